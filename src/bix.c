@@ -0,0 +1,558 @@
+#include "bix.h"
+
+#  define min(_a, _b) \
+     ((_a) > (_b) ? (_b) : (_a))
+
+
+/* Fixed-width integers, stored low-order byte first.  A long too small for an
+   eight-byte number gets just its low-order bytes. */
+
+void bix_put32(unsigned char * out, unsigned long v) {
+
+  /* Store v in the four bytes at out. */
+
+  int i;
+
+  for (i = 0; i < 4; i++, v >>= 8) out[i] = (unsigned char) (v & 0xff);
+
+  } /* bix_put32 */
+
+
+
+void bix_put64(unsigned char * out, unsigned long v) {
+
+  /* Store v in the eight bytes at out. */
+
+  int i;
+
+  for (i = 0; i < 8; i++, v >>= 8) out[i] = (unsigned char) (v & 0xff);
+
+  } /* bix_put64 */
+
+
+
+long bix_get64(const unsigned char * in) {
+
+  /* Return the number stored in the eight bytes at in. */
+
+  unsigned long v = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--) v = (v << 8) | in[i];
+
+  return (long) v;
+
+  } /* bix_get64 */
+
+
+
+unsigned long bix_hash(unsigned long h, const unsigned char * p, long n) {
+
+  /* Return the 32-bit FNV-1a hash of the n bytes at p, carrying on from h
+     (BIX_HASH_INIT to start). */
+
+  for (; n > 0; n--, p++) h = ((h ^ *p)*16777619UL) & 0xffffffffUL;
+
+  return h;
+
+  } /* bix_hash */
+
+
+
+/* Variable-byte integers.  A value is stored seven bits to a byte, low-order
+   bits first; every byte but the last has its high bit set. */
+
+int bix_put_varint(unsigned char * out, unsigned long v) {
+
+  /* Store v at out and return the number of bytes used.  If out is null, just
+     return the number of bytes that would be used. */
+
+  int n = 1;
+
+  while (v >= 0x80) {
+    if (out != NULL) *out++ = (unsigned char) (v | 0x80);
+    v >>= 7;
+    n++;
+    }
+  if (out != NULL) *out = (unsigned char) v;
+
+  return n;
+
+  } /* bix_put_varint */
+
+
+
+const unsigned char * bix_get_varint(
+  const unsigned char * in, unsigned long * v) {
+
+  /* Store in *v the value stored at in; return a pointer to the byte after the
+     value. */
+
+  unsigned long r = 0;
+  int shift = 0;
+
+  while (*in & 0x80) {
+    r |= ((unsigned long) (*in++ & 0x7f)) << shift;
+    shift += 7;
+    }
+  *v = r | (((unsigned long) *in++) << shift);
+
+  return in;
+
+  } /* bix_get_varint */
+
+
+
+/* Entry lists.  An entry list is a strictly increasing list of entry numbers,
+   stored as the gaps between successive entries less one (the first entry is
+   taken to follow entry -1).  The gaps are grouped into blocks of BIX_BLOCK
+   entries.  A list of more than one block starts with a skip table so a
+   cursor can jump over blocks without decoding them:
+
+	length of the skip table in bytes
+	array of			-- one per block
+	    last entry in the block, less the previous block's last entry
+	    length of the block in bytes
+	array of blocks
+
+   All the numbers are variable-byte integers. */
+
+static int encode_block(
+  unsigned char * out, const int * refs, int from, int to, int prev) {
+
+  /* Encode refs[from..to) following the entry prev into out; return the
+     number of bytes used.  If out is null, just return the size. */
+
+  int n = 0;
+
+  for (; from < to; prev = refs[from++])
+    n += bix_put_varint(out ? out + n : NULL, refs[from] - prev - 1);
+
+  return n;
+
+  } /* encode_block */
+
+
+
+int bix_encode_refs(unsigned char * out, const int * refs, int count) {
+
+  /* Encode the count entries in refs into out; return the number of bytes
+     used.  If out is null, just return the size. */
+
+  const int blocks = (count + BIX_BLOCK - 1)/BIX_BLOCK;
+  int b, n, skipsize, prev;
+
+  skipsize = 0;
+  if (blocks > 1) {
+    for (b = 0, prev = -1; b < blocks; b++) {
+      const int to = min((b + 1)*BIX_BLOCK, count);
+
+      skipsize += bix_put_varint(NULL, refs[to - 1] - prev);
+      skipsize += bix_put_varint(NULL,
+				 encode_block(NULL, refs, b*BIX_BLOCK, to, prev));
+      prev = refs[to - 1];
+      }
+    n = bix_put_varint(out, skipsize);
+    for (b = 0, prev = -1; b < blocks; b++) {
+      const int to = min((b + 1)*BIX_BLOCK, count);
+
+      n += bix_put_varint(out ? out + n : NULL, refs[to - 1] - prev);
+      n += bix_put_varint(out ? out + n : NULL,
+			  encode_block(NULL, refs, b*BIX_BLOCK, to, prev));
+      prev = refs[to - 1];
+      }
+    }
+  else n = 0;
+
+  for (b = 0, prev = -1; b < blocks; b++) {
+    const int to = min((b + 1)*BIX_BLOCK, count);
+
+    n += encode_block(out ? out + n : NULL, refs, b*BIX_BLOCK, to, prev);
+    prev = refs[to - 1];
+    }
+
+  return n;
+
+  } /* bix_encode_refs */
+
+
+
+static void next_skip(Bix_cursor * c) {
+
+  /* Read the skip-table entry for the cursor's current block. */
+
+  unsigned long d, bytes;
+
+  c->skip = bix_get_varint(bix_get_varint(c->skip, &d), &bytes);
+  c->last += d;
+  c->bytes = bytes;
+
+  } /* next_skip */
+
+
+
+void bix_open_refs(Bix_cursor * c, const unsigned char * list, int count) {
+
+  /* Set c to the start of the count-entry list stored at list. */
+
+  c->count = count;
+  c->blocks = (count + BIX_BLOCK - 1)/BIX_BLOCK;
+  c->block = 0;
+  c->left = min(count, BIX_BLOCK);
+  c->value = c->last = -1;
+
+  if (c->blocks > 1) {
+    unsigned long skipsize;
+
+    c->skip = bix_get_varint(list, &skipsize);
+    c->start = c->p = c->skip + skipsize;
+    next_skip(c);
+    }
+  else {
+    c->skip = NULL;
+    c->start = c->p = list;
+    c->bytes = 0;
+    }
+
+  } /* bix_open_refs */
+
+
+
+static void next_block(Bix_cursor * c) {
+
+  /* Move c to the start of the next block, skipping whatever's left of the
+     current block. */
+
+  c->value = c->last;
+  c->start += c->bytes;
+  c->p = c->start;
+  c->block++;
+  c->left = min(c->count - c->block*BIX_BLOCK, BIX_BLOCK);
+  next_skip(c);
+
+  } /* next_block */
+
+
+
+bool bix_next_ref(Bix_cursor * c) {
+
+  /* Move c to the next entry in the list; return false if there isn't one. */
+
+  unsigned long gap;
+
+  if (c->left == 0) {
+    if (c->block + 1 >= c->blocks) return false;
+    next_block(c);
+    }
+
+  c->p = bix_get_varint(c->p, &gap);
+  c->value += gap + 1;
+  c->left--;
+
+  return true;
+
+  } /* bix_next_ref */
+
+
+
+bool bix_seek_ref(Bix_cursor * c, int target) {
+
+  /* Move c to the first entry at or after its current entry that's no less
+     than target; return false if there isn't one. */
+
+  if (target < 0) target = 0;
+  while ((c->block + 1 < c->blocks) && (c->last < target)) next_block(c);
+  while (c->value < target)
+    if (!bix_next_ref(c)) return false;
+
+  return true;
+
+  } /* bix_seek_ref */
+
+
+
+/* Dictionaries. */
+
+int bix_encode_word(
+  unsigned char * out, const char * prev, const char * word, int numrefs,
+  int refsize) {
+
+  /* Encode word, which follows prev in its dictionary block (prev is null
+     for the block's first word), along with the count and size of its entry
+     list; return the number of bytes used.  If word is null, encode just the
+     count and size.  If out is null, just return the size. */
+
+  int shared = 0, rest, n;
+
+  if (word == NULL) {
+    n = bix_put_varint(out, numrefs);
+    return n + bix_put_varint(out ? out + n : NULL, refsize);
+    }
+
+  if (prev != NULL)
+    while (prev[shared] && (prev[shared] == word[shared])) shared++;
+  rest = strlen(word + shared);
+  assert((shared < 256) && (rest < 256));
+
+  if (out != NULL) {
+    out[0] = shared;
+    out[1] = rest;
+    memcpy((char *) out + 2, word + shared, rest);
+    }
+  n = 2 + rest;
+  n += bix_put_varint(out ? out + n : NULL, numrefs);
+  n += bix_put_varint(out ? out + n : NULL, refsize);
+
+  return n;
+
+  } /* bix_encode_word */
+
+
+
+static bool next_in_block(Bix_dict * d) {
+
+  /* Decode the next word in d's current block; return false if the block's
+     run out. */
+
+  unsigned long v;
+  int shared, rest;
+
+  if (d->left == 0) return false;
+
+  if (!d->words) shared = rest = 0;
+  else {
+    shared = d->p[0];
+    rest = d->p[1];
+    d->p += 2;
+    }
+  if (shared + rest > MAXWORD) {
+    d->left = 0;
+    return false;
+    }
+  memcpy(d->word + shared, (const char *) d->p, rest);
+  d->word[shared + rest] = eos;
+  d->p += rest;
+
+  d->refs += d->refsize;
+  d->p = bix_get_varint(d->p, &v);
+  d->numrefs = v;
+  d->p = bix_get_varint(d->p, &v);
+  d->refsize = v;
+  d->left--;
+
+  return true;
+
+  } /* next_in_block */
+
+
+
+static bool start_block(Bix_dict * d, int b) {
+
+  /* Make b the current block of d and decode its first word; return false if
+     there is no block b. */
+
+  long data;
+
+  if ((b < 0) || (b*BIX_DICT_BLOCK >= d->numwords)) return false;
+  data = bix_get32(d->blocks[b].data);
+  if ((data < 0) || (data >= d->dictsize)) return false;
+
+  d->block = b;
+  d->left = min(d->numwords - b*BIX_DICT_BLOCK, BIX_DICT_BLOCK);
+  d->p = d->dict + data;
+  d->refs = bix_get32(d->blocks[b].refs);
+  d->refsize = 0;
+
+  return next_in_block(d);
+
+  } /* start_block */
+
+
+
+void bix_open_dict(
+  Bix_dict * d, const Bix_dblock * blocks, const unsigned char * dict,
+  int dictsize, int numwords, bool words) {
+
+  /* Set d to the start of the numwords-word dictionary whose blocks are given
+     in blocks; the blocks' data is in the dictsize-byte area dict, and has
+     the words themselves if words is true.  There is no current word until d
+     is moved. */
+
+  d->blocks = blocks;
+  d->dict = dict;
+  d->words = words;
+  d->word[0] = eos;
+  d->dictsize = dictsize;
+  d->numwords = numwords;
+  d->block = -1;
+  d->left = 0;
+
+  } /* bix_open_dict */
+
+
+
+bool bix_next_word(Bix_dict * d) {
+
+  /* Move d to the next word in its dictionary; return false if there isn't
+     one. */
+
+  return next_in_block(d) || start_block(d, d->block + 1);
+
+  } /* bix_next_word */
+
+
+
+static int compare_lead(const char * word, const unsigned char * lead) {
+
+  /* Return strcmp(word, w), where w is the word leading the dictionary block
+     starting at lead. */
+
+  const int len = lead[1], wlen = strlen(word);
+  const int c = memcmp(word, (const char *) lead + 2, min(len, wlen));
+
+  return (c ? c : wlen - len);
+
+  } /* compare_lead */
+
+
+
+bool bix_seek_word(Bix_dict * d, const char * word) {
+
+  /* Move d to the first word in its dictionary no less than word; return
+     false if there isn't one.  The blocks' leading words are binary searched
+     for the block that could hold word, which is then searched from the
+     front. */
+
+  int lo, hi;
+
+  lo = 0;
+  hi = (d->numwords + BIX_DICT_BLOCK - 1)/BIX_DICT_BLOCK - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1)/2;
+    const long data = bix_get32(d->blocks[mid].data);
+
+    if ((data < 0) || (data >= d->dictsize)) return false;
+    if (compare_lead(word, d->dict + data) < 0) hi = mid - 1;
+    else lo = mid;
+    }
+
+  if (!start_block(d, lo)) return false;
+  while (strcmp(d->word, word) < 0)
+    if (!bix_next_word(d)) return false;
+
+  return true;
+
+  } /* bix_seek_word */
+
+
+
+/* Terms.  In an index with a single term dictionary, a term's entry list is
+   preceded by
+
+	# fields containing the term
+	array of fields			-- increasing, as differences
+	length of the masks in bytes	-- only if more than one field
+	array of masks			-- one per entry, only if more than one
+					   field
+
+   A mask has one bit for each of the term's fields, the lowest for the first
+   field, and tells which of them hold the term in the entry.  Its bits are
+   stored seven to a byte, low-order bits first, in as few bytes as will hold
+   the highest bit set; every byte but the last has its high bit set.  All the
+   other numbers are variable-byte integers. */
+
+#  define mask_bit(_m, _i) \
+     ((_m)[(_i)/8] & (1 << ((_i) % 8)))
+
+static int encode_mask(unsigned char * out, const unsigned char * mask,
+		       int nbits) {
+
+  /* Encode the nbits-bit mask into out; return the number of bytes used.  If
+     out is null, just return the size. */
+
+  int n, i, top;
+
+  for (top = nbits; (top > 0) && !mask_bit(mask, top - 1); top--) { }
+
+  n = 0;
+  i = 0;
+  do {
+    int group = 0, b;
+
+    for (b = 0; (b < 7) && (i < top); b++, i++)
+      if (mask_bit(mask, i)) group |= 1 << b;
+    if (out != NULL) out[n] = group | (i < top ? 0x80 : 0);
+    n++;
+    } while (i < top);
+
+  return n;
+
+  } /* encode_mask */
+
+
+
+int bix_encode_term(
+  unsigned char * out, const int * fields, int nfields,
+  const unsigned char * masks, int masksize, const int * refs, int count) {
+
+  /* Encode the entry list of a term found in the nfields fields given in
+     fields, along with its masks, into out; return the number of bytes used.
+     The count entries are in refs, and the mask for refs[i] is the
+     (nfields + 7)/8 bytes at masks[i*((nfields + 7)/8)]; the masks take
+     masksize bytes encoded (see bix_mask_size()).  If out is null, just
+     return the size. */
+
+  const int stride = (nfields + 7)/8;
+  int i, n, prev;
+
+  n = bix_put_varint(out, nfields);
+  for (i = 0, prev = 0; i < nfields; prev = fields[i++])
+    n += bix_put_varint(out ? out + n : NULL, fields[i] - prev);
+
+  if (nfields > 1) {
+    n += bix_put_varint(out ? out + n : NULL, masksize);
+    if (out == NULL) n += masksize;
+    else
+      for (i = 0; i < count; i++)
+	n += encode_mask(out + n, masks + i*stride, nfields);
+    }
+
+  return n + bix_encode_refs(out ? out + n : NULL, refs, count);
+
+  } /* bix_encode_term */
+
+
+
+const unsigned char * bix_term_refs(const unsigned char * term) {
+
+  /* Return a pointer to the entry list of the term stored at term. */
+
+  unsigned long nfields, v, i;
+
+  term = bix_get_varint(term, &nfields);
+  for (i = 0; i < nfields; i++) term = bix_get_varint(term, &v);
+  if (nfields > 1) {
+    term = bix_get_varint(term, &v);
+    term += v;
+    }
+
+  return term;
+
+  } /* bix_term_refs */
+
+
+
+bool bix_seek_ordinal(Bix_dict * d, int ordinal) {
+
+  /* Move d to the word at the given position in its dictionary, counting
+     from 0; return false if there isn't one. */
+
+  int i;
+
+  if ((ordinal < 0) || !start_block(d, ordinal/BIX_DICT_BLOCK)) return false;
+  for (i = ordinal % BIX_DICT_BLOCK; i > 0; i--)
+    if (!next_in_block(d)) return false;
+
+  return true;
+
+  } /* bix_seek_ordinal */
@@ -0,0 +1,291 @@
+#ifndef _bix_h_defined_
+#define _bix_h_defined_
+
+#include "common.h"
+
+
+/* The binary part of an index file.  Everything after the text header is laid
+   out so btxlook can map the file and search it in place: each section starts
+   on a BIX_ALIGN boundary and holds either an array of fixed-size records or
+   a run of bytes (nul-terminated strings or compressed numbers).
+
+   The text header written with btxindex_header_fmt is followed by nul padding
+   up to the next BIX_ALIGN boundary.  There is always at least one nul, which
+   stops the header fscanf() before it can eat any of the binary part.  The
+   padding is followed by a Bix_preamble and then the section directory.
+
+   The binary part reads the same on every host.  The numbers in the records
+   are unsigned little-endian integers of four or eight bytes, kept as byte
+   arrays so the records have no padding, and are read and written with the
+   functions below. */
+
+#  define BIX_ALIGN 8
+
+/* Round _n up to the next BIX_ALIGN boundary. */
+
+#  define bix_align(_n) \
+     ((((long) (_n)) + BIX_ALIGN - 1) & ~((long) BIX_ALIGN - 1))
+
+/* Return the offset of the preamble given the text header is _hlen bytes
+   long. */
+
+#  define bix_start(_hlen) \
+     ((((long) (_hlen))/BIX_ALIGN + 1)*BIX_ALIGN)
+
+
+   typedef unsigned char Bix_u32[4], Bix_u64[8];
+
+/* Return the number stored in the Bix_u32 at _p. */
+
+#  define bix_get32(_p) \
+     ((long) ((unsigned long) (_p)[0] | ((unsigned long) (_p)[1] << 8) | \
+	      ((unsigned long) (_p)[2] << 16) | \
+	      ((unsigned long) (_p)[3] << 24)))
+
+
+/* Section ids.  A reader ignores sections it doesn't recognize. */
+
+   enum {
+     bix_entries,	/* Bix_block[], one per BIX_BLOCK entries */
+     bix_offsets,	/* unsigned char[], entry extents, see below */
+     bix_fields,	/* Bix_field[], sorted by field name */
+     bix_blocks,	/* Bix_dblock[], each field's dictionary blocks */
+     bix_dict,		/* unsigned char[], front-coded words, see below */
+     bix_strings,	/* char[], nul-terminated field names */
+     bix_refs,		/* unsigned char[], each word's entry list */
+     bix_terms,		/* Bix_field[], the single term dictionary, if any */
+     bix_fsa,		/* unsigned char[], dictionary automata, see fsa.c */
+     bix_roots,		/* Bix_u32[], each dictionary's automaton, if any */
+     bix_text,		/* unsigned char[], compressed entry text, if any */
+     bix_texts,		/* Bix_u32[], each entry block's text in bix_text */
+     bix_files,		/* Bix_file[], a collection's bib files, if any */
+     bix_segment,	/* Bix_segment, where the segment's entries go */
+     bix_hashes,	/* Bix_hash[], one per entry, if any */
+     bix_macros,	/* Bix_macro[], the bib file's string definitions */
+     bix_libraries,	/* Bix_library[], the string libraries read first */
+     bix_sections
+     };
+
+   typedef struct {
+     Bix_u64 mod_time;	/* the bib file's modification time */
+     Bix_u32 sections;	/* the number of Bix_sections following */
+     Bix_u32 entries;	/* the number of entries in the bib file */
+     } Bix_preamble;
+
+   typedef struct {
+     Bix_u32 id;
+     Bix_u32 unused;
+     Bix_u64 offset;	/* from the start of the index file */
+     Bix_u64 size;	/* in bytes */
+     } Bix_section;
+
+/* Each entry's extent in the bib file runs from its '@' through its closing
+   bracket.  A block's first entry starts at the block's offset; in
+   bix_offsets, each entry in the block is stored as the variable-byte gap
+   between the end of the entry before it and its start (omitted for the
+   first entry), followed by the variable-byte length of the entry. */
+
+   typedef struct {
+     Bix_u64 offset;	/* in the bib file of the block's first entry */
+     Bix_u32 data;	/* where the block's extents start in bix_offsets */
+     Bix_u32 unused;
+     } Bix_block;
+
+/* An index can cover a collection of bib files, described in bix_files in the
+   order their entries are numbered.  An entry's offset is its offset in its
+   bib file plus the file's base, the total size of the files before it, so
+   the entries' offsets still increase.  The preamble's modification time is
+   then the newest file's, and the header names the collection. */
+
+   typedef struct {
+     Bix_u32 name;	/* offset of the file's full path in bix_strings */
+     Bix_u32 first;	/* the file's first entry */
+     Bix_u64 base;	/* added to the offsets of the file's entries */
+     Bix_u64 mod_time;	/* the file's modification time */
+     } Bix_file;
+
+/* An index can also hold the entries' text, so the bib file needn't be read to
+   print them.  Each block of BIX_BLOCK entries has its entries' extents laid
+   end to end and compressed on its own (see lz.c); bix_texts gives the offset
+   of each block's compressed text in bix_text, and the block's text runs up
+   to the next block's. */
+
+/* An index is a sequence of segments, each a preamble, a section directory,
+   and sections.  The first segment indexes the whole bib file; each segment
+   after it replaces a run of the entries indexed before it (possibly none)
+   with the entries in its own sections, which are numbered from 0 and have
+   their offsets in the bib file as it was when the segment was added.  The
+   entries after the run keep their text but move by the change in the bib
+   file's size.  Each segment starts at the BIX_ALIGN boundary after the end
+   of the one before, and a segment whose sections don't all fit in the file
+   (because it was being added when the file was read) is ignored, as is
+   anything after it.  The last whole segment's preamble holds the bib file's
+   modification time. */
+
+   typedef struct {
+     Bix_u64 next;	/* where the next segment starts, if there is one */
+     Bix_u64 size;	/* the bib file's size */
+     Bix_u32 first;	/* the first entry replaced */
+     Bix_u32 replaced;	/* the number of entries replaced */
+     Bix_u32 gap;	/* the hash of the gap after the segment's entries */
+     Bix_u32 unused;
+     } Bix_segment;
+
+/* To find what's changed in the bib file, the index keeps a hash of each
+   entry's text and of the gap between it and the entry before it (or the
+   start of the file); a segment's gap is the text from the end of its last
+   entry (or where the replaced entries started) up to the next entry (or
+   the end of the file).  A gap hash has its low bit set if the gap might
+   define a string.  Hashes are bix_hash()es of the bytes. */
+
+#  define BIX_HASH_INIT 2166136261UL
+
+   typedef struct {
+     Bix_u32 text;
+     Bix_u32 gap;
+     } Bix_hash;
+
+/* The first segment also keeps the bib file's string definitions in the
+   order they're made, so entries can be reindexed without reading the rest of
+   the file.  A definition's value is as it was entered in the string table. */
+
+   typedef struct {
+     Bix_u32 entry;	/* the number of entries before the definition */
+     Bix_u32 name;	/* offset of the string's name in bix_strings */
+     Bix_u32 value;	/* offset of its value in bix_strings */
+     } Bix_macro;
+
+/* The first segment also names the string libraries (btxindex -l) read ahead
+   of the bib file, in order, so the index is rewritten rather than added to
+   when they aren't the same, and btxlook updates it with the same ones. */
+
+   typedef struct {
+     Bix_u32 name;	/* offset of the library's bib file in bix_strings */
+     Bix_u32 unused;
+     Bix_u64 mod_time;	/* the library's modification time */
+     } Bix_library;
+
+   typedef struct {
+     Bix_u32 name;	/* offset of the field name in bix_strings */
+     Bix_u32 first;	/* index of the field's first block in bix_blocks */
+     Bix_u32 numwords;
+     } Bix_field;
+
+
+/* A field's dictionary is its words in strcmp() order, split into blocks of
+   BIX_DICT_BLOCK words.  Within a block each word is stored as
+
+	length of the prefix shared with the previous word	-- one byte
+	length of the rest of the word				-- one byte
+	the rest of the word
+	# entries in the word's entry list			-- varint
+	size of the word's entry list in bytes			-- varint
+
+   The first word in a block shares nothing with its predecessor, so the
+   blocks' leading words can be binary searched in place.  A block's entry
+   lists follow one another in bix_refs.
+
+   An index normally has a dictionary for each field, and bix_terms is empty.
+   An index can instead have a single dictionary of terms, described by the
+   one record in bix_terms (the fields in bix_fields then have no words, and
+   the record's name is unused).  Each term's entry list is the union of the
+   term's entry lists in every field, headed by field masks (see bix.c).
+
+   An index can also have an automaton for each dictionary, accepting the
+   dictionary's words and giving each word's position in the dictionary.  The
+   automata are stored one after the other in bix_fsa; bix_roots gives the
+   offset of each one's start state, in the order of the dictionaries.  The
+   dictionaries of such an index don't store their words; each entry in a
+   block is just the count and size of the word's entry list. */
+
+#  define BIX_DICT_BLOCK 16
+
+   typedef struct {
+     Bix_u32 data;	/* offset of the block in bix_dict */
+     Bix_u32 refs;	/* offset of the block's first entry list in bix_refs */
+     } Bix_dblock;
+
+/* Words are read with a dictionary cursor.  The cursor's current word is in
+   word, and its entry list is at offset refs in bix_refs. */
+
+   typedef struct {
+     const Bix_dblock    * blocks;
+     const unsigned char * dict;
+     bool                  words;	/* does the dictionary store words? */
+     int                   dictsize,
+                           numwords,
+                           block,	/* the current block */
+                           left,	/* words left in the current block */
+                           refs,
+                           numrefs,
+                           refsize;
+     const unsigned char * p;		/* the next word in the block */
+     char                  word[MAXWORD + 1];
+     } Bix_dict;
+
+
+/* Entry lists are compressed in blocks of BIX_BLOCK entries (see bix.c), and
+   are read with a cursor.  The cursor's current entry is in value. */
+
+#  define BIX_BLOCK 128
+
+/* The most bytes bix_encode_refs() takes for a list of _n entries: a
+   variable-byte integer, at most five bytes, per entry and two per block, and
+   the skip table's length.  bix_encode_term() takes at most
+   bix_term_bound(_f) bytes more for a term in _f fields, besides its masks; a
+   mask whose highest bit set is bit _top - 1 takes bix_mask_size(_top)
+   bytes. */
+
+#  define bix_refs_bound(_n) \
+     (5*((_n) + 2*(((_n) + BIX_BLOCK - 1)/BIX_BLOCK) + 1))
+#  define bix_term_bound(_f) \
+     (5*((_f) + 2))
+#  define bix_mask_size(_top) \
+     ((_top) > 7 ? ((_top) + 6)/7 : 1)
+
+   typedef struct {
+     const unsigned char
+       * p,		/* the next entry in the current block */
+       * start,		/* the start of the current block */
+       * skip;		/* the skip-table entry for the next block */
+     int count,		/* entries in the list */
+         blocks,	/* blocks in the list */
+         block,		/* the current block */
+         left,		/* entries left in the current block */
+         bytes,		/* size of the current block */
+         last,		/* the last entry in the current block */
+         value;
+     } Bix_cursor;
+
+   extern int
+     bix_put_varint(unsigned char *, unsigned long),
+     bix_encode_refs(unsigned char *, const int *, int),
+     bix_encode_word(unsigned char *, const char *, const char *, int, int),
+     bix_encode_term(unsigned char *, const int *, int, const unsigned char *,
+		     int, const int *, int);
+
+   extern long
+     bix_get64(const unsigned char *);
+
+   extern unsigned long
+     bix_hash(unsigned long, const unsigned char *, long);
+
+   extern const unsigned char
+     * bix_get_varint(const unsigned char *, unsigned long *),
+     * bix_term_refs(const unsigned char *);
+
+   extern void
+     bix_put32(unsigned char *, unsigned long),
+     bix_put64(unsigned char *, unsigned long),
+     bix_open_refs(Bix_cursor *, const unsigned char *, int),
+     bix_open_dict(Bix_dict *, const Bix_dblock *, const unsigned char *, int,
+		   int, bool);
+
+   extern bool
+     bix_next_ref(Bix_cursor *),
+     bix_seek_ref(Bix_cursor *, int),
+     bix_next_word(Bix_dict *),
+     bix_seek_word(Bix_dict *, const char *),
+     bix_seek_ordinal(Bix_dict *, int);
+
+#endif
@@ -6,8 +6,14 @@
 
 # define max_word_size 256
 
+/* How a query word matches: exactly, as a prefix (word*), or within a few
+   edits (word~). */
+
+  enum { match_exact, match_prefix, match_near };
+
   typedef struct {
     char word[max_word_size];
+    int  mode;
     bool matched;
     }  Match_word, * match_word;
 
@@ -27,22 +27,65 @@
    allocated on the fly.
 
    The entry lists associated with each word are implemented as extendible
-   arrays.  Initially, each list holds eight entries.  If a new entry is
-   inserted into a full list, the list is doubled first.
+   arrays.  A list's first FEW_REFS (two) entries are kept in its table entry
+   itself; a longer list lives in the reference list pool, a power of two
+   entries long, and is moved to twice the space when it's full.
 
    The index file has the following format (loosely):
 
-	version info
-	# entries
-	array of offsets into bib file	-- one per entry
-	# field types
-	array of field names		-- one per field type
-	array of			-- one per field type
-	    # words
-	    array of			-- one per word
-		word			-- in alphabetical order
-		# locations
-		array of entry #s	-- one per location
+	version info			-- text, nul padded
+	bib file modification time, # entries
+	section directory
+	entries section			-- one per block of entries
+	    offset into bib file of the first entry in the block
+	offsets section			-- entry extents within blocks
+	    gap from the previous entry, length
+	fields section			-- one per field type, sorted by name
+	    name, first block, # words
+	blocks section			-- one per block of words, by field
+	    first word, first entry list
+	dict section			-- front-coded words
+	    shared prefix, suffix, # locations, entry list size
+	strings section			-- field names
+	refs section			-- compressed entry lists
+	terms section			-- the term dictionary, with -t
+	    first block, # words
+	fsa section			-- dictionary automata, with -a
+	roots section			-- each automaton's start state
+	text section			-- compressed entry text, with -e
+	texts section			-- each block of entries' text
+	files section			-- a collection's bib files, with -c
+	    name, first entry, base offset, modification time
+	segment section			-- where the next segment goes
+	    bib file size, entries replaced, gap after the last entry
+	hashes section			-- each entry's text and gap hashes
+	macros section			-- the string definitions
+	    entry before, name, value
+	libraries section		-- the string libraries, with -l
+	    name, modification time
+
+   Each field's words are in alphabetical order, in blocks of sixteen.  Each
+   word after the first in a block stores only what differs from the word
+   before it, and the blocks' first words are binary searched.  With -a, the
+   words are instead kept in a minimal automaton for each dictionary (see
+   fsa.c), which maps each word to its position in the dictionary, and the
+   blocks hold just the entry list counts and sizes.
+
+   The sections are aligned arrays of fixed-size records or bytes (see
+   bix.h), so btxlook can map the index file and search it without reading it
+   in.  An entry list stores the differences between successive entry numbers
+   as variable-byte integers, in blocks headed by a skip table (see bix.c);
+   btxlook decodes the lists it needs as it searches.  With -e, the entries'
+   text is kept in the index too, compressed a block of entries at a time
+   (see lz.c), and btxlook prints entries without reading the bib file.
+
+   What follows the version info is the index's first segment.  With -i, a
+   changed bib file's entries are compared with the hashes kept in the index,
+   and the ones that changed are indexed on their own and added to the end of
+   the index file as another segment, which replaces a run of the entries
+   before it.  btxlook searches every segment, dropping entries replaced by
+   later ones.  Once there are too many segments, or they hold too many of
+   the entries, or a string definition changes, the index is rebuilt whole.
 
    There are advantages and disadvantages of having multiple hash tables
    instead of a single table.  I am starting with the premise that the lookup
@@ -59,15 +102,35 @@
    less than two field types.  The bitmask approach would also require
    knowledge of the field names in advance; the multiple table approach does
    not.
+
+   Since queries don't name fields, though, btxlook ends up searching every
+   field table for every word.  With -t, btxindex writes a single table
+   anyway.  The bitmasks are kept small by giving each word its own list of
+   the fields it appears in, and masking each entry against that list; a word
+   found in only one field needs no masks at all.
 */
 
+/* fileno(), ftruncate() and getopt() are only declared under -ansi if POSIX
+   is asked for. */
+
+#define _XOPEN_SOURCE 500
+
 #include "common.h"
+#include "bix.h"
+#include "fsa.h"
+#include "lz.h"
 #include "string-table.h"
 #include <time.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 static long line_number = 1L;		/* for debug messages */
 static long initial_line_number = 1L;
+static FILE * messages;			/* where parse messages go */
+static long item_start, item_end;	/* where the entries and string
+					   definitions parsed start and end */
 
 
 #define loop while (1)
@@ -120,15 +183,20 @@ static long initial_line_number = 1L;
 	 while (*_sp) addchar_sbuff(*_sp++); } while (0)
 
 
-/* Character input macros. */
+/* Character input macros.  The bib file is scanned in memory, from input up
+   to input_end; each character read is folded through fold.  Characters
+   added to the string buffer in runs are mapped through wordchar, which
+   folds them as addchar_sbuff() would. */
 
-   static char buffer;
+   static const unsigned char * input, * input_end;
+   static char buffer, fold[256], wordchar[256];
    static int line_no, char_no;
 
-/* Initialize the character input routines. */
+/* Initialize the character input routines to read the _n characters at _p. */
 
-#  define init_char() \
-     do { line_no = char_no = 0; } while (0)
+#  define init_char(_p, _n) \
+     do { line_no = char_no = 0; input = (_p); input_end = input + (_n); \
+	  if (!fold[' ']) init_fold(); } while (0)
         
 /* Get the current character. */
 
@@ -138,10 +206,10 @@ static long initial_line_number = 1L;
 
 #  define eof_char() (current_char() == 0)
 
-/* Read a character from _f; on eof, store a zero. */
+/* Read the next character; at the end of the input, store a zero. */
 
-#  define _fillbuffer_char(_f) \
-     do {int _i = fgetc(_f); current_char() = (_i == EOF ? 0 : _i);} while (0)
+#  define _fillbuffer_char() \
+     do current_char() = (input < input_end ? *input++ : 0); while (0)
 
 /* Advance the current charcter.  Letters should be folded to lower case; keep
    track of line numbers; and all white space characters should be folded to a
@@ -149,11 +217,9 @@ static long initial_line_number = 1L;
 
 #  define _advance_char() \
     do {char_no++; \
-	_fillbuffer_char(fid); \
-	if (isupper(current_char())) \
-          current_char() = tolower(current_char()); \
-	else {if (current_char() == '\n') line_no++; \
-	      if (isspace(current_char())) current_char() = ' '; } } while (0)
+	_fillbuffer_char(); \
+	if (current_char() == '\n') line_no++; \
+	current_char() = fold[(unsigned char) current_char()]; } while (0)
 
 /* Advance the current character.  If the new current character is the start of
    a tex control sequence, skip over it.  A control sequence is a back slash
@@ -168,13 +234,29 @@ static long initial_line_number = 1L;
 	  if (!isalpha(current_char())) _advance_char(); \
 	  else do _advance_char(); \
 	       while (isalpha(current_char())); \
-	  while (isspace(current_char())) _advance_char(); } } while (0)
+	  while (current_char() == ' ') _advance_char(); } } while (0)
 
 /* Advance the current char to the next non-white space character.  */
 
 #  define skipwhite_char() \
      while (current_char() == ' ') advance_char()
 
+/* Runs of characters are scanned a long at a time.  zero_bytes() leaves the
+   high bit set in each byte of _v that's zero, and only in those; xoring _v
+   with a byte repeated by repeat_byte() first finds that byte instead. */
+
+#  define ONES ((unsigned long) -1/0xff)
+#  define LOWS (ONES*0x7f)
+
+#  define repeat_byte(_b) \
+     (ONES*(unsigned char) (_b))
+
+#  define zero_bytes(_v) \
+     (~((((_v) & LOWS) + LOWS) | (_v) | LOWS))
+
+#  define count_bytes(_z) \
+     (((((_z) >> 7)*ONES) >> (8*(sizeof(unsigned long) - 1))) & 0xff)
+
  
 /* Sundries. */
 
@@ -185,7 +267,7 @@ static long initial_line_number = 1L;
      ((_a) > (_b) ? (_b) : (_a))
 
 #  define vrbg(_v, _w, _m, _a, _b) \
-     verbage(_v, (stderr, #_w " in %s at line %d:%s  " _m ".\n", fname, \
+     verbage(_v, (messages, #_w " in %s at line %d:%s  " _m ".\n", fname, \
 		  line_no, (strlen(fname) + strlen(_m) > 50 ? "\n" : ""), _a,_b))
 
 #  define emsg2(_m, _a, _b) \
@@ -203,6 +285,7 @@ static long initial_line_number = 1L;
 typedef struct {
   sblock bib_dirs;
   sblock bib_files;
+  sblock libraries;
   char * bix_dir;
   } Arguments, * arguments;
 
@@ -255,9 +338,14 @@ void *safemalloc(unsigned howmuch, const char *msg1, const char *msg2)
    size is always a power of two, the secondary hash value has to be
    odd to avoid loops.
 
-   The field tables are non-extendible hash tables, otherwise handled
-   the same way.  It is probably well worth the effort to fine tune
-   the field table hash function in order to avoid collisions.
+   The field tables themselves are kept in an array that grows as
+   fields are found, so a field is known by its index there, its
+   field id.  The field ids are found by name in a small hash table
+   using linear probing, which keeps each name's hash to compare
+   before the name.
+
+   The cells hold term numbers rather than words (see TERMS below),
+   and are hashed the same way by term number.
 
    The field tables associated with ignored fields are black holes.
    Everything is the same, except that InsertEntry doesn't actually
@@ -265,34 +353,550 @@ void *safemalloc(unsigned howmuch, const char *msg1, const char *msg2)
 
 \* ================================================================= */
 
-#define MAXFIELDS	64	 	/* intentionally way too much */
-
 #define INIT_HASH_SIZE	256
 #define HASH_CONST   	1482907		/* prime close to 2^{20.5} */
 
 typedef char Word[MAXWORD+1];
 
+#define FEW_REFS	2		/* references kept in the cell itself */
+
 typedef struct		/* Hash table entry */
 {
-    Word   theword;	/* the hashed word */
+    int    term;	/* the hashed word's term number */
     int    number;	/* number of references in the list */
     int    size;	/* real size of reference list */
-    int   *refs;	/* actual list of references */
+    union {
+      int *list;	/* actual list of references, or */
+      int  few[FEW_REFS];	/* the list itself, if size is FEW_REFS */
+    }      refs;
 } HashCell, *HashPtr;
 
+/* The cell's list of references. */
+
+#define cell_refs(_c) \
+  ((_c)->size > FEW_REFS ? (_c)->refs.list : (_c)->refs.few)
+
 typedef struct		/* Extendiable hash table */
 {
     Word    thefield;	/* the field type */
     int     number;	/* number of words in the hash table */
     int     size;	/* real size of the hash table */
     HashPtr words;	/* the actual hash table */
-    bool    visited;	/* when looking for open slots. */
+    unsigned long
+	    hash;	/* the field type's hash */
 } ExHashTable;
 
-static ExHashTable fieldtable[MAXFIELDS];	/* the field tables */
-static char        numfields;			/* number of fields */
+static ExHashTable *fieldtable = NULL;	/* the field tables, by field id */
+static int numfields = 0, fieldspace = 0;
+static int *fieldids = NULL;		/* field ids plus 1, by name; 0 if
+					   empty */
+static int fieldidsize = 0;
+
+
+/* ======================== REFERENCE LIST POOL ==================== *\
+
+   The reference lists longer than FEW_REFS are carved out of big
+   blocks rather than malloc()ed one by one, and are all freed at
+   once, with the field tables; so is the terms' text.  Lists are
+   always a power of two long; a list that outgrows its space is
+   copied to one twice as long, and the old space goes on a free
+   list for the next list of its size.
+
+\* ================================================================= */
+
+#define POOL_BLOCK	(1 << 18)	/* bytes in a pool block */
+#define POOL_SIZES	32		/* the lists' log2 sizes */
+
+static char **poolblocks = NULL;	/* the blocks allocated */
+static int numpoolblocks = 0, poolblockspace = 0;
+static int *poolnext = NULL;		/* the unused part of the last block */
+static int poolleft = 0;		/* ints in it */
+static long poolbytes = 0;		/* bytes in all the blocks */
+static int *poolfree[POOL_SIZES];	/* the free lists, by log2 size */
+
+/* ----------------------------------------------------------------- *\
+|  int PoolSize(int size)
+|
+|  Return log2 of size, a power of two.
+\* ----------------------------------------------------------------- */
+static int PoolSize(int size)
+{
+    int i;
+
+    for (i = 0; (1 << i) < size; i++) { }
+
+    return i;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void *PoolBlock(unsigned size)
+|
+|  Return a new block of size bytes, freed by FreePool().
+\* ----------------------------------------------------------------- */
+static void *PoolBlock(unsigned size)
+{
+    if (numpoolblocks == poolblockspace) {
+      char **old = poolblocks;
+
+      poolblockspace = max(2*poolblockspace, 16);
+      poolblocks = (char **) safemalloc(poolblockspace*sizeof(char *),
+					"Can't extend the pool", "");
+      if (old) {
+	memcpy((char *) poolblocks, (char *) old,
+	       numpoolblocks*sizeof(char *));
+	free(old);
+	}
+      }
+
+    poolbytes += size;
+    return poolblocks[numpoolblocks++] =
+      (char *) safemalloc(size, "Can't extend the pool", "");
+}
+
+/* ----------------------------------------------------------------- *\
+|  int *PoolRefs(int size)
+|
+|  Return space for a list of size references, a power of two more
+|  than FEW_REFS.
+\* ----------------------------------------------------------------- */
+static int *PoolRefs(int size)
+{
+    const int i = PoolSize(size);
+    int *refs;
+
+    if (poolfree[i]) {
+      refs = poolfree[i];
+      memcpy((char *) (poolfree + i), (char *) refs, sizeof(int *));
+      }
+    else if (size*sizeof(int) > POOL_BLOCK/4)
+      refs = (int *) PoolBlock(size*sizeof(int));
+    else {
+      if (poolleft < size) {
+	poolnext = (int *) PoolBlock(POOL_BLOCK);
+	poolleft = POOL_BLOCK/sizeof(int);
+	}
+      refs = poolnext;
+      poolnext += size;
+      poolleft -= size;
+      }
+
+    return refs;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void UnpoolRefs(int *refs, int size)
+|
+|  Put the space for a list of size references at refs on its free
+|  list.
+\* ----------------------------------------------------------------- */
+static void UnpoolRefs(int *refs, int size)
+{
+    const int i = PoolSize(size);
+
+    memcpy((char *) refs, (char *) (poolfree + i), sizeof(int *));
+    poolfree[i] = refs;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void FreePool(void)
+|
+|  Free all of the reference lists.
+\* ----------------------------------------------------------------- */
+static void FreePool(void)
+{
+    int i;
+
+    while (numpoolblocks > 0) free(poolblocks[--numpoolblocks]);
+    poolnext = NULL;
+    poolleft = 0;
+    poolbytes = 0;
+    for (i = 0; i < POOL_SIZES; i++) poolfree[i] = NULL;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void GrowRefs(HashPtr cell, int n)
+|
+|  Make room for n more references in the cell's list.
+\* ----------------------------------------------------------------- */
+static void GrowRefs(HashPtr cell, int n)
+{
+    int size = cell->size, *newlist;
+
+    if (cell->number + n <= size) return;
+
+    while (cell->number + n > size) size *= 2;
+    newlist = PoolRefs(size);
+    memcpy((char *) newlist, (char *) cell_refs(cell),
+	   cell->number*sizeof(int));
+    if (cell->size > FEW_REFS) UnpoolRefs(cell->refs.list, cell->size);
+    cell->refs.list = newlist;
+    cell->size = size;
+}
 
 
+
+
+/* ============================= TERMS ============================= *\
+
+   Each word indexed is kept once, whatever fields it's in, and the
+   field tables' cells refer to it by its term number.  The words'
+   text is carved out of pool blocks.  Term 0 is the empty word,
+   which marks an empty cell.
+
+   The term table finds a word's term number.  It's an open
+   addressing table whose slots come in groups of sizeof(long), each
+   group with a long of control bytes: a byte is zero if its slot is
+   empty, and otherwise holds the high seven bits of the slot's
+   word's hash, plus 0x80.  A word's hash picks its first group, and
+   the groups after are tried at growing distances.  Each group's
+   slots are checked a long at a time, the same way the scanner looks
+   for characters; only slots whose byte matches have their term's
+   hash, which is kept with the term, and then its word compared.  A
+   word not in a group having an empty slot isn't in the table; it's
+   put in the first such group's first empty slot.  The table
+   doubles when it's seven eighths full, rehashing with the kept
+   hashes.
+
+\* ================================================================= */
+
+#define TERM_GROUP	((int) sizeof(unsigned long))	/* slots a group */
+
+static char **termtext = NULL;		/* each term's word */
+static unsigned long *termhash = NULL;	/* and the word's hash */
+static int termcount = 0, termspace = 0;
+static unsigned long *termctrl = NULL;	/* each group's control bytes */
+static int *termslots = NULL;		/* the slots' term numbers */
+static int termgroups = 0;
+static char *textnext = NULL;		/* the unused part of the last block */
+static int textleft = 0;		/* bytes in it */
+
+/* The word with the given term number. */
+
+#define term_text(_t) \
+  (termtext[_t])
+
+/* The control byte for a word with hash _h. */
+
+#define term_tag(_h) \
+  (0x80 | ((_h) >> 25))
+
+/* The first high bit set in _z, a word of zero_bytes(), as a slot number
+   in its group. */
+
+#define first_slot(_z) \
+  ((int) count_bytes((((_z) & (~(_z) + 1)) - 1) & ~LOWS))
+
+/* ----------------------------------------------------------------- *\
+|  void PutTerm(unsigned long hash, int term)
+|
+|  Put term, with the given hash, in the first empty slot it can go
+|  in.
+\* ----------------------------------------------------------------- */
+static void PutTerm(unsigned long hash, int term)
+{
+    int g = hash & (termgroups - 1), step = 0, k;
+    unsigned long z;
+
+    while (!(z = zero_bytes(termctrl[g])))
+      g = (g + ++step) & (termgroups - 1);
+
+    k = first_slot(z);
+    termctrl[g] |= (unsigned long) term_tag(hash) << (8*k);
+    termslots[g*TERM_GROUP + k] = term;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void ExtendTerms(void)
+|
+|  Double the size of the term table and rehash everything.
+\* ----------------------------------------------------------------- */
+static void ExtendTerms(void)
+{
+    int oldgroups = termgroups, *oldslots = termslots, i;
+    unsigned long *oldctrl = termctrl;
+
+    termgroups = oldgroups ? 2*oldgroups : INIT_HASH_SIZE/TERM_GROUP;
+    termctrl = (unsigned long *) safemalloc(termgroups*sizeof(unsigned long),
+					    "Can't extend term table", "");
+    termslots = (int *) safemalloc(termgroups*TERM_GROUP*sizeof(int),
+				   "Can't extend term table", "");
+    memset((char *) termctrl, 0, termgroups*sizeof(unsigned long));
+
+    for (i = 0; i < oldgroups*TERM_GROUP; i++)
+      if ((oldctrl[i/TERM_GROUP] >> (8*(i % TERM_GROUP))) & 0xff)
+	PutTerm(termhash[oldslots[i]], oldslots[i]);
+
+    if (oldctrl) {
+      free(oldctrl);
+      free(oldslots);
+      }
+}
+
+/* ----------------------------------------------------------------- *\
+|  int GetTerm(const char *word)
+|
+|  Return the term number of the word, giving it one if it doesn't
+|  have one.
+\* ----------------------------------------------------------------- */
+static int GetTerm(const char *word)
+{
+    unsigned long hash = BIX_HASH_INIT, z;
+    int g, step = 0, n;
+
+    for (n = 0; word[n]; n++)
+      hash = ((hash ^ (unsigned char) word[n])*16777619UL) & 0xffffffffUL;
+
+    /* Look for the word. */
+
+    for (g = hash & (termgroups - 1); termgroups > 0;
+	 g = (g + ++step) & (termgroups - 1)) {
+      z = zero_bytes(termctrl[g] ^ repeat_byte(term_tag(hash)));
+      while (z) {
+	const int t = termslots[g*TERM_GROUP + first_slot(z)];
+
+	if ((termhash[t] == hash) && !strcmp(termtext[t], word)) return t;
+	z &= z - 1;
+	}
+      if (zero_bytes(termctrl[g])) break;
+      }
+
+    /* It's new. */
+
+    if (termtext == NULL) {
+      termspace = INIT_HASH_SIZE;
+      termtext = (char **) safemalloc(termspace*sizeof(char *),
+				      "Can't create term list", "");
+      termhash = (unsigned long *) safemalloc(termspace*sizeof(unsigned long),
+					      "Can't create term list", "");
+      termtext[0] = "";
+      termhash[0] = 0;
+      termcount = 1;
+      }
+    if (termcount == termspace) {
+      char **oldtext = termtext;
+      unsigned long *oldhash = termhash;
+
+      termspace *= 2;
+      termtext = (char **) safemalloc(termspace*sizeof(char *),
+				      "Can't extend term list for", word);
+      termhash = (unsigned long *) safemalloc(termspace*sizeof(unsigned long),
+					      "Can't extend term list for",
+					      word);
+      memcpy((char *) termtext, (char *) oldtext, termcount*sizeof(char *));
+      memcpy((char *) termhash, (char *) oldhash,
+	     termcount*sizeof(unsigned long));
+      free(oldtext);
+      free(oldhash);
+      }
+
+    n++;
+    assert(n <= (int) sizeof(Word));
+    if (textleft < n) {
+      textnext = (char *) PoolBlock(POOL_BLOCK);
+      textleft = POOL_BLOCK;
+      }
+    termtext[termcount] = memcpy(textnext, word, n);
+    termhash[termcount] = hash;
+    textnext += n;
+    textleft -= n;
+
+    if (8*termcount >= 7*termgroups*TERM_GROUP) ExtendTerms();
+    PutTerm(hash, termcount);
+
+    return termcount++;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void FreeTerms(void)
+|
+|  Forget the terms; their text goes with the pool.
+\* ----------------------------------------------------------------- */
+static void FreeTerms(void)
+{
+    if (termctrl) {
+      free(termctrl);
+      free(termslots);
+      }
+    if (termtext) {
+      free(termtext);
+      free(termhash);
+      }
+    termctrl = NULL;
+    termslots = NULL;
+    termtext = NULL;
+    termhash = NULL;
+    termcount = termspace = termgroups = 0;
+    textnext = NULL;
+    textleft = 0;
+}
+
+/* The byte at depth in the term's word. */
+
+#define term_char(_t, _d) \
+  ((unsigned char) termtext[_t][_d])
+
+/* ----------------------------------------------------------------- *\
+|  void SortTerms(int *t, int n, int depth)
+|
+|  Sort the n term numbers at t, whose words agree in their first
+|  depth bytes, into strcmp() order.  The terms are split three ways
+|  by their bytes at depth, and the parts sorted on their own, the
+|  middle one a byte further on; a few terms are sorted by
+|  insertion.
+\* ----------------------------------------------------------------- */
+static void SortTerms(int *t, int n, int depth)
+{
+    int lt, i, gt, x, a, b, c, pivot;
+
+    while (n >= 8) {
+      a = term_char(t[0], depth);
+      b = term_char(t[n/2], depth);
+      c = term_char(t[n - 1], depth);
+      pivot = a < b ? (b < c ? b : max(a, c)) : (a < c ? a : max(b, c));
+
+      for (lt = i = 0, gt = n; i < gt; )
+	if ((c = term_char(t[i], depth)) < pivot) {
+	  x = t[lt]; t[lt++] = t[i]; t[i++] = x;
+	  }
+	else if (c > pivot) {
+	  x = t[--gt]; t[gt] = t[i]; t[i] = x;
+	  }
+	else
+	  i++;
+
+      SortTerms(t, lt, depth);
+      if (pivot) SortTerms(t + lt, gt - lt, depth + 1);
+      t += gt;
+      n -= gt;
+      }
+
+    for (i = 1; i < n; i++) {
+      x = t[i];
+      for (gt = i; (gt > 0) && (strcmp(termtext[t[gt - 1]] + depth,
+				       termtext[x] + depth) > 0); gt--)
+	t[gt] = t[gt - 1];
+      t[gt] = x;
+      }
+}
+
+/* ----------------------------------------------------------------- *\
+|  int *RankTerms(void)
+|
+|  Return each term's place among the terms in strcmp() order.
+\* ----------------------------------------------------------------- */
+static int *RankTerms(void)
+{
+    int *order = (int *) safemalloc((termcount + 1)*sizeof(int),
+				    "Can't sort terms", ""),
+	*rank = (int *) safemalloc((termcount + 1)*sizeof(int),
+				   "Can't sort terms", ""),
+	i;
+
+    for (i = 0; i < termcount; i++) order[i] = i;
+    SortTerms(order, termcount, 0);
+    for (i = 0; i < termcount; i++) rank[order[i]] = i;
+    free(order);
+
+    return rank;
+}
+
+/* A string used in a field is indexed from the terms of its words,
+   found the first time it's used, instead of from its text copied
+   into the field and split again.  The terms are kept by the address
+   of the string's text, which stays put until the string table is
+   emptied; a redefined string gets new text.  The kept terms go when
+   the terms or the string table are cleared.  A word too long to
+   index is kept as -1 less its place in the text, so the warning
+   about it can still be given at each use. */
+
+typedef struct		/* A string's terms */
+{
+    const char *str;	/* the string's text, or null */
+    int         first;	/* its terms in expterms */
+    int         count;
+} Expansion;
+
+static Expansion *expansions = NULL;	/* by the text's address */
+static int expslots = 0, numexpansions = 0;
+static int *expterms = NULL;
+static int numexpterms = 0, exptermspace = 0;
+
+#define exp_slot(_s) \
+  ((int) ((((unsigned long) (_s) >> 3)*2654435761UL) & (expslots - 1)))
+
+/* ----------------------------------------------------------------- *\
+|  void ClearExpansions(void)
+|
+|  Forget the strings' terms.
+\* ----------------------------------------------------------------- */
+static void ClearExpansions(void)
+{
+    int i;
+
+    for (i = 0; numexpansions && (i < expslots); i++)
+      expansions[i].str = NULL;
+    numexpansions = numexpterms = 0;
+}
+
+/* ----------------------------------------------------------------- *\
+|  Expansion *GetExpansion(const char *str)
+|
+|  Return the terms of the words in the string text str, finding
+|  them if they haven't been.
+\* ----------------------------------------------------------------- */
+static Expansion *GetExpansion(const char *str)
+{
+    Expansion *x;
+    const char *w, *e;
+    int i;
+
+    if (2*(numexpansions + 1) > expslots) {
+      Expansion *old = expansions;
+      const int oldslots = expslots;
+
+      expslots = max(2*expslots, 64);
+      expansions = (Expansion *) safemalloc(expslots*sizeof(Expansion),
+					    "Can't keep string terms", "");
+      for (i = 0; i < expslots; i++) expansions[i].str = NULL;
+      for (i = 0; i < oldslots; i++)
+	if (old[i].str) {
+	  for (x = expansions + exp_slot(old[i].str); x->str;
+	       x = expansions + ((x - expansions + 1) & (expslots - 1))) { }
+	  *x = old[i];
+	  }
+      if (old) free(old);
+      }
+
+    for (x = expansions + exp_slot(str); x->str;
+	 x = expansions + ((x - expansions + 1) & (expslots - 1)))
+      if (x->str == str) return x;
+
+    x->str = str;
+    x->first = numexpterms;
+    for (w = str; *w; w = e) {
+      while (*w == ' ') w++;
+      for (e = w; *e && (*e != ' '); e++) { }
+      if (e - w < 2) continue;
+      if (numexpterms == exptermspace) {
+	exptermspace = max(2*exptermspace, 256);
+	expterms = (int *) realloc(expterms, exptermspace*sizeof(int));
+	if (!expterms) die("Can't keep string terms", "");
+	}
+      if (e - w < MAXWORD) {
+	char word[MAXWORD];
+
+	memcpy(word, w, e - w);
+	word[e - w] = eos;
+	expterms[numexpterms++] = GetTerm(word);
+	}
+      else expterms[numexpterms++] = -1 - (w - str);
+      }
+    x->count = numexpterms - x->first;
+    numexpansions++;
+
+    return x;
+}
+
 /* ----------------------------------------------------------------- *\
 |  void InitTables(void)
 |
@@ -300,16 +904,9 @@ static char        numfields;			/* number of fields */
 \* ----------------------------------------------------------------- */
 void InitTables(void)
 {
-    register unsigned int i;
-
     numfields = 0;
-    for (i=0; i<MAXFIELDS; i++)
-    {
-	fieldtable[i].thefield[0] = 0;
-	fieldtable[i].number = 0;
-	fieldtable[i].size = 0;
-	fieldtable[i].words = NULL;
-    }
+    if (fieldids)
+      memset((char *) fieldids, 0, fieldidsize*sizeof(int));
 }
 
 /* ----------------------------------------------------------------- *\
@@ -328,71 +925,132 @@ void InitOneField(register ExHashTable *htable)
 					 htable->thefield);
     for (i=0; i<INIT_HASH_SIZE; i++)
     {
-	htable->words[i].theword[0] = 0;
+	htable->words[i].term = 0;
 	htable->words[i].number = 0;
 	htable->words[i].size = 0;
-	htable->words[i].refs = NULL;
+	htable->words[i].refs.list = NULL;
     }
 }
 
+typedef struct		/* A run spilled from the tables, with -m */
+{
+    FILE *f;
+    int   merges;	/* the number of merges making it */
+} RunFile;
+
+static RunFile *runs = NULL;		/* the runs, in order */
+static int numruns = 0, runspace = 0;
+
 /* ----------------------------------------------------------------- *\
-|  void FreeTables(void)
+|  void FreeRuns(void)
 |
-|  Free the tables
+|  Forget the runs spilled from the tables (see SpillTables()).
+\* ----------------------------------------------------------------- */
+static void FreeRuns(void)
+{
+    while (numruns > 0) fclose(runs[--numruns].f);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void ClearTables(void)
+|
+|  Free the tables' words
 \* ----------------------------------------------------------------- */
 
-void FreeTables(void) {
+static void ClearTables(void) {
 
   unsigned i;
 
   for (i = 0; i < (unsigned int)numfields; i++)
     if (fieldtable[i].words) {
-      unsigned j;
-      for (j = 0; j < (unsigned int)(fieldtable[i].number); j++)
-	if (fieldtable[i].words[j].refs)
-	  free(fieldtable[i].words[j].refs);
       free(fieldtable[i].words);
       }
+  numfields = 0;
+  FreeTerms();
+  ClearExpansions();
+  FreePool();
+  }
+
+/* ----------------------------------------------------------------- *\
+|  void FreeTables(void)
+|
+|  Free the tables
+\* ----------------------------------------------------------------- */
+
+void FreeTables(void) {
+
+  ClearTables();
+  FreeRuns();
   }
 
 
 
+static int *FieldSlot(unsigned long hash, const char *field) {
+
+  /* Return the slot in fieldids for the field with the given hash: the one
+     holding its id, or the empty slot where it goes. */
+
+  int i = hash & (fieldidsize - 1);
+
+  while (fieldids[i] && ((fieldtable[fieldids[i] - 1].hash != hash) ||
+			 strcmp(fieldtable[fieldids[i] - 1].thefield, field)))
+    i = (i + 1) & (fieldidsize - 1);
+
+  return fieldids + i;
+
+  } /* FieldSlot */
+
+
+
 static ExHashTable *GetHashTable(char *field) {
 
   /* Get the hash table associated with the given field.  If the table is
-     unclaimed, claim it and initialize it. */
+     unclaimed, claim it and initialize it.  The table may move when
+     another field is claimed. */
+
+  const unsigned long hash =
+    bix_hash(BIX_HASH_INIT, (const unsigned char *) field, strlen(field));
+  ExHashTable *ht;
+  int *slot, i;
 
-  register unsigned long hash = 0;	/* primary hash value	*/
-  register unsigned long skip = 1;	/* secondary hash value */
-  int i, slots_visited;
+  if (2*(numfields + 1) > fieldidsize) {
 
-  for (i = 0; i < MAXFIELDS; i++) fieldtable[i].visited = false;
-  slots_visited = 0;
+    /* Double the ids' table, putting the ids already there back. */
 
-  for (i = 0; field[i]; i++) {
-    hash = (hash*HASH_CONST + field[i]) % MAXFIELDS;
-    skip += 2*hash;
+    if (fieldids) free(fieldids);
+    fieldidsize = max(2*fieldidsize, 16);
+    fieldids = (int *) safemalloc(fieldidsize*sizeof(int),
+				  "Can't extend field table for", field);
+    memset((char *) fieldids, 0, fieldidsize*sizeof(int));
+    for (i = 0; i < numfields; i++)
+      *FieldSlot(fieldtable[i].hash, fieldtable[i].thefield) = i + 1;
     }
 
-  while (fieldtable[hash].thefield[0] &&
-	 strcmp(fieldtable[hash].thefield, field)) {
-    if (!(fieldtable[hash].visited)) {
-      fieldtable[hash].visited = true;
-      if (++slots_visited >= MAXFIELDS) die("out of hash-table slots", "");
+  slot = FieldSlot(hash, field);
+  if (*slot) return fieldtable + *slot - 1;
+
+  if (numfields == fieldspace) {
+    ExHashTable *old = fieldtable;
+
+    fieldspace = max(2*fieldspace, 16);
+    fieldtable = (ExHashTable *) safemalloc(fieldspace*sizeof(ExHashTable),
+					    "Can't extend field table for",
+					    field);
+    if (old) {
+      memcpy((char *) fieldtable, (char *) old,
+	     numfields*sizeof(ExHashTable));
+      free(old);
       }
-    hash = (hash + skip) % MAXFIELDS;
     }
 
-  if (!fieldtable[hash].thefield[0]) {
-    assert(strlen(field) < sizeof(fieldtable[hash].thefield));
-    strcpy(fieldtable[hash].thefield, field);
-    InitOneField(fieldtable+hash);
-    numfields++;
-    if (numfields > MAXFIELDS)
-      die("too many field names",field);
-    }
+  ht = fieldtable + numfields;
+  assert(strlen(field) < sizeof(ht->thefield));
+  strcpy(ht->thefield, field);
+  ht->hash = hash;
+  InitOneField(ht);
+  *slot = ++numfields;
 
-  return fieldtable+hash;
+  return ht;
   }
 
 /* ----------------------------------------------------------------- *\
@@ -409,35 +1067,28 @@ void InitBlackHole(char *field)
     hole->words = NULL;
 }
 
-HashPtr GetHashCell(ExHashTable *htable, char *word) {
+HashPtr GetHashCell(ExHashTable *htable, int term) {
 
-  /* Get the hash table cell associated with the given word.  If the cell is
+  /* Get the hash table cell associated with the given term.  If the cell is
      unclaimed, claim it, initialize it, and update the table's word count. */
 
   register HashPtr table, cell;
-  register unsigned long hash = 0;	/* primary hash value	*/
-  register unsigned long skip = 1;	/* secondary hash value */
-  register int i;
+  register unsigned long hash;		/* primary hash value	*/
+  register unsigned long skip;		/* secondary hash value */
 
   table = htable->words;
 
-  for (i = 0; word[i]; i++) {
-    hash = (hash*HASH_CONST + word[i]) % htable->size;
-    skip += 2*hash;
-    }
+  hash = ((unsigned long) term*HASH_CONST) & (htable->size - 1);
+  skip = 2*(unsigned long) term + 1;
 
-  while (table[hash].theword[0] && strcmp(table[hash].theword, word))
-    hash = (hash+skip) % htable->size;
+  while (table[hash].term && (table[hash].term != term))
+    hash = (hash+skip) & (htable->size - 1);
 
   cell = table + hash;
 
-  if (!cell->theword[0]) {
-    assert(strlen(word) < sizeof(Word));
-    strcpy(cell->theword, word);
-    cell->size = 8;
-    cell->refs = (int *) safemalloc(cell->size * sizeof(int),
-					     "Can't create entry list for",
-					     word);
+  if (!cell->term) {
+    cell->term = term;
+    cell->size = FEW_REFS;
     htable->number++;
     }
   return cell;
@@ -468,17 +1119,17 @@ void ExtendHashTable(ExHashTable *htable)
 
     for (i=0; i < (unsigned int)(htable->size); i++)
     {
-	htable->words[i].theword[0] = 0;
+	htable->words[i].term = 0;
 	htable->words[i].number = 0;
 	htable->words[i].size = 0;
-	htable->words[i].refs = NULL;
+	htable->words[i].refs.list = NULL;
     }
 
     for (i=0; i< (unsigned int)oldsize; i++)
     {
-	if (oldtable[i].theword[0])
+	if (oldtable[i].term)
 	{
-	    newcell = GetHashCell(htable, oldtable[i].theword);
+	    newcell = GetHashCell(htable, oldtable[i].term);
 	    *newcell = oldtable[i];
 	}
     }
@@ -487,493 +1138,2862 @@ void ExtendHashTable(ExHashTable *htable)
 }
 
 /* ----------------------------------------------------------------- *\
-|  void InsertEntry(ExHashTable *htable, char *word, int entry)
+|  void InsertTerm(ExHashTable *htable, int term, int entry)
 |
-|  Insert the word/entry pair into the hash table, unless it's
+|  Insert the term/entry pair into the hash table, unless it's
 |  already there.
 \* ----------------------------------------------------------------- */
-void InsertEntry(ExHashTable *htable, char *word, int entry)
+static void InsertTerm(ExHashTable *htable, int term, int entry)
 {
     register HashPtr cell;
-    int *newlist;
 
     if (htable->words == NULL) return;
 
     if (htable->number*2 > htable->size) ExtendHashTable(htable);
 
-    cell = GetHashCell(htable, word);
+    cell = GetHashCell(htable, term);
 
-    if (cell->number && (cell->refs[cell->number - 1] == entry)) return;
+    if (cell->number && (cell_refs(cell)[cell->number - 1] == entry)) return;
 
-    if (cell->number == cell->size) {
-      cell->size *= 2;
-      newlist = (int *) safemalloc(cell->size*sizeof(int),
-				   "Can't extend entry list for", word);
-      memcpy((char *) newlist, (char *) cell->refs, cell->number*sizeof(int));
-      free(cell->refs);
-      cell->refs = newlist;
-      }
-    cell->refs[cell->number++] = entry;
+    GrowRefs(cell, 1);
+    cell_refs(cell)[cell->number++] = entry;
     }
 
-
-/* ================================================================= */
-
 /* ----------------------------------------------------------------- *\
-|  void WriteWord(FILE *ofp, char *word)
+|  void InsertEntry(ExHashTable *htable, char *word, int entry)
 |
-|  Output the word in "Pascal" string format -- length byte followed
-|  by characters.  This saves some disk space over writing 16 bytes
-|  in all cases.
+|  Insert the word/entry pair into the hash table, unless it's
+|  already there.
 \* ----------------------------------------------------------------- */
-void WriteWord(FILE *ofp, char *word)
+void InsertEntry(ExHashTable *htable, char *word, int entry)
 {
-    unsigned char length = strlen(word);
-    fwrite((void *) &length, sizeof(char), 1, ofp);
-    fwrite((void *) word, sizeof(char), length, ofp);
-}
+    if (htable->words == NULL) return;
+
+    InsertTerm(htable, GetTerm(word), entry);
+    }
 
 /* ----------------------------------------------------------------- *\
-|  void OutputTables(FILE *ofp)
+|  void AppendRefs(ExHashTable *htable, char *word, const int *refs,
+|                  int n, int base)
 |
-|  Compress and output the tables, with lots of user feedback.
-|  KLUDGE -- Passing strcmp to qsort assumes intimate knowledge of
-|  the HashCell and ExhashTable structs.
+|  Add the n entries in refs, each plus base, to the word's list in
+|  the hash table; they all come after the entries already there.
 \* ----------------------------------------------------------------- */
-void OutputTables(FILE *ofp)
+static void AppendRefs(ExHashTable *htable, char *word, const int *refs,
+		       int n, int base)
 {
-    register HashPtr words;
-    register int i, j, k, count;
+    register HashPtr cell;
+    int *list, i;
 
-    /* printf("Writing index tables..."); */
-    fflush(stdout);
+    if (htable->words == NULL) return;
 
-    numfields = 0;		/* recount, ignoring black holes */
-    for (i = 0; i < MAXFIELDS; i++) {
-      if (fieldtable[i].words) {
-	if (i > numfields) {
-	  fieldtable[(int) numfields] = fieldtable[i]; /* copy i-th table */
-	  fieldtable[i].number = 0; /* then clear i-th table */
-	  fieldtable[i].size = 0; /* to avoid duplicate free() later */
-	  fieldtable[i].words = NULL;
-	  }
-	numfields++;
-	}
-    }
-    qsort(fieldtable, (size_t)numfields, sizeof(ExHashTable),
-	  (int (*)(const void*,const void*))strcmp);
+    if (htable->number*2 > htable->size) ExtendHashTable(htable);
 
-    fwrite((void *) &numfields, sizeof(char), 1, ofp);
-    for (i=0; i<numfields; i++)
-	WriteWord(ofp, fieldtable[i].thefield);
+    cell = GetHashCell(htable, GetTerm(word));
 
-    /* printf("[%d fields]\n", numfields); */
+    GrowRefs(cell, n);
+    list = cell_refs(cell);
+    for (i = 0; i < n; i++) list[cell->number++] = refs[i] + base;
+}
 
-    for (k=0; k<numfields; k++)
-    {
-	/* printf("%2d: %s...", k+1, fieldtable[k].thefield); */
-	fflush(stdout);
+
+/* ================================================================= *\
 
-	words = fieldtable[k].words;
+   OUTPUT
 
-	for (i=0, j=0; i<fieldtable[k].size; i++)
-	{
-	    if (words[i].theword[0])
-	    {
-		if (i > j)
-		{
-		    words[j] = words[i]; /* copy i-th table to j-th */
-		    words[i].number = 0; /* then clear i-th table */
-		    words[i].size = 0;	/* to avoid duplicate free() later */
-		    words[i].refs = (int*)NULL;
+   A segment is written through an Out, which gathers the small
+   writes in a buffer and hands the buffer to writev() with anything
+   that doesn't fit in it, so a segment takes a few system calls and
+   the big sections aren't copied on the way.
+
+\* ================================================================= */
+
+#define OUT_BUFFER	(1 << 20)	/* bytes gathered before a write */
+
+static int syncing = 0;		/* flush index files to disk? */
+static long membudget = 0;	/* the tables' most bytes, or 0, with -m */
+
+typedef struct		/* An index file being written */
+{
+    int            fd;
+    long           pos;		/* the file offset of the bytes in buf */
+    unsigned char *buf;		/* the bytes gathered */
+    long           used;	/* number of bytes in buf */
+    bool           ok;		/* has every write worked? */
+} Out;
+
+/* The file offset of the next byte written. */
+
+#define out_pos(_o) \
+  ((_o)->pos + (_o)->used)
+
+/* ----------------------------------------------------------------- *\
+|  void OpenOut(Out *o, FILE *f)
+|
+|  Start writing at f's position, through its descriptor.
+\* ----------------------------------------------------------------- */
+static void OpenOut(Out *o, FILE *f)
+{
+    o->fd = fileno(f);
+    o->pos = fflush(f) ? -1 : ftell(f);
+    o->ok = (o->pos >= 0) && (lseek(o->fd, o->pos, SEEK_SET) == o->pos);
+    o->buf = (unsigned char *) safemalloc(OUT_BUFFER, "Can't buffer index",
+					  "");
+    o->used = 0;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void OutWrite(Out *o, const unsigned char *p, long n)
+|
+|  Write the bytes gathered, then the n bytes at p.
+\* ----------------------------------------------------------------- */
+static void OutWrite(Out *o, const unsigned char *p, long n)
+{
+    struct iovec v[2];
+    long w, k;
+    int i = 0;
+
+    v[0].iov_base = (void *) o->buf;
+    v[0].iov_len = o->used;
+    v[1].iov_base = (void *) p;
+    v[1].iov_len = n;
+    o->pos += o->used + n;
+    o->used = 0;
+
+    while (o->ok && (i < 2))
+      if (v[i].iov_len == 0)
+	i++;
+      else if ((w = writev(o->fd, v + i, 2 - i)) < 0)
+	o->ok = (errno == EINTR);
+      else
+	for (; w > 0; w -= k) {
+	  k = min(w, (long) v[i].iov_len);
+	  v[i].iov_base = (void *) ((char *) v[i].iov_base + k);
+	  v[i].iov_len -= k;
+	  if (v[i].iov_len == 0) i++;
+	  }
+}
+
+/* ----------------------------------------------------------------- *\
+|  void OutBytes(Out *o, const void *p, long n)
+|
+|  Write the n bytes at p.
+\* ----------------------------------------------------------------- */
+static void OutBytes(Out *o, const void *p, long n)
+{
+    if (o->used + n > OUT_BUFFER)
+      OutWrite(o, (const unsigned char *) p, n);
+    else {
+      memcpy((char *) o->buf + o->used, (const char *) p, n);
+      o->used += n;
+      }
+}
+
+/* ----------------------------------------------------------------- *\
+|  bool CloseOut(Out *o, FILE *f)
+|
+|  Finish writing, leaving f positioned after the bytes written, and
+|  return false if any write failed.
+\* ----------------------------------------------------------------- */
+static bool CloseOut(Out *o, FILE *f)
+{
+    OutWrite(o, NULL, 0);
+    free(o->buf);
+
+    return (fseek(f, o->pos, SEEK_SET) == 0) && o->ok;
+}
+
+/* ----------------------------------------------------------------- *\
+|  bool SyncFile(FILE *f)
+|
+|  With -f, flush the index file f to disk; return false if that
+|  fails.
+\* ----------------------------------------------------------------- */
+static bool SyncFile(FILE *f)
+{
+    return !syncing || (!fflush(f) && !fsync(fileno(f)));
+}
+
+/* ----------------------------------------------------------------- *\
+|  void WritePad(Out *o, long to)
+|
+|  Write nul bytes until the file offset reaches to.
+\* ----------------------------------------------------------------- */
+static void WritePad(Out *o, long to)
+{
+    static const unsigned char nul = 0;
+
+    assert(out_pos(o) <= to);
+    while (out_pos(o) < to) OutBytes(o, &nul, 1);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void WriteInts(Out *o, const int *v, int n)
+|
+|  Write the n numbers in v as Bix_u32s.
+\* ----------------------------------------------------------------- */
+static void WriteInts(Out *o, const int *v, int n)
+{
+    Bix_u32 u;
+
+    for (; n > 0; n--, v++) {
+      bix_put32(u, *v);
+      OutBytes(o, u, sizeof(u));
+      }
+}
+
+/* ================================================================= *\
+
+   DICTIONARIES
+
+   An index has either a dictionary for each field or, with -t, a single
+   dictionary of terms for all of them.  Either way, the words in the field
+   tables, or in the runs spilled from them, are listed as DictCells in
+   dictionary order, and the cells are grouped into terms.  A field
+   dictionary's term is a single cell; a term in the term dictionary is every
+   cell holding the same word, and its entry list is the union of theirs,
+   with a mask telling which fields each entry came from.  The terms are
+   written one at a time, their words and entry lists put aside until their
+   sections come up in the index file.
+
+\* ================================================================= */
+
+typedef struct		/* A word in a field table */
+{
+    HashPtr cell;	/* the word's cell */
+    int     field;	/* the cell's field table */
+} DictCell;
+
+typedef struct		/* A bibliography file being indexed */
+{
+    char   *name;	/* the file's full path */
+    time_t  mod_time;
+    long    base;	/* added to the offsets of the file's entries */
+    int     first;	/* the file's first entry */
+} BibFile;
+
+typedef struct		/* A string definition */
+{
+    int   entry;	/* the number of entries before it */
+    char *name;
+    char *value;
+} Macro;
+
+typedef struct		/* Entries read from the bibliography files */
+{
+    long  *offsets;	/* of the entries, plus their files' bases */
+    long  *lengths;
+    unsigned long
+	  *hashes,	/* each entry's text and gap hashes, if any */
+	   tail;	/* the hash of the gap after the last entry */
+    int    count;
+    int    space;
+} Entries;
+
+typedef struct		/* Where a segment's entries go in the index */
+{
+    int   first;	/* the first entry they replace */
+    int   replaced;	/* the number of entries they replace */
+    long  size;		/* the bib file's size */
+    bool  delta;	/* added to an existing index? */
+} Segment;
+
+static int termdict = 0;	/* one dictionary for all fields? */
+static int automata = 0;	/* look words up with automata? */
+static int embed = 0;		/* keep the entries' text in the index? */
+static int incremental = 0;	/* add segments to existing indexes? */
+static int jobs = 1;		/* the most files indexed at once */
+static int chunks = 1;		/* the most pieces of a file read at once */
+static char *collection = NULL;	/* the collection's name, with -c */
+static BibFile *libraries = NULL;	/* the libraries' bib files, with -l */
+static int numlibraries = 0;
+static Macro *macros = NULL;	/* the bib file's string definitions */
+static int nummacros = 0, macrospace = 0;
+
+/* ----------------------------------------------------------------- *\
+|  void AddMacro(int entry, const char *name, const char *value)
+|
+|  Note the definition of the string name as value, made before the
+|  given entry.
+\* ----------------------------------------------------------------- */
+static void AddMacro(int entry, const char *name, const char *value)
+{
+    if (nummacros == macrospace) {
+      Macro *old = macros;
+
+      macrospace = max(2*macrospace, 16);
+      macros = (Macro *) alloc(macrospace*sizeof(Macro));
+      if (old) {
+	memcpy((char *) macros, (char *) old, nummacros*sizeof(Macro));
+	free(old);
+	}
+      }
+    macros[nummacros].entry = entry;
+    macros[nummacros].name = strdupl(name);
+    macros[nummacros++].value = strdupl(value);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void FreeMacros(void)
+|
+|  Forget the string definitions.
+\* ----------------------------------------------------------------- */
+static void FreeMacros(void)
+{
+    while (nummacros > 0) {
+      nummacros--;
+      free(macros[nummacros].name);
+      free(macros[nummacros].value);
+      }
+}
+
+#define RADIX_BITS	11	/* the bits of rank sorted on at a time */
+
+/* ----------------------------------------------------------------- *\
+|  int CompareFields(const void *a, const void *b)
+|
+|  Order field tables by name.
+\* ----------------------------------------------------------------- */
+static int CompareFields(const void *a, const void *b)
+{
+    return strcmp(((const ExHashTable *) a)->thefield,
+		  ((const ExHashTable *) b)->thefield);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void SortCells(DictCell *cells, int n, const int *rank)
+|
+|  Sort the n cells, listed field by field, into dictionary order:
+|  by field and then by the rank of their words, or with -t the
+|  other way round.  The cells are dealt into bins by RADIX_BITS of
+|  rank at a time, lowest first, and then, without -t, by field;
+|  each pass keeps the order the cells are in within a bin.
+\* ----------------------------------------------------------------- */
+static void SortCells(DictCell *cells, int n, const int *rank)
+{
+    const int bins = max(1 << RADIX_BITS, numfields);
+    DictCell *from = cells, *to, *t;
+    int *key = (int *) safemalloc(n*sizeof(int) + 1, "Can't sort words", ""),
+	*tokey = (int *) safemalloc(n*sizeof(int) + 1, "Can't sort words",
+				    ""),
+	*count = (int *) safemalloc(bins*sizeof(int), "Can't sort words", ""),
+	*k, shift, i, b, sum;
+    const int mask = (1 << RADIX_BITS) - 1;
+
+    to = (DictCell *) safemalloc(n*sizeof(DictCell) + 1, "Can't sort words",
+				 "");
+    for (i = 0; i < n; i++) key[i] = rank[cells[i].cell->term];
+
+    for (shift = 0; (1L << shift) < termcount; shift += RADIX_BITS) {
+      memset((char *) count, 0, bins*sizeof(int));
+      for (i = 0; i < n; i++)
+	count[(key[i] >> shift) & mask]++;
+      for (b = 0, sum = 0; b < bins; b++) {
+	const int c = count[b];
+
+	count[b] = sum;
+	sum += c;
+	}
+      for (i = 0; i < n; i++) {
+	b = count[(key[i] >> shift) & mask]++;
+	to[b] = from[i];
+	tokey[b] = key[i];
+	}
+      t = from; from = to; to = t;
+      k = key; key = tokey; tokey = k;
+      }
+
+    if (!termdict) {
+      memset((char *) count, 0, bins*sizeof(int));
+      for (i = 0; i < n; i++) count[from[i].field]++;
+      for (b = 0, sum = 0; b < bins; b++) {
+	const int c = count[b];
+
+	count[b] = sum;
+	sum += c;
+	}
+      for (i = 0; i < n; i++) to[count[from[i].field]++] = from[i];
+      t = from; from = to; to = t;
+      }
+
+    if (from != cells) {
+      memcpy((char *) cells, (char *) from, n*sizeof(DictCell));
+      to = from;
+      }
+    free(to);
+    free(key);
+    free(tokey);
+    free(count);
+}
+
+/* ----------------------------------------------------------------- *\
+|  int EncodeTerm(const DictCell *cells, int numcells, const char *word,
+|                 int *numrefs, unsigned char **out)
+|
+|  Compress the entry list of the term word, made of the numcells
+|  cells at cells, point *out at it and return its size.  Set
+|  *numrefs to the term's entry count.  The list is good until the
+|  next call.
+\* ----------------------------------------------------------------- */
+static int EncodeTerm(const DictCell *cells, int numcells, const char *word,
+		      int *numrefs, unsigned char **out)
+{
+    static int *refs = NULL, refsize = 0, *fields = NULL, *next = NULL,
+	       *hits = NULL, fieldsize = 0;
+    static unsigned char *masks = NULL, *buf = NULL;
+    static long bufsize = 0;
+    const int stride = (numcells + 7)/8;
+    const int *list;
+    register int i, j, k, n;
+    int masksize = 0;
+    long size;
+
+    if (numcells > fieldsize) {
+	if (fields) {
+	    free(fields);
+	    free(next);
+	    free(hits);
+	    free(masks);
+	    masks = NULL;
+	}
+	fieldsize = max(2*fieldsize, max(numcells, 8));
+	fields = (int *) safemalloc(fieldsize*sizeof(int),
+				    "Can't merge entry lists for", word);
+	next = (int *) safemalloc(fieldsize*sizeof(int),
+				  "Can't merge entry lists for", word);
+	hits = (int *) safemalloc(fieldsize*sizeof(int),
+				  "Can't merge entry lists for", word);
+    }
+    for (i=0, n=0; i<numcells; i++) {
+	fields[i] = cells[i].field;
+	next[i] = 0;
+	n += cells[i].cell->number;
+    }
+
+    /* A term in one field has its cell's list as it is.  Otherwise the
+       cells' entry lists, which are increasing, are merged, and each
+       entry's mask is sized as it's made. */
+
+    if (!termdict || (numcells == 1))
+	list = cell_refs(cells->cell);
+    else {
+	if (n > refsize) {
+	    if (refs) free(refs);
+	    if (masks) free(masks);
+	    masks = NULL;
+	    refsize = max(2*refsize, n);
+	    refs = (int *) safemalloc(refsize*sizeof(int),
+				      "Can't merge entry lists for", word);
+	}
+	if (masks == NULL)
+	    masks = (unsigned char *)
+		safemalloc(refsize*((fieldsize + 7)/8),
+			   "Can't merge entry lists for", word);
+
+	for (n=0; ; n++) {
+	    int least = -1;
+
+	    for (i=0, k=0; i<numcells; i++)
+		if (next[i] < cells[i].cell->number) {
+		    const int r = cell_refs(cells[i].cell)[next[i]];
+
+		    if ((least == -1) || (r < least)) {
+			least = r;
+			k = 0;
+		    }
+		    if (r == least) hits[k++] = i;
 		}
-		j++;
+	    if (least == -1) break;
+
+	    refs[n] = least;
+	    memset((char *) masks + n*stride, 0, stride);
+	    for (j=0; j<k; j++) {
+		masks[n*stride + hits[j]/8] |= 1 << (hits[j] % 8);
+		next[hits[j]]++;
 	    }
+	    masksize += bix_mask_size(hits[k - 1] + 1);
+	}
+	list = refs;
+    }
+
+    size = bix_refs_bound(n) + bix_term_bound(numcells) + masksize;
+    if (size > bufsize) {
+	if (buf) free(buf);
+	bufsize = max(2*bufsize, size);
+	buf = (unsigned char *) safemalloc(bufsize,
+					   "Can't compress entry list for",
+					   word);
+    }
+
+    *out = buf;
+    *numrefs = n;
+    if (!termdict) return bix_encode_refs(buf, list, n);
+    return bix_encode_term(buf, fields, numcells, masks, masksize, list, n);
+}
+
+typedef struct		/* Bytes put aside to be written later */
+{
+    FILE          *f;		/* where they're kept, with -m, */
+    unsigned char *data;	/* or else where they're kept */
+    long           size;	/* number of bytes put aside */
+    long           space;	/* real size of data */
+} Spool;
+
+/* ----------------------------------------------------------------- *\
+|  void OpenSpool(Spool *s)
+|
+|  Start an empty spool, kept in a temporary file when memory is
+|  budgeted.
+\* ----------------------------------------------------------------- */
+static void OpenSpool(Spool *s)
+{
+    s->f = NULL;
+    s->data = NULL;
+    s->size = s->space = 0;
+    if (membudget && ((s->f = tmpfile()) == NULL))
+      die("Can't open a temporary file", "");
+}
+
+/* ----------------------------------------------------------------- *\
+|  void SpoolBytes(Spool *s, const unsigned char *p, int n)
+|
+|  Put the n bytes at p at the end of the spool.
+\* ----------------------------------------------------------------- */
+static void SpoolBytes(Spool *s, const unsigned char *p, int n)
+{
+    if (s->f) {
+      if (fwrite((void *) p, sizeof(char), n, s->f) != (size_t) n)
+	die("Can't write a temporary file", "");
+      }
+    else {
+      if (s->size + n > s->space) {
+	unsigned char *old = s->data;
+
+	s->space = max(2*s->space, max(s->size + n, 4096));
+	s->data = (unsigned char *) safemalloc(s->space,
+					       "Can't extend a spool", "");
+	if (old) {
+	  memcpy((char *) s->data, (char *) old, s->size);
+	  free(old);
+	  }
+	}
+      memcpy((char *) s->data + s->size, (char *) p, n);
+      }
+    s->size += n;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void CloseSpool(Out *o, Spool *s)
+|
+|  Write the spool's bytes, then free it.
+\* ----------------------------------------------------------------- */
+static void CloseSpool(Out *o, Spool *s)
+{
+    char buf[BUFSIZ];
+    size_t n;
+    long reread = 0;
+
+    if (s->f) {
+      if (fflush(s->f) || ferror(s->f) || fseek(s->f, 0L, SEEK_SET))
+	die("Can't reread a temporary file", "");
+      while ((n = fread((void *) buf, sizeof(char), sizeof(buf), s->f)) > 0) {
+	OutBytes(o, buf, n);
+	reread += n;
+	}
+      if (ferror(s->f) || (reread != s->size))
+	die("Can't reread a temporary file", "");
+      fclose(s->f);
+      }
+    else if (s->data) {
+      OutBytes(o, s->data, s->size);
+      free(s->data);
+      }
+}
+
+typedef struct		/* The dictionaries, as they're written */
+{
+    int     numdicts;
+    int     dict;	/* the dictionary being written */
+    int    *numwords;	/* each dictionary's number of terms */
+    int    *roots;	/* each dictionary's automaton */
+    int     numterms;
+    Word    last;	/* the last term written */
+    Bix_dblock
+	   *blocks;	/* the dictionary blocks */
+    int     numblocks;
+    int     blockspace;
+    Spool   words;	/* the dictionary section */
+    Spool   refs;	/* the entry lists */
+    fsa_builder
+	    fsa;	/* the dictionary's automaton, with -a */
+    unsigned char
+	   *fsadata;	/* the automata built */
+    int     fsasize;
+} Dicts;
+
+/* ----------------------------------------------------------------- *\
+|  void NextDict(Dicts *d)
+|
+|  Finish the dictionary being written and start the next one.  The
+|  automata are built one after another into d->fsadata.
+\* ----------------------------------------------------------------- */
+static void NextDict(Dicts *d)
+{
+    if ((d->dict >= 0) && (d->dict < d->numdicts) && automata) {
+      const unsigned char *data;
+      unsigned char *old = d->fsadata;
+      int size, root;
+
+      data = end_fsa_builder(d->fsa, &size, &root);
+      d->fsadata = (unsigned char *) safemalloc(d->fsasize + size,
+						"Can't store automaton", "");
+      if (old) {
+	memcpy((char *) d->fsadata, (char *) old, d->fsasize);
+	free(old);
+	}
+      memcpy((char *) d->fsadata + d->fsasize, (char *) data, size);
+      d->roots[d->dict] = d->fsasize + root;
+      d->fsasize += size;
+      free_fsa_builder(d->fsa);
+      }
+
+    d->dict++;
+    if ((d->dict < d->numdicts) && automata) d->fsa = new_fsa_builder();
+}
+
+/* ----------------------------------------------------------------- *\
+|  void StartDicts(Dicts *d, int numdicts)
+|
+|  Start writing numdicts empty dictionaries.
+\* ----------------------------------------------------------------- */
+static void StartDicts(Dicts *d, int numdicts)
+{
+    d->numdicts = numdicts;
+    d->numwords = (int *) safemalloc((numdicts + 1)*sizeof(int),
+				     "Can't list dictionaries", "");
+    d->roots = (int *) safemalloc((numdicts + 1)*sizeof(int),
+				  "Can't list dictionaries", "");
+    memset((char *) d->numwords, 0, (numdicts + 1)*sizeof(int));
+    d->numterms = 0;
+    d->blocks = NULL;
+    d->numblocks = d->blockspace = 0;
+    OpenSpool(&d->words);
+    OpenSpool(&d->refs);
+    d->fsadata = NULL;
+    d->fsasize = 0;
+    d->dict = -1;
+    NextDict(d);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void AddTerm(Dicts *d, int dict, const char *word,
+|               const DictCell *cells, int numcells)
+|
+|  Write the term word, made of the numcells cells at cells, at the
+|  end of the given dictionary, which is the one being written or a
+|  later one.
+\* ----------------------------------------------------------------- */
+static void AddTerm(Dicts *d, int dict, const char *word,
+		    const DictCell *cells, int numcells)
+{
+    unsigned char wbuf[2 + MAXWORD + sizeof(int)*4], *buf;
+    int t, numrefs, refsize;
+
+    while (d->dict < dict) NextDict(d);
+    t = d->numwords[dict]++;
+    d->numterms++;
+
+    if (t % BIX_DICT_BLOCK == 0) {
+      if (d->numblocks == d->blockspace) {
+	Bix_dblock *old = d->blocks;
+
+	d->blockspace = max(2*d->blockspace, 64);
+	d->blocks = (Bix_dblock *)
+	  safemalloc(d->blockspace*sizeof(Bix_dblock),
+		     "Can't extend the dictionary for", word);
+	if (old) {
+	  memcpy((char *) d->blocks, (char *) old,
+		 d->numblocks*sizeof(Bix_dblock));
+	  free(old);
+	  }
+	}
+      bix_put32(d->blocks[d->numblocks].data, d->words.size);
+      bix_put32(d->blocks[d->numblocks].refs, d->refs.size);
+      d->numblocks++;
+      }
+
+    refsize = EncodeTerm(cells, numcells, word, &numrefs, &buf);
+    SpoolBytes(&d->refs, buf, refsize);
+
+    SpoolBytes(&d->words, wbuf,
+	       bix_encode_word(wbuf, t % BIX_DICT_BLOCK ? d->last : NULL,
+			       automata ? NULL : word, numrefs, refsize));
+    strcpy(d->last, word);
+    if (automata) add_fsa_builder(d->fsa, word);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void EndDicts(Dicts *d)
+|
+|  Finish writing the dictionaries.
+\* ----------------------------------------------------------------- */
+static void EndDicts(Dicts *d)
+{
+    while (d->dict < d->numdicts) NextDict(d);
+}
+
+/* ----------------------------------------------------------------- *\
+|  DictCell *SortTables(int *totalcells)
+|
+|  Drop the black holes from the field tables, sort the fields by
+|  name, and return the *totalcells cells in dictionary order.
+\* ----------------------------------------------------------------- */
+static DictCell *SortTables(int *totalcells)
+{
+    register HashPtr words;
+    register int i, k, n;
+    DictCell *cells;
+    int *rank;
+
+    n = numfields;
+    numfields = 0;		/* recount, ignoring black holes */
+    for (i = 0; i < n; i++) {
+      if (fieldtable[i].words) {
+	if (i > numfields) {
+	  fieldtable[numfields] = fieldtable[i]; /* copy i-th table */
+	  fieldtable[i].number = 0; /* then clear i-th table */
+	  fieldtable[i].size = 0; /* to avoid duplicate free() later */
+	  fieldtable[i].words = NULL;
+	  }
+	numfields++;
 	}
-	qsort(words, (size_t)fieldtable[k].number, sizeof(HashCell),
-	      (int (*)(const void*,const void*))strcmp);
+    }
+    qsort(fieldtable, (size_t)numfields, sizeof(ExHashTable), CompareFields);
+
+    for (k=0, *totalcells=0; k<numfields; k++)
+      *totalcells += fieldtable[k].number;
+    cells = (DictCell *) safemalloc(*totalcells*sizeof(DictCell) + 1,
+				    "Can't list words", "");
+    for (k=0, n=0; k<numfields; k++) {
+      words = fieldtable[k].words;
+      for (i=0; i<fieldtable[k].size; i++)
+	if (words[i].term) {
+	  cells[n].cell = words + i;
+	  cells[n++].field = k;
+	  }
+    }
+
+    rank = RankTerms();
+    SortCells(cells, n, rank);
+    free(rank);
+
+    return cells;
+}
+
+/* ================================================================= *\
+
+   RUNS
+
+   With -m the field tables are kept to a memory budget.  When they
+   outgrow it, their words are written in dictionary order to a
+   temporary file, a run, and the tables start again empty, while the
+   entries go on being numbered as before.  Runs are merged a word at
+   a time; a word's entry list is its lists from the runs, taken in
+   order.  Whenever the last MERGE_RUNS runs have been merged as
+   often as each other, they're merged into one run, and at the end
+   the runs left are merged into the dictionaries.  A run is
+
+	# fields
+	    field name		-- each, in order
+	field			-- each word, in dictionary order
+	    word, # entries, entries
+	-1
+
+   where a field is its place among the run's fields, and a string
+   is its length, nul included, then its bytes.  Sorting takes about
+   as much memory again as the tables, and a merge takes a buffer and
+   the longest entry list of each run; the entries' places and the
+   string definitions are kept in memory whatever the budget, as are
+   the automata, with -a.
+
+\* ================================================================= */
+
+#define MERGE_RUNS	16	/* the runs merged at once */
+
+#define write_ints(_f, _v, _n) \
+  fwrite((void *) (_v), sizeof(int), _n, _f)
+
+#define read_ints(_f, _v, _n) \
+  (fread((void *) (_v), sizeof(int), _n, _f) == (size_t) (_n))
+
+typedef struct		/* A run being merged */
+{
+    FILE *f;
+    int   numfields;
+    Word *names;	/* the run's fields' names */
+    int  *fields;	/* and their places among all the fields */
+    int   field;	/* the next word's field, or -1 after the last */
+    Word  word;		/* the next word */
+    int   number;	/* its number of entries */
+    int  *refs;		/* and the entries */
+    int   size;		/* real size of refs */
+} Run;
+
+/* ----------------------------------------------------------------- *\
+|  long TableBytes(void)
+|
+|  Return about how many bytes the field tables take.
+\* ----------------------------------------------------------------- */
+static long TableBytes(void)
+{
+    long n = poolbytes +
+	     termspace*(long) (sizeof(char *) + sizeof(unsigned long)) +
+	     termgroups*(long) (sizeof(unsigned long) +
+				TERM_GROUP*sizeof(int));
+    int k;
+
+    for (k=0; k<numfields; k++)
+      n += fieldtable[k].size*(long) sizeof(HashCell);
+
+    return n;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void WriteString(FILE *f, const char *s)
+|
+|  Write the string s to the run or chunk f.
+\* ----------------------------------------------------------------- */
+static void WriteString(FILE *f, const char *s)
+{
+    const int n = strlen(s) + 1;
+
+    write_ints(f, &n, 1);
+    fwrite((void *) s, sizeof(char), n, f);
+}
+
+/* ----------------------------------------------------------------- *\
+|  bool ReadWord(FILE *f, char *word)
+|
+|  Read the next string in the run or chunk f into word; return
+|  false if there's none, or it doesn't fit.
+\* ----------------------------------------------------------------- */
+static bool ReadWord(FILE *f, char *word)
+{
+    int n;
+
+    return read_ints(f, &n, 1) && (n > 0) && (n <= (int) sizeof(Word)) &&
+	   (fread((void *) word, sizeof(char), n, f) == (size_t) n) &&
+	   !word[n - 1];
+}
+
+/* ----------------------------------------------------------------- *\
+|  FILE *StartRun(void)
+|
+|  Return a new run, holding the fields in the field tables.
+\* ----------------------------------------------------------------- */
+static FILE *StartRun(void)
+{
+    FILE *f = tmpfile();
+    int k;
+
+    if (f == NULL) die("Can't open a temporary file", "");
+    write_ints(f, &numfields, 1);
+    for (k=0; k<numfields; k++)
+      WriteString(f, fieldtable[k].thefield);
+
+    return f;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void WriteCell(FILE *f, int field, const char *word,
+|                 const HashCell *cell)
+|
+|  Write the field's cell, holding word, to the run f.
+\* ----------------------------------------------------------------- */
+static void WriteCell(FILE *f, int field, const char *word,
+		      const HashCell *cell)
+{
+    write_ints(f, &field, 1);
+    WriteString(f, word);
+    write_ints(f, &(cell->number), 1);
+    write_ints(f, cell_refs(cell), cell->number);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void EndRun(FILE *f, int merges)
+|
+|  Finish the run f, made by the given number of merges, and add it
+|  to the runs.
+\* ----------------------------------------------------------------- */
+static void EndRun(FILE *f, int merges)
+{
+    const int end = -1;
+
+    write_ints(f, &end, 1);
+    if (fflush(f) || ferror(f)) die("Can't write a run of", "words");
+
+    if (numruns == runspace) {
+      RunFile *old = runs;
+
+      runspace = max(2*runspace, 16);
+      runs = (RunFile *) safemalloc(runspace*sizeof(RunFile),
+				    "Can't list the runs", "");
+      if (old) {
+	memcpy((char *) runs, (char *) old, numruns*sizeof(RunFile));
+	free(old);
+	}
+      }
+    runs[numruns].f = f;
+    runs[numruns++].merges = merges;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void ReadRun(Run *r)
+|
+|  Read the run's next word.
+\* ----------------------------------------------------------------- */
+static void ReadRun(Run *r)
+{
+    if (!read_ints(r->f, &(r->field), 1) || (r->field >= r->numfields))
+      die("Can't read a run of", "words");
+    if (r->field < 0) {
+      r->field = -1;
+      return;
+      }
+    r->field = r->fields[r->field];
+
+    if (!ReadWord(r->f, r->word) || !read_ints(r->f, &(r->number), 1) ||
+	(r->number < 0))
+      die("Can't read a run of", "words");
+    if (r->number > r->size) {
+      if (r->refs) free(r->refs);
+      r->size = max(2*r->size, r->number);
+      r->refs = (int *) safemalloc(r->size*sizeof(int),
+				   "Can't read entry list for", r->word);
+      }
+    if (!read_ints(r->f, r->refs, r->number))
+      die("Can't read a run of", "words");
+}
+
+/* ----------------------------------------------------------------- *\
+|  bool RunBefore(const Run *a, const Run *b)
+|
+|  Return true if a's next word comes before b's in dictionary
+|  order, or is the same word in the same field from an earlier run.
+\* ----------------------------------------------------------------- */
+static bool RunBefore(const Run *a, const Run *b)
+{
+    int cmp = termdict ? strcmp(a->word, b->word) : a->field - b->field;
+
+    if (cmp == 0)
+      cmp = termdict ? a->field - b->field : strcmp(a->word, b->word);
+
+    return cmp ? cmp < 0 : a < b;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void SiftRun(Run *run, int *heap, int n, int i)
+|
+|  Move the run at the heap's i-th place down among the n runs
+|  there, until each run comes before the two below it.
+\* ----------------------------------------------------------------- */
+static void SiftRun(Run *run, int *heap, int n, int i)
+{
+    const int r = heap[i];
+    int c;
+
+    while ((c = 2*i + 1) < n) {
+      if ((c + 1 < n) && RunBefore(run + heap[c + 1], run + heap[c])) c++;
+      if (!RunBefore(run + heap[c], run + r)) break;
+      heap[i] = heap[c];
+      i = c;
+      }
+    heap[i] = r;
+}
+
+/* ----------------------------------------------------------------- *\
+|  void MergeRuns(Dicts *d, int first)
+|
+|  Merge the runs from the first on and write their words as the
+|  dictionaries d, the fields in the runs becoming the field tables,
+|  empty, in order; or, if d is null, as a run replacing them.
+\* ----------------------------------------------------------------- */
+static void MergeRuns(Dicts *d, int first)
+{
+    const int n = numruns - first;
+    Run *run = (Run *) safemalloc(n*sizeof(Run), "Can't merge runs", "");
+    int *heap = (int *) safemalloc(n*sizeof(int), "Can't merge runs", "");
+    DictCell *cells;
+    HashCell *merged;
+    FILE *f = NULL;
+    Word word;
+    int numheap, numcells, i, k, r;
+
+    for (r=0; r<n; r++) {
+      run[r].f = runs[first + r].f;
+      if (fseek(run[r].f, 0L, SEEK_SET) ||
+	  !read_ints(run[r].f, &(run[r].numfields), 1) ||
+	  (run[r].numfields < 0))
+	die("Can't read a run of", "words");
+      run[r].names = (Word *) safemalloc(run[r].numfields*sizeof(Word) + 1,
+					 "Can't merge runs", "");
+      run[r].fields = (int *) safemalloc(run[r].numfields*sizeof(int) + 1,
+					 "Can't merge runs", "");
+      for (i=0; i<run[r].numfields; i++) {
+	if (!ReadWord(run[r].f, run[r].names[i]))
+	  die("Can't read a run of", "words");
+	GetHashTable(run[r].names[i]);
+	}
+      run[r].refs = NULL;
+      run[r].size = 0;
+      }
+    qsort(fieldtable, (size_t)numfields, sizeof(ExHashTable), CompareFields);
+    for (r=0; r<n; r++) {
+      for (i=0; i<run[r].numfields; i++) {
+	for (k=0; strcmp(fieldtable[k].thefield, run[r].names[i]); k++) { }
+	run[r].fields[i] = k;
+	}
+      free(run[r].names);
+      }
+
+    /* The runs not yet merged are kept in a heap, the run whose word
+       comes first on top.  A term's cells are gathered from the runs
+       until the next term comes up. */
+
+    for (r=0, numheap=0; r<n; r++) {
+      ReadRun(run + r);
+      if (run[r].field >= 0) heap[numheap++] = r;
+      }
+    for (i=numheap/2 - 1; i>=0; i--)
+      SiftRun(run, heap, numheap, i);
+
+    cells = (DictCell *) safemalloc(numfields*sizeof(DictCell) + 1,
+				    "Can't merge runs", "");
+    merged = (HashCell *) safemalloc(numfields*sizeof(HashCell) + 1,
+				     "Can't merge runs", "");
+    for (k=0; k<numfields; k++) {
+      merged[k].term = 0;
+      merged[k].size = FEW_REFS;
+      cells[k].cell = merged + k;
+      }
+
+    if (d) StartDicts(d, termdict ? 1 : numfields);
+    else f = StartRun();
+
+    for (numcells=0; numheap>=0; ) {
+      Run *next = numheap > 0 ? run + heap[0] : NULL;
+
+      if ((numcells > 0) &&
+	  ((next == NULL) || strcmp(next->word, word) ||
+	   (!termdict && (next->field != cells[0].field)))) {
+	if (d)
+	  AddTerm(d, termdict ? 0 : cells[0].field, word, cells, numcells);
+	else
+	  for (k=0; k<numcells; k++)
+	    WriteCell(f, cells[k].field, word, merged + k);
+	numcells = 0;
+	}
+      if (next == NULL) break;
+
+      if ((numcells == 0) || (next->field != cells[numcells - 1].field)) {
+	strcpy(word, next->word);
+	cells[numcells].field = next->field;
+	merged[numcells++].number = 0;
+	}
+      GrowRefs(merged + numcells - 1, next->number);
+      memcpy((char *) (cell_refs(merged + numcells - 1) +
+		       merged[numcells - 1].number),
+	     (char *) next->refs, next->number*sizeof(int));
+      merged[numcells - 1].number += next->number;
+
+      ReadRun(next);
+      if (next->field < 0) heap[0] = heap[--numheap];
+      SiftRun(run, heap, numheap, 0);
+      }
+
+    for (r=0; r<n; r++) {
+      free(run[r].fields);
+      if (run[r].refs) free(run[r].refs);
+      }
+    free(run);
+    free(heap);
+    free(cells);
+    free(merged);
+
+    if (d) {
+      EndDicts(d);
+      FreeRuns();
+      }
+    else {
+      k = runs[first].merges + 1;
+      while (numruns > first) fclose(runs[--numruns].f);
+      EndRun(f, k);
+      ClearTables();
+      InitTables();
+      }
+}
+
+/* ----------------------------------------------------------------- *\
+|  void SpillTables(void)
+|
+|  Write the field tables to a new run and empty them.
+\* ----------------------------------------------------------------- */
+static void SpillTables(void)
+{
+    DictCell *cells;
+    FILE *f;
+    int totalcells, i;
+
+    cells = SortTables(&totalcells);
+    f = StartRun();
+    for (i=0; i<totalcells; i++)
+      WriteCell(f, cells[i].field, term_text(cells[i].cell->term),
+		cells[i].cell);
+    free(cells);
+    ClearTables();
+    InitTables();
+    EndRun(f, 0);
+
+    while ((numruns >= MERGE_RUNS) &&
+	   (runs[numruns - MERGE_RUNS].merges == runs[numruns - 1].merges))
+      MergeRuns(NULL, numruns - MERGE_RUNS);
+}
+
+/* ----------------------------------------------------------------- *\
+|  void AddTables(Dicts *d)
+|
+|  Write the words in the field tables as the dictionaries d.
+\* ----------------------------------------------------------------- */
+static void AddTables(Dicts *d)
+{
+    DictCell *cells;
+    int totalcells, i, j;
+
+    cells = SortTables(&totalcells);
+
+    StartDicts(d, termdict ? 1 : numfields);
+    for (i=0; i<totalcells; i=j) {
+      for (j=i+1; termdict && (j<totalcells) &&
+		  (cells[j].cell->term == cells[i].cell->term); j++)
+	{ }
+      AddTerm(d, termdict ? 0 : cells[i].field,
+	      term_text(cells[i].cell->term), cells + i, j - i);
+      }
+    EndDicts(d);
+
+    free(cells);
+}
+
+/* ----------------------------------------------------------------- *\
+|  int EncodeEntry(unsigned char *out, long *offsets, long *lengths,
+|                  int i)
+|
+|  Store the i-th entry's place in the bib file in out and return its
+|  size in bytes; just return the size if out is null.  An entry is
+|  its distance from the end of the entry before it in the block
+|  (the first entry's offset is kept in the block), then its length.
+\* ----------------------------------------------------------------- */
+static int EncodeEntry(unsigned char *out, long *offsets, long *lengths,
+		       int i)
+{
+    int n = 0;
+
+    if (i % BIX_BLOCK)
+      n = bix_put_varint(out, offsets[i] - offsets[i - 1] - lengths[i - 1]);
+    return n + bix_put_varint(out ? out + n : NULL, lengths[i]);
+}
+
+/* ----------------------------------------------------------------- *\
+|  unsigned char *CompressText(BibFile *files, int numfiles,
+|                              long *offsets, long *lengths, int count,
+|                              int *texts, int *size)
+|
+|  Read the text of the count entries from the numfiles bib files
+|  and compress it a block of BIX_BLOCK entries at a time.  Return
+|  the compressed blocks, *size bytes in all, and store the offset
+|  of each block in texts.
+\* ----------------------------------------------------------------- */
+static unsigned char *CompressText(BibFile *files, int numfiles,
+				   long *offsets, long *lengths, int count,
+				   int *texts, int *size)
+{
+    unsigned char *text = NULL, *out = NULL;
+    long textsize = 0, outsize = 0, n;
+    int b, i, f = -1;
+    FILE *ifp = NULL;
+
+    *size = 0;
+    for (b = 0; b*BIX_BLOCK < count; b++) {
+      const int last = min(count, (b + 1)*BIX_BLOCK);
+
+      for (i = b*BIX_BLOCK, n = 0; i < last; i++) n += lengths[i];
+      if (n > textsize) {
+	if (text) free(text);
+	textsize = max(n, 2*textsize);
+	text = (unsigned char *) alloc(textsize);
+	}
+      if (*size + lz_bound(n) > outsize) {
+	unsigned char *old = out;
+
+	outsize = max(*size + lz_bound(n), 2*outsize);
+	out = (unsigned char *) alloc(outsize);
+	if (old) {
+	  memcpy((char *) out, (char *) old, *size);
+	  free(old);
+	  }
+	}
+
+      for (i = b*BIX_BLOCK, n = 0; i < last; n += lengths[i++]) {
+	if ((f < 0) || ((f + 1 < numfiles) && (files[f + 1].first <= i))) {
+	  if (ifp) fclose(ifp);
+	  while ((f + 1 < numfiles) && (files[f + 1].first <= i)) f++;
+	  ifp = fopen(files[f].name, "r");
+	  if (ifp == NULL) die("can't reopen", files[f].name);
+	  }
+	if (fseek(ifp, offsets[i] - files[f].base, SEEK_SET) ||
+	    (fread((void *) (text + n), sizeof(char), lengths[i], ifp) !=
+	     (size_t) lengths[i]))
+	  die("can't reread", files[f].name);
+	}
+
+      texts[b] = *size;
+      *size += lz_compress(out + *size, text, n);
+      }
+
+    if (text) free(text);
+    if (ifp) fclose(ifp);
+
+    return out;
+}
+
+/* ----------------------------------------------------------------- *\
+|  bool OutputTables(FILE *ofp, BibFile *files, int numfiles,
+|                    Entries *e, const Segment *seg)
+|
+|  Compress and output the tables, or the runs spilled from them, as
+|  the segment seg, with lots of user feedback.  Return false if the
+|  segment couldn't be written.
+\* ----------------------------------------------------------------- */
+
+bool OutputTables(FILE *ofp, BibFile *files, int numfiles, Entries *e,
+		  const Segment *seg)
+{
+    long *offsets = e->offsets, *lengths = e->lengths;
+    const int count = e->count;
+    register int i, j, k, n;
+    int strsize, offsize, textsize, names, defs, libs, libnames;
+    unsigned char *text = NULL;
+    int *texts = NULL;
+    Dicts d;
+    long start;
+    Out o;
+    struct { long offset, size; } dir[bix_sections];
+    Bix_preamble preamble;
+    Bix_section section;
+    Bix_block block;
+    Bix_field field;
+    Bix_file file;
+    Bix_segment segment;
+    Bix_hash hash;
+    Bix_macro macro;
+    Bix_library library;
+    time_t mod_time;
+    unsigned char gap[sizeof(long)*4];
+
+    /* printf("Writing index tables..."); */
+    fflush(stdout);
+
+    if (numruns > 0) {
+      SpillTables();
+      MergeRuns(&d, 0);
+      }
+    else
+      AddTables(&d);
+
+    for (k=0, strsize=0; k<numfields; k++)
+      strsize += strlen(fieldtable[k].thefield) + 1;
+
+    for (i=0, offsize=0; i<count; i++)
+      offsize += EncodeEntry(NULL, offsets, lengths, i);
+
+    textsize = 0;
+    if (embed) {
+      texts = (int *)
+	alloc(((count + BIX_BLOCK - 1)/BIX_BLOCK)*sizeof(int) + 1);
+      text = CompressText(files, numfiles, offsets, lengths, count, texts,
+			  &textsize);
+      }
+
+    /* A collection's file names follow the field names. */
+
+    for (k=0, names=strsize; collection && (k<numfiles); k++)
+      strsize += strlen(files[k].name) + 1;
+
+    /* So do the string definitions, which only an index's first segment
+       has. */
+
+    for (k=0, defs=strsize; k<nummacros; k++)
+      strsize += strlen(macros[k].name) + strlen(macros[k].value) + 2;
+
+    /* And so do the libraries' names, also only in the first segment. */
+
+    libs = seg->delta ? 0 : numlibraries;
+    for (k=0, libnames=strsize; k<libs; k++)
+      strsize += strlen(libraries[k].name) + 1;
+
+    /* Lay out the sections, then write them in order.  A collection's
+       modification time is its newest file's.  A segment added to an
+       index starts where the index ends. */
+
+    for (k=1, mod_time=files[0].mod_time; k<numfiles; k++)
+      mod_time = max(mod_time, files[k].mod_time);
+
+    OpenOut(&o, ofp);
+    bix_put64(preamble.mod_time, (unsigned long) mod_time);
+    bix_put32(preamble.sections, bix_sections);
+    bix_put32(preamble.entries, count);
+    dir[bix_entries].size =
+      ((count + BIX_BLOCK - 1)/BIX_BLOCK)*sizeof(Bix_block);
+    dir[bix_offsets].size = offsize;
+    dir[bix_fields].size = numfields*sizeof(Bix_field);
+    dir[bix_blocks].size = d.numblocks*sizeof(Bix_dblock);
+    dir[bix_dict].size = d.words.size;
+    dir[bix_strings].size = strsize;
+    dir[bix_refs].size = d.refs.size;
+    dir[bix_terms].size = termdict ? sizeof(Bix_field) : 0;
+    dir[bix_fsa].size = d.fsasize;
+    dir[bix_roots].size = automata ? d.numdicts*sizeof(Bix_u32) : 0;
+    dir[bix_text].size = textsize;
+    dir[bix_texts].size =
+      embed ? ((count + BIX_BLOCK - 1)/BIX_BLOCK)*sizeof(Bix_u32) : 0;
+    dir[bix_files].size = collection ? numfiles*sizeof(Bix_file) : 0;
+    dir[bix_segment].size = sizeof(Bix_segment);
+    dir[bix_hashes].size = e->hashes ? count*sizeof(Bix_hash) : 0;
+    dir[bix_macros].size = nummacros*sizeof(Bix_macro);
+    dir[bix_libraries].size = libs*sizeof(Bix_library);
+
+    start = seg->delta ? bix_align(out_pos(&o)) : bix_start(out_pos(&o));
+    dir[0].offset = bix_align(start + sizeof(preamble) +
+			      bix_sections*sizeof(section));
+    for (i = 1; i < bix_sections; i++)
+      dir[i].offset = bix_align(dir[i - 1].offset + dir[i - 1].size);
+
+    WritePad(&o, start);
+    OutBytes(&o, &preamble, sizeof(preamble));
+    bix_put32(section.unused, 0);
+    for (i = 0; i < bix_sections; i++) {
+      bix_put32(section.id, i);
+      bix_put64(section.offset, dir[i].offset);
+      bix_put64(section.size, dir[i].size);
+      OutBytes(&o, &section, sizeof(section));
+      }
+
+    WritePad(&o, dir[bix_entries].offset);
+    bix_put32(block.unused, 0);
+    for (i=0, j=0; i<count; i++) {
+      if (i % BIX_BLOCK == 0) {
+	bix_put64(block.offset, offsets[i]);
+	bix_put32(block.data, j);
+	OutBytes(&o, &block, sizeof(block));
+	}
+      j += EncodeEntry(NULL, offsets, lengths, i);
+      }
+
+    WritePad(&o, dir[bix_offsets].offset);
+    for (i=0; i<count; i++)
+      OutBytes(&o, gap, EncodeEntry(gap, offsets, lengths, i));
+
+    /* In a term index the fields have no words of their own. */
+
+    WritePad(&o, dir[bix_fields].offset);
+    for (k=0, i=0, j=0; k<numfields; k++) {
+      n = termdict ? 0 : d.numwords[k];
+      bix_put32(field.name, i);
+      bix_put32(field.first, termdict ? 0 : j);
+      bix_put32(field.numwords, n);
+      OutBytes(&o, &field, sizeof(field));
+      i += strlen(fieldtable[k].thefield) + 1;
+      j += (n + BIX_DICT_BLOCK - 1)/BIX_DICT_BLOCK;
+      }
+
+    WritePad(&o, dir[bix_blocks].offset);
+    if (d.blocks) {
+      OutBytes(&o, d.blocks, d.numblocks*sizeof(Bix_dblock));
+      free(d.blocks);
+      }
+
+    WritePad(&o, dir[bix_dict].offset);
+    CloseSpool(&o, &d.words);
+
+    WritePad(&o, dir[bix_strings].offset);
+    for (k=0; k<numfields; k++)
+      OutBytes(&o, fieldtable[k].thefield,
+	       strlen(fieldtable[k].thefield) + 1);
+    for (k=0; collection && (k<numfiles); k++)
+      OutBytes(&o, files[k].name, strlen(files[k].name) + 1);
+    for (k=0; k<nummacros; k++) {
+      OutBytes(&o, macros[k].name, strlen(macros[k].name) + 1);
+      OutBytes(&o, macros[k].value, strlen(macros[k].value) + 1);
+      }
+    for (k=0; k<libs; k++)
+      OutBytes(&o, libraries[k].name, strlen(libraries[k].name) + 1);
+
+    WritePad(&o, dir[bix_refs].offset);
+    CloseSpool(&o, &d.refs);
+
+    WritePad(&o, dir[bix_terms].offset);
+    if (termdict) {
+      bix_put32(field.name, 0);
+      bix_put32(field.first, 0);
+      bix_put32(field.numwords, d.numterms);
+      OutBytes(&o, &field, sizeof(field));
+      }
+
+    WritePad(&o, dir[bix_fsa].offset);
+    if (d.fsadata) {
+      OutBytes(&o, d.fsadata, d.fsasize);
+      free(d.fsadata);
+      }
+
+    WritePad(&o, dir[bix_roots].offset);
+    if (automata) WriteInts(&o, d.roots, d.numdicts);
+
+    WritePad(&o, dir[bix_text].offset);
+    if (embed) {
+      OutBytes(&o, text, textsize);
+      free(text);
+      }
+
+    WritePad(&o, dir[bix_texts].offset);
+    if (embed) {
+      WriteInts(&o, texts, dir[bix_texts].size/sizeof(Bix_u32));
+      free(texts);
+      }
+
+    WritePad(&o, dir[bix_files].offset);
+    for (k=0; collection && (k<numfiles); k++) {
+      bix_put32(file.name, names);
+      bix_put32(file.first, files[k].first);
+      bix_put64(file.base, files[k].base);
+      bix_put64(file.mod_time, (unsigned long) files[k].mod_time);
+      OutBytes(&o, &file, sizeof(file));
+      names += strlen(files[k].name) + 1;
+      }
+
+    WritePad(&o, dir[bix_segment].offset);
+    bix_put64(segment.next, bix_align(dir[bix_sections - 1].offset +
+				      dir[bix_sections - 1].size));
+    bix_put64(segment.size, seg->size);
+    bix_put32(segment.first, seg->first);
+    bix_put32(segment.replaced, seg->replaced);
+    bix_put32(segment.gap, e->hashes ? e->tail : 0);
+    bix_put32(segment.unused, 0);
+    OutBytes(&o, &segment, sizeof(segment));
+
+    WritePad(&o, dir[bix_hashes].offset);
+    for (i=0; e->hashes && (i<count); i++) {
+      bix_put32(hash.text, e->hashes[2*i]);
+      bix_put32(hash.gap, e->hashes[2*i + 1]);
+      OutBytes(&o, &hash, sizeof(hash));
+      }
+
+    WritePad(&o, dir[bix_macros].offset);
+    for (k=0; k<nummacros; k++) {
+      bix_put32(macro.entry, macros[k].entry);
+      bix_put32(macro.name, defs);
+      defs += strlen(macros[k].name) + 1;
+      bix_put32(macro.value, defs);
+      defs += strlen(macros[k].value) + 1;
+      OutBytes(&o, &macro, sizeof(macro));
+      }
+
+    WritePad(&o, dir[bix_libraries].offset);
+    bix_put32(library.unused, 0);
+    for (k=0; k<libs; k++) {
+      bix_put32(library.name, libnames);
+      bix_put64(library.mod_time, (unsigned long) libraries[k].mod_time);
+      OutBytes(&o, &library, sizeof(library));
+      libnames += strlen(libraries[k].name) + 1;
+      }
+
+    free(d.numwords);
+    free(d.roots);
+
+    /* printf("[%d fields, %d terms, %d refs]\n", numfields, d.numterms,
+	      d.refs.size); */
+
+    return CloseOut(&o, ofp);
+}
+
+
+
+static void init_fold(void) {
+
+  /* Set up fold to map each character to lower case, and each white space
+     character to a space, and wordchar to map each character to its folded
+     alphanumeric or a space. */
+
+  int c;
+
+  for (c = 0; c < 256; c++) {
+    fold[c] = isupper(c) ? tolower(c) : (isspace(c) ? ' ' : c);
+    wordchar[c] = isalnum((unsigned char) fold[c]) ? fold[c] : ' ';
+    }
+
+  } /* init_fold */
+
+
+
+static void advance_run(int a, int b, bool keep) {
+
+  /* Advance the current character as advance_char() would until it's a, b,
+     or the end of the input, or a tex control sequence is skipped; if keep,
+     add the characters passed over after the current one to the string
+     buffer.  The characters up to the next a, b, back slash or nul can only
+     be folded, so they're passed over together. */
+
+  const unsigned long
+    sa = repeat_byte(a), sb = repeat_byte(b), sc = repeat_byte('\\'),
+    nl = repeat_byte('\n');
+  const unsigned char * p = input;
+  unsigned long v;
+  long n;
+
+  while (p + sizeof(v) <= input_end) {
+    memcpy((char *) &v, (const char *) p, sizeof(v));
+    if (zero_bytes(v) | zero_bytes(v ^ sa) | zero_bytes(v ^ sb) |
+	zero_bytes(v ^ sc))
+      break;
+    line_no += count_bytes(zero_bytes(v ^ nl));
+    p += sizeof(v);
+    }
+  while ((p < input_end) && *p && (*p != a) && (*p != b) && (*p != '\\')) {
+    if (*p == '\n') line_no++;
+    p++;
+    }
+
+  n = p - input;
+  if (keep) {
+    _resize_sbuff(n);
+    for (p = input; p < input + n; p++)
+      sbuff[sbuff_end++] = wordchar[*p];
+    }
+  char_no += n;
+  input += n;
+
+  advance_char();
+
+  } /* advance_run */
+
+
+
+static char * getword(char * stop, const char * fname) {
+
+  /* Read the next word from input and return a pointer to it.  Initial white
+     space is skipped, and the word ends with a white space character or one of
+     the characters given in stop.  The value returned is valid up until the
+     next call to getword().  If something goes wrong, return NULL. */
+
+  static char word[MAXWORD];
+  const char * word_end = word + MAXWORD - 1;
+  char * wordp;
+
+  wordp = word;
+  skipwhite_char();
+  while (!isspace(current_char())&&!strchr(stop,current_char())&&!eof_char()) {
+    if (wordp >= word_end) {
+      emsg0("word too long");
+      return NULL;
+      }
+    *wordp++ = current_char();
+    advance_char();
+    }
+  if (eof_char()) {
+    emsg0("eof in word"); 
+    return NULL;
+    }
+
+  skipwhite_char();
+  if (!strchr(stop, current_char())) {
+    emsg2("charcter '%c' not in word ending characters \"%s\"",
+	  current_char(), stop);
+    return NULL;
+    }
+  *wordp = '\0';
+
+  return word;
+
+  } /* getword */
+
+
+
+static bool parse_bracketed_string(const char * fname) {
+
+  /* With the current character at the opening bracket, read the bracketed
+     string from input and store it in the string buffer.  If all goes well,
+     upon return the current character is the first character after the
+     closing bracket. */
+
+  int bracket_count = 1;
+
+  assert(current_char() == '{');
+  advance_char();
+
+  loop {
+         if (current_char() == '{') bracket_count++;
+    else if ((current_char() == '}') && (bracket_count-- == 1)) break;
+    else if (eof_char()) {
+      emsg0("eof during string parse");
+      return false;
+      }
+    addchar_sbuff(current_char());
+    advance_run('{', '}', true);
+    }
+  advance_char();
+
+  return true;
+
+  } /* parse_bracketed_string */
+
+
+static bool parse_quoted_string(const char * fname) {
+
+  /* With the current character at the opening double quote, read the quoted
+     string from input and store it in the string buffer.  If all goes well,
+     upon return the current character is the first character after the
+     closing double quote. */
+
+  assert(current_char() == '"');
+  advance_char();
+
+  loop {
+         if (current_char() == '{') {
+	   if (!parse_bracketed_string(fname)) return false;
+	   }
+    else if (current_char() == '"') break;
+    else if (eof_char()) {
+      emsg0("eof during string parse");
+      return false;
+      }
+    else {
+      addchar_sbuff(current_char());
+      advance_run('{', '"', true);
+      }
+    }
+
+  advance_char();
+
+  return true;
+
+  } /* parse_quoted_string */
+
+
+
+/* The strings used in the string in the string buffer but not copied into
+   it, each with the place in the buffer its text would start. */
+
+   typedef struct {
+     long at;
+     const char * str;
+     } String_use;
+
+   static String_use * uses = NULL;
+   static int numuses = 0, usespace = 0;
+
+
+static bool parse_string(const bool expand, const char * fname) {
+
+  /* Read a string from input and assemble it in the string buffer.  The text
+     of each string used is copied into the buffer if expand, and otherwise
+     noted in uses.  Return true iff the string was read without error. */
+
+  char * wordp;
+
+  reset_sbuff();
+  numuses = 0;
+
+  loop {
+    skipwhite_char();
+         if (eof_char()) {
+	   emsg0("Unexpected eof in string");
+	   return false;
+	   }
+    else if (current_char() == '"') {
+           if (!parse_quoted_string(fname)) return false;
+	   }
+    else if (current_char() == '{') {
+           if (!parse_bracketed_string(fname)) return false;
+	   }
+    else {
+      wordp = getword("#,)}", fname);
+      if (wordp == NULL) return false;
+
+      /* Index the string name and the string (if defined). */
+
+      if (*wordp != eos) {
+	char * str = find_strtbl(wordp);
+
+	addstring_sbuff(wordp);
+	addchar_sbuff(' ');
+	if ((str != NULL) && expand) addstring_sbuff(str);
+	else if (str != NULL) {
+	  if (numuses == usespace) {
+	    usespace = max(2*usespace, 16);
+	    uses = (String_use *) realloc(uses, usespace*sizeof(String_use));
+	    assert(uses);
+	    }
+	  uses[numuses].at = sbuff_end;
+	  uses[numuses++].str = str;
+	  }
+	}
+      }
+
+    skipwhite_char();
+    switch (current_char()) {
+      case '#': advance_char(); break;
+
+      case ',': advance_char();
+      case ')': 
+      case '}': return true;
+
+      default : emsg1("Bad string separator '%c'", current_char());
+		return false;
+      }
+    }
+
+  return false;
+
+  } /* parse_string */
+
+
+
+static void index_string(
+  ExHashTable * ht, const char * str, const int entry_no, const char * fname) {
+
+  /* Index the words of the string text str, used in entry entry_no, under
+     the field with table ht, from their terms. */
+
+  const Expansion * x = GetExpansion(str);
+  int k;
+
+  for (k = 0; k < x->count; k++) {
+    const int t = expterms[x->first + k];
+
+    if (t >= 0) InsertTerm(ht, t, entry_no);
+    else {
+      const char * w = str - 1 - t;
+      char word[MAXWORD];
+
+      memcpy(word, w, min(MAXWORD/2, 30));
+      strcpy(word + min(MAXWORD/2, 30), "...");
+      wmsg2("too-long %d-character word \"%s\" not indexed",
+	    (int) strcspn(w, " "), word);
+      }
+    }
+
+  } /* index_string */
+
+
+
+static bool parse_fields(
+  const bool is_string, const int entry_no, const char * fname) {
+
+  /* Read the fields for an entry from input; if is_string is true, the entry
+     is a string definition, otherwise it's a reference. */
+
+  loop {
+    char * wordp, name[MAXWORD];
+
+    skipwhite_char();
+    if (current_char() == ',') advance_char();
+    if ((current_char() == '}') || (current_char() == ')')) break;
+
+    wordp = getword("=", fname);
+    if (wordp == NULL) {
+      emsg0("missing field name");
+      return false;
+      }
+    advance_char();
+    copy_str(wordp, name);
+
+    if (!parse_string(is_string, fname)) return false;
+    
+    addchar_sbuff(' ');
+    addchar_sbuff(eos);
+
+    if (is_string) {
+      add_strtbl(name, getstring_sbuff());
+      AddMacro(entry_no, name, getstring_sbuff());
+      }
+    else {
+
+      /* Index the words in string under the field name. */
+
+      ExHashTable *ht = GetHashTable(name);
+      int u = 0;
+
+      wordp = getstring_sbuff();
+
+      loop {
+	char * ep;
+        unsigned wlen;
+
+	while (*wordp == ' ') wordp++;
+	for (; (u < numuses) && (uses[u].at <= wordp - sbuff); u++)
+	  index_string(ht, uses[u].str, entry_no, fname);
+	if (!(*wordp)) break;
+	ep = strchr(wordp, ' ');
+	assert(ep);
+	*ep = eos;
+
+	wlen = ep - wordp;
+	/* fprintf(stderr, "wlen = %d.\n", wlen); */
+	if (1 < wlen) {
+	  if (wlen < MAXWORD) 
+	    InsertEntry(ht, wordp, entry_no);
+	  else {
+	    strcpy(wordp + min(MAXWORD/2, 30), "...");
+	    wmsg2("too-long %d-character word \"%s\" not indexed",
+		  wlen, wordp);
+	    }
+	  }
+
+	wordp = ep + 1;
+	}
+      }
+    }
+
+  return true;
+
+  } /* parse_fields */
+
+
+
+#define max_ename_size 13 /* inproceedings or mastersthesis */
+
+static long find_entry(bool * is_string) {
+
+  /* Look for the next entry in input.  Return the location if found or -1 if
+     there's no more entries.  Upon successful return, the current character
+     will be the one immedately after the opening bracket or parens. */
+       
+  int ename_size, location;
+  char ename[max_ename_size + 1];
+
+  loop {
+    while (!eof_char() && (current_char() != '@')) advance_run('@', '@', false);
+    if (eof_char()) return -1;
+    location = char_no;
+    advance_char();
+
+    /* If the '@' is the start of a reference, it will be followed by a word
+       that's not too big, which will be followed by some optional white space
+       and either an open parens or brace.  If any of this isn't true, the '@'
+       didn't start a reference. (Note that if all of this is true, the '@' may
+       still not start a reference since the code doesn't check to see if the
+       word is a valid reference type.  Oh well.) */
+
+    ename_size = 0;
+    skipwhite_char();
+    while ((ename_size < max_ename_size) && isalpha(current_char())) {
+      ename[ename_size++] = current_char();
+      advance_char();
+      }
+    ename[ename_size] = eos;
+
+    skipwhite_char();
+    if ((current_char() != '{') && (current_char() != '(')) continue;
+    
+    *is_string = (strcmp(ename, "string") ? false : true);
+    break;
+    }
+       
+  advance_char();
+
+  return (long) location;
+
+  } /* find_entry */
+
+
+
+static long parse_entry(
+  const int entry_no, const char * fname, long * end) {
+
+  /* Parse the next entry in the bibliography file having name fname.
+     Return 
+         -2  on error.
+         -1  on end of file.
+       > -1  the entry's start in the file, with the offset just past the
+             entry's closing bracket stored in end. */
+
+  char * wordp;
+  bool is_string;
+  long location;
+
+  do {
+    location = find_entry(&is_string);
+    if (location < 0) return location;
+
+    if (!is_string) {
+      wordp = getword(",", fname);
+      if (wordp == NULL) {
+	emsg0("missing reference key");
+	return -2;
+	}
+      advance_char();
+      }
+
+    if (!parse_fields(is_string, entry_no, fname)) return -2;
+    if (item_start < 0) item_start = location;
+    item_end = char_no + 1;
+    }
+  while (is_string);
+
+  *end = char_no + 1;
+
+  return (long) location;
+
+  } /* parse_entry */
 
-	fwrite((void *) &(fieldtable[k].number), sizeof(int), 1, ofp);
 
-	count = 0;
-	for (i=0; i<fieldtable[k].number; i++)
-	{
-	    WriteWord(ofp, words[i].theword);
-	    fwrite((void *) &(words[i].number), sizeof(int), 1, ofp);
-	    fwrite((void *) words[i].refs, sizeof(int),
-		   words[i].number, ofp);
-	    count += words[i].number;
-	}
 
-	/* printf("[%d words, %d refs]\n", fieldtable[k].number, count); */
+static void AddEntry(Entries * e, long offset, long length) {
+
+  /* Add the entry at offset, length bytes long, to the end of e. */
+
+  if (e->count == e->space) {
+    long *oldoff = e->offsets, *oldlen = e->lengths;
+
+    e->space *= 2;
+    e->offsets = (long *) alloc(e->space*sizeof(long));
+    memcpy((char *) e->offsets, (char *) oldoff, e->count*sizeof(long));
+    free(oldoff);
+    e->lengths = (long *) alloc(e->space*sizeof(long));
+    memcpy((char *) e->lengths, (char *) oldlen, e->count*sizeof(long));
+    free(oldlen);
     }
-}
 
+  e->offsets[e->count] = offset;
+  e->lengths[e->count++] = length;
 
+  } /* AddEntry */
 
-static char * getword(FILE * fid, char * stop, const char * fname) {
 
-  /* Read the next word from input and return a pointer to it.  Initial white
-     space is skipped, and the word ends with a white space character or one of
-     the characters given in stop.  The value returned is valid up until the
-     next call to getword().  If something goes wrong, return NULL. */
 
-  static char word[MAXWORD];
-  const char * word_end = word + MAXWORD - 1;
-  char * wordp;
+static bool ParseEntries(
+  const unsigned char * text, long size, int line, BibFile * file,
+  Entries * e) {
 
-  wordp = word;
-  skipwhite_char();
-  while (!isspace(current_char())&&!strchr(stop,current_char())&&!eof_char()) {
-    if (wordp >= word_end) {
-      emsg0("word too long");
-      return NULL;
-      }
-    *wordp++ = current_char();
-    advance_char();
+  /* Parse the size bytes of the bibliography file described by file at text,
+     which start on the given line, and add their entries to e, numbering
+     them on from the entries already there.  Return true if all of the bytes
+     were parsed. */
+
+  long curoffset, curend;
+
+  init_char(text, size);
+  line_no = line;
+  _fillbuffer_char();
+  file->first = e->count;
+  item_start = -1;
+  item_end = 0;
+
+  loop {
+    curoffset = parse_entry(e->count, file->name, &curend);
+    if (curoffset < 0) break;
+    AddEntry(e, file->base + curoffset, curend - curoffset);
+    if (membudget && (TableBytes() > membudget)) SpillTables();
     }
-  if (eof_char()) {
-    emsg0("eof in word"); 
+
+  return (curoffset == -1);
+
+  } /* ParseEntries */
+
+
+
+static bool ReadBibFile(
+  const unsigned char * text, long size, BibFile * file, Entries * e) {
+
+  /* Read the size bytes of the bibliography file described by file at text
+     and add its entries to e, numbering them on from the entries already
+     there.  Return true if the whole file was read. */
+
+  const bool success = ParseEntries(text, size, 0, file, e);
+
+  clear_strtbl();
+  ClearExpansions();
+
+  return success;
+
+  } /* ReadBibFile */
+
+
+
+static unsigned char * ReadWhole(FILE * ifp, long * size) {
+
+  /* Return all of the file ifp, *size bytes, or null if it can't be read. */
+
+  struct stat st;
+  unsigned char * text;
+
+  if (fstat(fileno(ifp), &st) || fseek(ifp, 0L, SEEK_SET)) return NULL;
+  *size = st.st_size;
+  text = (unsigned char *) alloc(*size + 1);
+  if (fread((void *) text, sizeof(char), *size, ifp) != (size_t) *size) {
+    free(text);
     return NULL;
     }
 
-  skipwhite_char();
-  if (!strchr(stop, current_char())) {
-    emsg2("charcter '%c' not in word ending characters \"%s\"",
-	  current_char(), stop);
+  return text;
+
+  } /* ReadWhole */
+
+
+
+static long FindStringDef(const unsigned char * p, long n) {
+
+  /* Return the offset in the n bytes at p of the first '@' that might define
+     a string, or -1 if there's none.  An '@' might if it's followed by
+     "string" in any case. */
+
+  const unsigned char * start = p, * end = p + n;
+
+  for (; p < end; p++)
+    if (*p == '@') {
+      const unsigned char * q = p + 1;
+      const char * s = "string";
+
+      while ((q < end) && isspace(*q)) q++;
+      while ((q < end) && *s && (tolower(*q) == *s)) q++, s++;
+      if (!*s) return p - start;
+      }
+
+  return -1;
+
+  } /* FindStringDef */
+
+#define StringDef(_p, _n) \
+  (FindStringDef(_p, _n) >= 0)
+
+
+#define gap_hash(_p, _n) \
+  ((bix_hash(BIX_HASH_INIT, _p, _n) & ~1UL) | StringDef(_p, _n))
+
+static void HashEntries(const unsigned char * text, Entries * e, long start,
+			long end) {
+
+  /* Hash the entries in e and the gaps before them, given the text of their
+     bib file.  The first entry's gap starts at start, and the gap after the
+     last entry ends at end. */
+
+  int i;
+
+  e->hashes = (unsigned long *) alloc((2*e->count + 1)*sizeof(unsigned long));
+  for (i = 0; i < e->count; i++) {
+    e->hashes[2*i] =
+      bix_hash(BIX_HASH_INIT, text + e->offsets[i], e->lengths[i]);
+    e->hashes[2*i + 1] = gap_hash(text + start, e->offsets[i] - start);
+    start = e->offsets[i] + e->lengths[i];
+    }
+  e->tail = gap_hash(text + start, end - start);
+
+  } /* HashEntries */
+
+
+
+#define new_entries(_e) \
+  do {(_e).count = 0; \
+      (_e).space = 128; \
+      (_e).offsets = (long *) alloc((_e).space*sizeof(long)); \
+      (_e).lengths = (long *) alloc((_e).space*sizeof(long)); \
+      (_e).hashes = NULL; \
+     } while (0)
+
+#define free_entries(_e) \
+  do {free((_e).offsets); free((_e).lengths); \
+      if ((_e).hashes) free((_e).hashes); } while (0)
+
+/* A big bib file is read in chunks at once, each by a process of its own.
+   The chunks are split just before '@'s starting a line.  Each process starts
+   with the strings defined before its chunk, found by parsing only the string
+   definitions ahead of it, and writes its chunk's entries, definitions, and
+   field tables to a temp file as
+
+	whole chunk read?, # entries, # string definitions
+	first item's offset, offset past the last item
+	entry offsets, entry lengths
+	    string's entry, name length, name, value length, value
+	# fields
+	    field name, # words
+		word, # entries, entries
+
+   and its messages to another, where an item is an entry or a string
+   definition.  The chunks are merged in order, renumbering their entries; if
+   a chunk doesn't start where the whole file's items would, or doesn't define
+   the strings found ahead of it, or anything else goes wrong, the file is read
+   whole instead. */
+
+#define MIN_CHUNK	(1L << 20)	/* the smallest chunk worth splitting */
+#define MAX_CHUNKS	64
+
+static void WriteChunk(
+  FILE * f, const Entries * e, bool whole, long base, int defs) {
+
+  /* Write the chunk starting at base with entries e, whole if it was all
+     read, the string definitions from the defs-th on, and the words in the
+     field tables to f. */
+
+  int head[3], i, j, n;
+  long ends[2];
+
+  head[0] = whole;
+  head[1] = e->count;
+  head[2] = nummacros - defs;
+  write_ints(f, head, 3);
+  ends[0] = item_start < 0 ? -1 : base + item_start;
+  ends[1] = base + item_end;
+  fwrite((void *) ends, sizeof(long), 2, f);
+  fwrite((void *) e->offsets, sizeof(long), e->count, f);
+  fwrite((void *) e->lengths, sizeof(long), e->count, f);
+
+  for (i = defs; i < nummacros; i++) {
+    write_ints(f, &(macros[i].entry), 1);
+    WriteString(f, macros[i].name);
+    WriteString(f, macros[i].value);
+    }
+
+  for (i = 0, n = 0; i < numfields; i++)
+    if (fieldtable[i].words != NULL) n++;
+  write_ints(f, &n, 1);
+
+  for (i = 0; i < numfields; i++)
+    if (fieldtable[i].words != NULL) {
+      const ExHashTable * ht = fieldtable + i;
+
+      WriteString(f, ht->thefield);
+      write_ints(f, &(ht->number), 1);
+      for (j = 0; j < ht->size; j++)
+	if (ht->words[j].term) {
+	  const HashCell * cell = ht->words + j;
+
+	  WriteString(f, term_text(cell->term));
+	  write_ints(f, &(cell->number), 1);
+	  write_ints(f, cell_refs(cell), cell->number);
+	  }
+      }
+
+  } /* WriteChunk */
+
+
+
+static char * ReadChunkString(FILE * f) {
+
+  /* Return the next string in the chunk f, or null if there's none. */
+
+  char * s;
+  int n;
+
+  if (!read_ints(f, &n, 1) || (n < 1)) return NULL;
+  s = (char *) alloc(n);
+  if ((fread((void *) s, sizeof(char), n, f) != (size_t) n) || s[n - 1]) {
+    free(s);
     return NULL;
     }
-  *wordp = '\0';
 
-  return word;
+  return s;
 
-  } /* getword */
+  } /* ReadChunkString */
 
 
 
-static bool parse_bracketed_string(FILE * fid, const char * fname) {
+static bool MergeChunk(
+  FILE * f, const unsigned char * text, long start, long * end, Entries * e,
+  const Macro * defs, int numdefs) {
 
-  /* With the current character at the opening bracket, read the bracketed
-     string from fid and store it in the string buffer.  If all goes well, upon
-     return the current character is the first character after the closing
-     bracket. */
+  /* Add the entries, string definitions, and words of the chunk starting at
+     start in the bib file text, read from f, to e, the definitions, and the
+     field tables, numbering its entries on from e's.  The items before the
+     chunk end at *end, which is set to where the chunk's items end.  Return
+     false if the chunk wasn't read whole, if the text from *end to start
+     holds an '@' or a tex control sequence, so the whole file's items might
+     not be found where the chunk's are, or if the chunk doesn't make the
+     numdefs string definitions at defs. */
 
-  int bracket_count = 1;
+  const int base = e->count;
+  int head[3], numfields, numwords, n, space = 0, * refs = NULL, i, j;
+  long ends[2], offset, length;
+  Word field, word;
+  bool ok;
 
-  assert(current_char() == '{');
-  advance_char();
+  if (!read_ints(f, head, 3) || !head[0] || (head[1] < 0) ||
+      (head[2] != numdefs) ||
+      (fread((void *) ends, sizeof(long), 2, f) != 2) ||
+      (ends[0] < start) || (*end > start) ||
+      memchr(text + *end, '@', start - *end) ||
+      memchr(text + *end, '\\', start - *end))
+    return false;
+  *end = ends[1];
 
-  loop {
-         if (current_char() == '{') bracket_count++;
-    else if ((current_char() == '}') && (bracket_count-- == 1)) break;
-    else if (eof_char()) {
-      emsg0("eof during string parse");
-      return false;
+  for (i = 0; i < head[1]; i++) {
+    if (fread((void *) &offset, sizeof(long), 1, f) != 1) return false;
+    AddEntry(e, offset, 0);
+    }
+  for (i = 0; i < head[1]; i++) {
+    if (fread((void *) &length, sizeof(long), 1, f) != 1) return false;
+    e->lengths[base + i] = length;
+    }
+
+  for (i = 0, ok = true; ok && (i < numdefs); i++) {
+    char * name, * value = NULL;
+
+    ok = read_ints(f, &n, 1) && ((name = ReadChunkString(f)) != NULL);
+    if (!ok) break;
+    value = ReadChunkString(f);
+    ok = (value != NULL) && !strcmp(name, defs[i].name) &&
+	 !strcmp(value, defs[i].value);
+    if (ok) AddMacro(base + n, name, value);
+    free(name);
+    if (value != NULL) free(value);
+    }
+
+  ok = ok && read_ints(f, &numfields, 1);
+  for (i = 0; ok && (i < numfields); i++) {
+    ExHashTable * ht;
+
+    ok = ReadWord(f, field) && read_ints(f, &numwords, 1);
+    if (!ok) break;
+    ht = GetHashTable(field);
+
+    for (j = 0; ok && (j < numwords); j++) {
+      ok = ReadWord(f, word) && read_ints(f, &n, 1) && (n > 0);
+      if (!ok) break;
+      if (n > space) {
+	if (refs != NULL) free(refs);
+	space = max(n, 2*space);
+	refs = (int *) alloc(space*sizeof(int));
+	}
+      ok = read_ints(f, refs, n);
+      if (ok) AppendRefs(ht, word, refs, n, base);
       }
-    addchar_sbuff(current_char());
-    advance_char();
     }
-  advance_char();
 
-  return true;
+  if (refs != NULL) free(refs);
 
-  } /* parse_bracketed_string */
+  return ok;
 
+  } /* MergeChunk */
 
-static bool parse_quoted_string(FILE * fid, const char * fname) {
 
-  /* With the current character at the opening double quote, read the quoted
-     string from fid and store it in the string buffer.  If all goes well, upon
-     return the current character is the first character after the closing
-     double quote. */
 
-  assert(current_char() == '"');
-  advance_char();
+static void CopyMessages(FILE * f) {
 
-  loop {
-         if (current_char() == '{') {
-	   if (!parse_bracketed_string(fid, fname)) return false;
-	   }
-    else if (current_char() == '"') break;
-    else if (eof_char()) {
-      emsg0("eof during string parse");
-      return false;
-      }
-    else {
-      addchar_sbuff(current_char());
-      advance_char();
+  /* Copy the messages in f to stderr. */
+
+  char buf[BUFSIZ];
+  size_t n;
+
+  fflush(f);
+  rewind(f);
+  while ((n = fread((void *) buf, sizeof(char), sizeof(buf), f)) > 0)
+    fwrite((void *) buf, sizeof(char), n, stderr);
+
+  } /* CopyMessages */
+
+
+
+static void ParseStringDefs(
+  const unsigned char * text, long start, long end, long size,
+  const char * fname) {
+
+  /* Parse the string definitions starting in [start, end) in the size bytes
+     of the bib file fname at text, quietly, without parsing the rest. */
+
+  const int level = verbage_level;
+  long p;
+
+  verbage_level = 0;
+  while ((p = FindStringDef(text + start, end - start)) >= 0) {
+    bool is_string;
+
+    start += p;
+    init_char(text + start, size - start);
+    _fillbuffer_char();
+    if ((find_entry(&is_string) == 0) && is_string)
+      (void) parse_fields(true, 0, fname);
+    start++;
+    }
+  verbage_level = level;
+
+  } /* ParseStringDefs */
+
+
+
+static bool ReadChunks(
+  const unsigned char * text, long size, BibFile * file, Entries * e) {
+
+  /* Read the size bytes of the bibliography file described by file at text,
+     in chunks at once if it's big enough, and add its entries to e.  Return
+     true if the whole file was read. */
+
+  long split[MAX_CHUNKS + 1], p;
+  FILE * data[MAX_CHUNKS], * msgs[MAX_CHUNKS];
+  int pids[MAX_CHUNKS], defs[MAX_CHUNKS + 1], n, k, i, status, lines;
+  Macro * found;
+  bool ok;
+
+  n = min(min(chunks, MAX_CHUNKS), size/MIN_CHUNK);
+  split[0] = 0;
+  for (k = 1, i = 1; i < n; i++) {
+    p = (size/n)*i;
+    while ((p < size) && ((text[p] != '@') || (text[p - 1] != '\n'))) p++;
+    if ((p < size) && (p > split[k - 1])) split[k++] = p;
+    }
+  split[k] = size;
+  n = k;
+  if (n < 2) return ReadBibFile(text, size, file, e);
+
+  for (i = 0, ok = true; i < n; i++) {
+    data[i] = tmpfile();
+    msgs[i] = tmpfile();
+    ok = ok && (data[i] != NULL) && (msgs[i] != NULL);
+    }
+
+  /* Start each chunk's process with the strings defined ahead of it. */
+
+  for (i = 0, lines = 0; i < n; i++) {
+    defs[i] = nummacros;
+    fflush(NULL);
+    pids[i] = ok ? fork() : -1;
+    if (pids[i] == 0) {
+      BibFile chunk;
+      Entries c;
+      const long base = max(split[i] - 1, 0);
+
+      chunk = *file;
+      chunk.base = base;
+      messages = msgs[i];
+      new_entries(c);
+      InitTables();
+      ok = ParseEntries(text + base, split[i + 1] - base, lines, &chunk, &c);
+      WriteChunk(data[i], &c, ok, base, defs[i]);
+      exit((fflush(data[i]) || ferror(data[i])) ? 1 : 0);
       }
+    if (pids[i] < 0) ok = false;
+    if (ok) ParseStringDefs(text, split[i], split[i + 1], size, file->name);
+    for (p = max(split[i], 1); p < split[i + 1]; p++)
+      if (text[p] == '\n') lines++;
     }
+  defs[n] = nummacros;
+
+  for (i = 0; i < n; i++)
+    if (pids[i] > 0)
+      if ((waitpid(pids[i], &status, 0) < 0) || (status & 0xffff))
+	ok = false;
+
+  /* The chunks' own definitions replace the ones found ahead of them. */
+
+  found = macros;
+  k = nummacros;
+  macros = NULL;
+  nummacros = macrospace = 0;
+  for (i = 0, p = 0; ok && (i < n); i++) {
+    rewind(data[i]);
+    ok = MergeChunk(data[i], text, split[i], &p, e, found + defs[i],
+		    defs[i + 1] - defs[i]);
+    }
+  while (k > 0) {
+    k--;
+    free(found[k].name);
+    free(found[k].value);
+    }
+  if (found != NULL) free(found);
 
-  advance_char();
+  /* Pass on the chunks' messages in order, or start again. */
 
-  return true;
+  if (ok)
+    for (i = 0; i < n; i++) CopyMessages(msgs[i]);
+  for (i = 0; i < n; i++) {
+    if (data[i] != NULL) fclose(data[i]);
+    if (msgs[i] != NULL) fclose(msgs[i]);
+    }
+  clear_strtbl();
+  ClearExpansions();
+  if (ok) return true;
 
-  } /* parse_quoted_string */
+  verbage(3, (stdout, "Reading %s whole.\n", file->name));
+  free_entries(*e);
+  new_entries(*e);
+  FreeTables();
+  InitTables();
+  FreeMacros();
 
+  return ReadBibFile(text, size, file, e);
 
+  } /* ReadChunks */
 
-static bool parse_string(FILE * fid, const char * fname) {
 
-  /* Read a string from fid and assemble it in the string buffer.  Return true
-     iff the string was read without error. */
 
-  char * wordp;
+static bool IndexBibFile(FILE *ifp, FILE *ofp, char *filename) {
 
-  reset_sbuff();
+  /* Read the bibliography file ifp having name filename and write the index
+     file ofp.  The entries are hashed so segments can be added to the index
+     later. */ 
 
-  loop {
-    skipwhite_char();
-         if (eof_char()) {
-	   emsg0("Unexpected eof in string");
-	   return false;
-	   }
-    else if (current_char() == '"') {
-           if (!parse_quoted_string(fid, fname)) return false;
-	   }
-    else if (current_char() == '{') {
-           if (!parse_bracketed_string(fid, fname)) return false;
-	   }
-    else {
-      wordp = getword(fid, "#,)}", fname);
-      if (wordp == NULL) return false;
+  Entries e;
+  BibFile file;
+  Segment seg;
+  unsigned char * text;
+  bool success;
 
-      /* Index the string name and the string (if defined). */
+  text = ReadWhole(ifp, &seg.size);
+  if (text == NULL) die("can't read", filename);
 
-      if (*wordp != eos) {
-	char * str = find_strtbl(wordp);
+  new_entries(e);
+  InitTables();
 
-	addstring_sbuff(wordp);
-	addchar_sbuff(' ');
-	if (str != NULL) addstring_sbuff(str);
-	}
-      }
+  file.name = filename;
+  file.base = 0;
+  success = ReadChunks(text, seg.size, &file, &e);
+  
+  if (success && (e.count > 0)) {
+    struct stat fs_buffer;
+    int i;
 
-    skipwhite_char();
-    switch (current_char()) {
-      case '#': advance_char(); break;
+    fprintf(ofp, btxindex_header_fmt, FILE_VERSION, MAJOR_VERSION,
+	    MINOR_VERSION, filename);
 
-      case ',': advance_char();
-      case ')': 
-      case '}': return true;
+    i = stat(filename, &fs_buffer);
+    assert(i == 0);
+    file.mod_time = fs_buffer.st_mtime;
 
-      default : emsg1("Bad string separator '%c'", current_char());
-		return false;
-      }
+    HashEntries(text, &e, 0, seg.size);
+
+    seg.first = seg.replaced = 0;
+    seg.delta = false;
+    success = OutputTables(ofp, &file, 1, &e, &seg);
     }
 
-  return false;
+  free(text);
+  free_entries(e);
+  FreeTables();
+  FreeMacros();
 
-  } /* parse_string */
+  return success;
 
+  } /* IndexBibFile */
 
 
-static bool parse_fields(
-  FILE * fid, const bool is_string, const int entry_no, const char * fname) {
 
-  /* Read the fields for an entry from fid; if is_string is true, the entry
-     is a string definition, otherwise it's a reference. */
 
-  loop {
-    char * wordp, name[MAXWORD];
+/* An index is updated by adding a segment to it (see bix.h).  The entries
+   that haven't changed are found by hashing them in the new bib file, from
+   the front until one doesn't match and from the back likewise; the ones in
+   between are indexed again.  If too much of the index is in added segments,
+   it's rebuilt instead, merging them. */
 
-    skipwhite_char();
-    if (current_char() == ',') advance_char();
-    if ((current_char() == '}') || (current_char() == ')')) break;
+#define MAX_SEGMENTS 8
 
-    wordp = getword(fid, "=", fname);
-    if (wordp == NULL) {
-      emsg0("missing field name");
-      return false;
+typedef struct {
+  Entries e;		/* its entries, numbered as they now are */
+  long    size;		/* the bib file's size when last indexed */
+  long    end;		/* the end of the last whole segment */
+  int     segments,
+          added;	/* the entries in segments after the first */
+  bool    embedded;	/* is the entries' text in the index? */
+  } OldIndex;
+
+
+
+static const char * FindSection(
+  const char * map, long mapsize, const Bix_section * dir, int sections,
+  int id, int recsize, int * count) {
+
+  /* Return the section with the given id in the mapped index map, and store
+     the number of recsize-byte records in it in count; return null if the
+     section's missing or doesn't fit. */
+
+  int i;
+
+  for (i = 0; i < sections; i++)
+    if (bix_get32(dir[i].id) == id) {
+      const long
+	offset = bix_get64(dir[i].offset),
+	size = bix_get64(dir[i].size);
+
+      if ((offset < 0) || (size < 0) || (size % recsize) ||
+	  (offset > mapsize) || (size > mapsize - offset))
+	return NULL;
+      *count = size/recsize;
+      return map + offset;
       }
-    advance_char();
-    copy_str(wordp, name);
 
-    if (!parse_string(fid, fname)) return false;
-    
-    addchar_sbuff(' ');
-    addchar_sbuff(eos);
+  return NULL;
 
-    if (is_string) add_strtbl(name, getstring_sbuff());
-    else {
+  } /* FindSection */
 
-      /* Index the words in string under the field name. */
 
-      ExHashTable *ht = GetHashTable(name);
 
-      wordp = getstring_sbuff();
+static bool ReadSegment(
+  const char * map, long mapsize, long start, OldIndex * o) {
 
-      loop {
-	char * ep;
-        unsigned wlen;
+  /* Add the segment at start in the mapped index map to the index o; return
+     false if the segment's incomplete or can't be used. */
 
-	while (isspace(*wordp)) wordp++;
-	if (!(*wordp)) break;
-	ep = strchr(wordp, ' ');
-	assert(ep);
-	*ep = eos;
+  const Bix_preamble * preamble = (const Bix_preamble *) (map + start);
+  const Bix_section * dir = (const Bix_section *) (preamble + 1);
+  const Bix_segment * seg;
+  const Bix_block * blocks;
+  const Bix_hash * hashes;
+  const Bix_macro * defs;
+  const Bix_library * libs;
+  const unsigned char * offsets, * p = NULL;
+  const char * strings;
+  long * off, * len, shift;
+  unsigned long * hash, gap, size;
+  int sections, n, first, replaced, count, numblocks, offsize, strsize,
+      numdefs, i, j;
 
-	wlen = ep - wordp;
-	/* fprintf(stderr, "wlen = %d.\n", wlen); */
-	if (1 < wlen) {
-	  if (wlen < MAXWORD) 
-	    InsertEntry(ht, wordp, entry_no);
-	  else {
-	    strcpy(wordp + min(MAXWORD/2, 30), "...");
-	    wmsg2("too-long %d-character word \"%s\" not indexed",
-		  wlen, wordp);
-	    }
-	  }
+  if (start + (long) sizeof(Bix_preamble) > mapsize) return false;
+  sections = bix_get32(preamble->sections);
+  if ((sections < 0) ||
+      (mapsize - start - (long) sizeof(Bix_preamble))/
+        (long) sizeof(Bix_section) < sections)
+    return false;
+  for (i = 0; i < sections; i++)
+    if (bix_get64(dir[i].offset) + bix_get64(dir[i].size) > mapsize)
+      return false;
+
+  n = bix_get32(preamble->entries);
+  seg = (const Bix_segment *) FindSection(map, mapsize, dir, sections,
+    bix_segment, sizeof(Bix_segment), &count);
+  blocks = (const Bix_block *) FindSection(map, mapsize, dir, sections,
+    bix_entries, sizeof(Bix_block), &numblocks);
+  offsets = (const unsigned char *) FindSection(map, mapsize, dir, sections,
+    bix_offsets, sizeof(char), &offsize);
+  hashes = (const Bix_hash *) FindSection(map, mapsize, dir, sections,
+    bix_hashes, sizeof(Bix_hash), &i);
+  if ((seg == NULL) || (count != 1) || (blocks == NULL) || (offsets == NULL) ||
+      (hashes == NULL) || (i != n) ||
+      (numblocks != (n + BIX_BLOCK - 1)/BIX_BLOCK))
+    return false;
+
+  first = bix_get32(seg->first);
+  replaced = bix_get32(seg->replaced);
+  gap = bix_get32(seg->gap);
+  if ((n < 0) || (first < 0) || (replaced < 0) ||
+      (first + replaced > o->e.count))
+    return false;
+
+  /* The first segment's the one with the string definitions, and it
+     decides whether the index holds the entries' text.  It also names the
+     libraries the strings were read with, which must be the ones read now,
+     unchanged since. */
+
+  if (o->segments == 0) {
+    if (FindSection(map, mapsize, dir, sections, bix_files, sizeof(Bix_file),
+		    &count) == NULL || (count > 0) ||
+	(FindSection(map, mapsize, dir, sections, bix_text, sizeof(char),
+		     &count) == NULL))
+      return false;
+    o->embedded = (count > 0);
+
+    defs = (const Bix_macro *) FindSection(map, mapsize, dir, sections,
+      bix_macros, sizeof(Bix_macro), &numdefs);
+    strings = FindSection(map, mapsize, dir, sections, bix_strings,
+      sizeof(char), &strsize);
+    libs = (const Bix_library *) FindSection(map, mapsize, dir, sections,
+      bix_libraries, sizeof(Bix_library), &count);
+    if ((defs == NULL) || (strings == NULL) ||
+	((strsize > 0) && strings[strsize - 1]) || (libs == NULL) ||
+	(count != numlibraries))
+      return false;
+    for (i = 0; i < count; i++) {
+      const long name = bix_get32(libs[i].name);
+
+      if ((name < 0) || (name >= strsize) ||
+	  strcmp(strings + name, libraries[i].name) ||
+	  (bix_get64(libs[i].mod_time) != (long) libraries[i].mod_time))
+	return false;
+      }
+    for (i = 0; i < numdefs; i++) {
+      const long
+	name = bix_get32(defs[i].name),
+	value = bix_get32(defs[i].value);
+
+      if ((name < 0) || (name >= strsize) || (value < 0) ||
+	  (value >= strsize))
+	return false;
+      AddMacro(bix_get32(defs[i].entry), strings + name, strings + value);
+      }
+    }
+
+  /* The segment's entries replace the ones it says; the ones after them,
+     and any string definitions among them, move along. */
+
+  count = o->e.count - replaced + n;
+  off = (long *) alloc((count + 1)*sizeof(long));
+  len = (long *) alloc((count + 1)*sizeof(long));
+  hash = (unsigned long *) alloc((2*count + 1)*sizeof(unsigned long));
+  shift = bix_get64(seg->size) - o->size;
+
+  for (i = 0; i < first; i++) {
+    off[i] = o->e.offsets[i];
+    len[i] = o->e.lengths[i];
+    hash[2*i] = o->e.hashes[2*i];
+    hash[2*i + 1] = o->e.hashes[2*i + 1];
+    }
+  for (j = 0; j < n; i++, j++) {
+    if (j % BIX_BLOCK == 0) {
+      const long data = bix_get32(blocks[j/BIX_BLOCK].data);
 
-	wordp = ep + 1;
-	}
+      if ((data < 0) || (data > offsize)) break;
+      p = offsets + data;
+      off[i] = bix_get64(blocks[j/BIX_BLOCK].offset);
+      }
+    else {
+      unsigned long skip;
+
+      p = bix_get_varint(p, &skip);
+      off[i] = off[i - 1] + len[i - 1] + skip;
       }
+    p = bix_get_varint(p, &size);
+    len[i] = size;
+    if (p > offsets + offsize) break;
+    hash[2*i] = bix_get32(hashes[j].text);
+    hash[2*i + 1] = bix_get32(hashes[j].gap);
+    }
+  for (j = first + replaced; (i < count) && (j < o->e.count); i++, j++) {
+    off[i] = o->e.offsets[j] + shift;
+    len[i] = o->e.lengths[j];
+    hash[2*i] = o->e.hashes[2*j];
+    hash[2*i + 1] = o->e.hashes[2*j + 1];
     }
+  if (i < count) {
+    free((char *) off);
+    free((char *) len);
+    free((char *) hash);
+    return false;
+    }
+  if (first + n < count) hash[2*(first + n) + 1] = gap;
+  else o->e.tail = gap;
+
+  for (j = 0; (o->segments > 0) && (j < nummacros); j++)
+    if (macros[j].entry >= first + replaced)
+      macros[j].entry += n - replaced;
+
+  free_entries(o->e);
+  o->e.offsets = off;
+  o->e.lengths = len;
+  o->e.hashes = hash;
+  o->e.space = o->e.count = count;
+  o->size = bix_get64(seg->size);
+  o->end = bix_get64(seg->next);
+  if (o->segments++ > 0) o->added += n;
 
   return true;
 
-  } /* parse_fields */
+  } /* ReadSegment */
 
 
 
-#define max_ename_size 13 /* inproceedings or mastersthesis */
+static bool ReadIndex(
+  const char * bibfn, const char * map, long mapsize, OldIndex * o) {
 
-static long find_entry(FILE * fid, bool * is_string) {
+  /* Read the index for the bib file named bibfn, mapped at map, into o,
+     leaving its string definitions in macros.  Return false if the index
+     can't have segments added to it. */
 
-  /* Look for the next entry in fid.  Return the location if found or -1 if
-     there's no more entries.  Upon successful return, the current character
-     will be the one immedately after the opening bracket or parens. */
-       
-  int ename_size, location;
-  char ename[max_ename_size + 1];
+  const char * hend = memchr(map, eos, mapsize);
+  char name[MAXPATHLEN];
+  int filev, majorv, minorv;
 
-  loop {
-    while (!eof_char() && (current_char() != '@')) advance_char();
-    if (eof_char()) return -1;
-    location = char_no;
-    advance_char();
+  o->e.offsets = (long *) alloc(sizeof(long));
+  o->e.lengths = (long *) alloc(sizeof(long));
+  o->e.hashes = (unsigned long *) alloc(sizeof(unsigned long));
+  o->e.count = o->e.space = 0;
+  o->e.tail = 0;
+  o->size = o->end = 0;
+  o->segments = o->added = 0;
 
-    /* If the '@' is the start of a reference, it will be followed by a word
-       that's not too big, which will be followed by some optional white space
-       and either an open parens or brace.  If any of this isn't true, the '@'
-       didn't start a reference. (Note that if all of this is true, the '@' may
-       still not start a reference since the code doesn't check to see if the
-       word is a valid reference type.  Oh well.) */
+  if ((hend == NULL) || (hend - map >= MAXPATHLEN) ||
+      (sscanf(map, btxindex_header_fmt, &filev, &majorv, &minorv, name) < 4) ||
+      (filev != FILE_VERSION) || (majorv != MAJOR_VERSION) ||
+      (minorv != MINOR_VERSION) || strcmp(name, bibfn) ||
+      !ReadSegment(map, mapsize, bix_start(hend - map), o))
+    return false;
 
-    ename_size = 0;
-    skipwhite_char();
-    while ((ename_size < max_ename_size) && isalpha(current_char())) {
-      ename[ename_size++] = current_char();
-      advance_char();
-      }
-    ename[ename_size] = eos;
+  /* A segment that doesn't fit was being written when something went wrong;
+     it and anything after it are dropped. */
 
-    skipwhite_char();
-    if ((current_char() != '{') && (current_char() != '(')) continue;
-    
-    *is_string = (strcmp(ename, "string") ? false : true);
-    break;
-    }
-       
-  advance_char();
+  while (ReadSegment(map, mapsize, o->end, o)) { }
 
-  return (long) location;
+  return true;
 
-  } /* find_entry */
+  } /* ReadIndex */
 
 
 
-static long parse_entry(FILE * fid, const int entry_no, const char * fname) {
+static bool LockIndex(FILE * bixf, const char * bixfn) {
 
-  /* Parse the next entry in the bibliography file fid having name fname.
-     Return 
-         -2  on error.
-         -1  on end of file.
-       > -1  the entry's start in the file. */
+  /* Lock the index file bixf, named bixfn, for writing, waiting for any
+     other update of it to finish.  Return false if it can't be locked, or
+     if bixfn has been rewritten meanwhile and bixf is no longer it. */
 
-  char * wordp;
-  bool is_string;
-  long location;
+  struct flock lock;
+  struct stat st, now;
 
-  do {
-    location = find_entry(fid, &is_string);
-    if (location < 0) return location;
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 0;
 
-    if (!is_string) {
-      wordp = getword(fid, ",", fname);
-      if (wordp == NULL) {
-	emsg0("missing reference key");
-	return -2;
-	}
-      advance_char();
-      }
+  return !fcntl(fileno(bixf), F_SETLKW, &lock) &&
+	 !fstat(fileno(bixf), &st) && !stat(bixfn, &now) &&
+	 (st.st_dev == now.st_dev) && (st.st_ino == now.st_ino);
 
-    if (!parse_fields(fid, is_string, entry_no, fname)) return -2;
-    }
-  while (is_string);
+  } /* LockIndex */
 
-  return (long) location;
 
-  } /* parse_entry */
 
+static bool UpdateIndex(FILE * bibf, char * bibfn, const char * bixfn) {
 
+  /* Bring the index file bixfn up to date with the bibliography file bibf,
+     having name bibfn, by adding a segment for the entries that changed.
+     Return false, leaving the index alone, if that can't or shouldn't be
+     done.  The index is locked from before it's read until the segment's
+     written, so updates of a shared index don't write over each other; if
+     it can't be locked, it's rewritten instead. */
 
-static bool IndexBibFile(FILE *ifp, FILE *ofp, char *filename) {
+  FILE * bixf = fopen(bixfn, "r+");
+  struct stat st, bibst;
+  char * map = MAP_FAILED;
+  unsigned char * text = NULL;
+  OldIndex o;
+  Entries w;
+  BibFile file;
+  Segment seg;
+  long size, shift, last, start, end, next, from, after;
+  int lo, hi, level, i;
+  bool ok, tail;
 
-  /* Read the bibliography file ifp having name filename and write the index
-     file ofp. */ 
+  new_entries(w);
+  o.e.offsets = NULL;
 
-  int count = 0;
-  long curoffset;
-  long *offsets;
-  int offsize = 128;
+  ok = (bixf != NULL) && LockIndex(bixf, bixfn) &&
+       !fstat(fileno(bixf), &st) && (st.st_size > 0);
+  if (ok) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(bixf), 0);
+    ok = (map != MAP_FAILED) && ReadIndex(bibfn, map, st.st_size, &o) &&
+	 (o.embedded == (embed != 0)) && (o.segments < MAX_SEGMENTS);
+    }
+  if (ok) {
+    text = ReadWhole(bibf, &size);
+    ok = (text != NULL) && !stat(bibfn, &bibst);
+    }
 
-  offsets = (long *) alloc(offsize*sizeof(long));
+  /* Find the entries that are the same from the front, then from the back;
+     the back is only anchored if the text after the last entry is the
+     same. */
 
-  init_char();
-  InitTables();
-  _fillbuffer_char(ifp);
-  
-  loop {
-    curoffset = parse_entry(ifp, count, filename);
-    if (curoffset < 0) break;
+  if (ok) {
+    for (lo = 0, start = 0; lo < o.e.count; lo++) {
+      const long off = o.e.offsets[lo], len = o.e.lengths[lo];
 
-    if (count == offsize) {
-      long *oldoff = offsets;
+      if ((off < start) || (off + len > size) ||
+	  (gap_hash(text + start, off - start) != o.e.hashes[2*lo + 1]) ||
+	  (bix_hash(BIX_HASH_INIT, text + off, len) != o.e.hashes[2*lo]))
+	break;
+      start = off + len;
+      }
 
-      offsize *= 2;
-      offsets = (long *) alloc(offsize*sizeof(long));
-      memcpy((char *) offsets, (char *) oldoff, count*sizeof(long));
-      free(oldoff);
+    shift = size - o.size;
+    hi = o.e.count;
+    last = hi ? o.e.offsets[hi - 1] + o.e.lengths[hi - 1] : 0;
+    tail = (last + shift >= start) &&
+	   (gap_hash(text + last + shift, size - last - shift) == o.e.tail);
+    for (; tail && (hi > lo); hi--) {
+      const long
+	off = o.e.offsets[hi - 1] + shift,
+	len = o.e.lengths[hi - 1],
+	gap = (hi > 1 ? o.e.offsets[hi - 2] + o.e.lengths[hi - 2] : 0) + shift;
+
+      if ((gap < start) ||
+	  (gap_hash(text + gap, off - gap) != o.e.hashes[2*hi - 1]) ||
+	  (bix_hash(BIX_HASH_INIT, text + off, len) != o.e.hashes[2*hi - 2]))
+	break;
       }
 
-    offsets[count++] = curoffset;
-    }
-  
-  if ((curoffset == -1) && (count > 0)) {
-    struct stat fs_buffer;
-    int i;
+    /* The changed text runs from start to end, and the gap after it to
+       next.  It mustn't have defined strings before or after. */
 
-    fprintf(ofp, btxindex_header_fmt, FILE_VERSION, MAJOR_VERSION,
-	    MINOR_VERSION, filename);
+    if (!tail) end = next = size;
+    else {
+      end = (hi > 0 ? o.e.offsets[hi - 1] + o.e.lengths[hi - 1] : 0) + shift;
+      next = (hi < o.e.count) ? o.e.offsets[hi] + shift : size;
+      }
+    ok = (end >= start) && !StringDef(text + start, end - start) &&
+	 (tail || !(o.e.tail & 1));
+    for (i = lo; ok && (i < hi); i++)
+      ok = !(o.e.hashes[2*i + 1] & 1);
+    }
 
-    i = stat(filename, &fs_buffer);
-    assert(i == 0);
+  /* Index the changed text on its own, with the strings defined before it.
+     It's read from just after the end of the entry before it, so it's parsed
+     as it would be in the whole file. */
+
+  if (ok) {
+    from = (start > 0) ? start - 1 : 0;
+    InitTables();
+    for (i = 0; i < nummacros; i++)
+      if (macros[i].entry < lo) add_strtbl(macros[i].name, macros[i].value);
+    FreeMacros();
+
+    file.name = bibfn;
+    file.base = from;
+    file.mod_time = bibst.st_mtime;
+    level = verbage_level;
+    verbage_level = 0;
+    ok = ReadBibFile(text + from, end - from, &file, &w);
+    verbage_level = level;
+    file.base = 0;
+
+    after = w.count ? w.offsets[w.count - 1] + w.lengths[w.count - 1] : start;
+    ok = ok && (nummacros == 0) && (!w.count || (w.offsets[0] >= start)) &&
+	 !memchr(text + after, '@', end - after) &&
+	 !memchr(text + after, '\\', end - after) &&
+	 (o.e.count - (hi - lo) + w.count > 0) &&
+	 (4*(o.added + w.count) <= o.e.count - (hi - lo) + w.count);
+    }
 
-    fwrite((void *) &(fs_buffer.st_mtime), sizeof(time_t), 1, ofp);
-    fwrite((void *) &count, sizeof(int), 1, ofp);
-    fwrite((void *) offsets, sizeof(long), count, ofp);
-    free(offsets);
+  /* Add the segment to the end of the index, over anything left there by
+     an earlier update that didn't finish. */
 
-    OutputTables(ofp);
+  if (ok) {
+    HashEntries(text, &w, start, next);
+    ok = !ftruncate(fileno(bixf), o.end) && !fseek(bixf, o.end, SEEK_SET);
+    }
+  if (ok) {
+    seg.first = lo;
+    seg.replaced = hi - lo;
+    seg.size = size;
+    seg.delta = true;
+    ok = OutputTables(bixf, &file, 1, &w, &seg);
+    verbage(3, (stdout, "Replaced %d entries with %d in %s.\n", hi - lo,
+		w.count, bixfn));
     }
 
+  if (map != MAP_FAILED) munmap(map, st.st_size);
+  if (ok) ok = SyncFile(bixf);
+  if ((bixf != NULL) && fclose(bixf)) ok = false;
+  if (text != NULL) free(text);
+  if (o.e.offsets != NULL) free_entries(o.e);
+  free_entries(w);
   FreeTables();
-  clear_strtbl();
+  FreeMacros();
 
-  return (curoffset == -1);
+  return ok;
 
-  } /* IndexBibFile */
+  } /* UpdateIndex */
 
 
 
@@ -986,15 +4006,57 @@ static void do_cla(arguments cla, int argc, char ** argv) {
   extern char *optarg;
   extern int
     optind,
-    do_rcfile(char **, char **, int *);
+    do_rcfile(char **, char **, sblock *, int *, int *, int *, int *);
  
   bib_dirs = getenv("BIBINPUTS");
   cla->bix_dir = NULL;
-  do_rcfile(&bib_dirs, &(cla->bix_dir), &verbage_level);
+  cla->libraries = sblock_nil;
+  do_rcfile(&bib_dirs, &(cla->bix_dir), &(cla->libraries), &termdict,
+	    &automata, &embed, &verbage_level);
 
   errors = 0;
-  while ((c = getopt(argc, argv, "p:s:w:")) != -1)
+  while ((c = getopt(argc, argv, "ac:efij:l:m:p:s:tw:")) != -1)
     switch (c) {
+      case 'a':
+	automata = 1;
+	break;
+
+      case 'c':
+	collection = optarg;
+	break;
+
+      case 'e':
+	embed = 1;
+	break;
+
+      case 'f':
+	syncing = 1;
+	break;
+
+      case 'i':
+	incremental = 1;
+	break;
+
+      case 'j':
+	jobs = atoi(optarg);
+	if (jobs < 1) {
+	  verbage(1, (stderr, "The -j value must be positive.\n"));
+	  errors++;
+	  }
+	break;
+
+      case 'l':
+	cla->libraries = add_sblock(cla->libraries, optarg);
+	break;
+
+      case 'm':
+	membudget = atol(optarg) << 20;
+	if (membudget < 1) {
+	  verbage(1, (stderr, "The -m value must be positive.\n"));
+	  errors++;
+	  }
+	break;
+
       case 'p':
 	verbage_level = atoi(optarg);
 	break;
@@ -1003,6 +4065,10 @@ static void do_cla(arguments cla, int argc, char ** argv) {
         bib_dirs = optarg;
         break;
 
+      case 't':
+	termdict = 1;
+	break;
+
       case 'w':
 	cla->bix_dir = optarg;
 	break;
@@ -1012,8 +4078,9 @@ static void do_cla(arguments cla, int argc, char ** argv) {
       }
 
   if (errors) {
-    verbage(1, (stderr, "Command format is " 
-		"\"%s [-p int] [-s dirs] [-w dir] [bib-file]...\".\n ",
+    verbage(1, (stderr, "Command format is \"%s [-a] [-c name] [-e] [-f] [-i] "
+		"[-j int] [-l file]... [-m int] [-p int] [-s dirs] [-t] "
+		"[-w dir] [bib-file]...\".\n ",
 		argv[0]));
     exit(1);
     }
@@ -1062,6 +4129,97 @@ static void do_cla(arguments cla, int argc, char ** argv) {
         verbage(1, (stderr, "btxindex:  error %d during fclose(" #_f ").\n", \
 		    errno)); while (0)
 
+static bool IndexCollection(sblock filenames, FILE *ofp) {
+
+  /* Read the bibliography files named in filenames and write the collection
+     index file ofp.  Each file's offsets are moved past the ends of the files
+     before it. */
+
+  const int numfiles = size_sblock(filenames);
+  BibFile *files = (BibFile *) alloc(numfiles*sizeof(BibFile));
+  Entries e;
+  bool success = true;
+  long base = 0;
+  int k;
+
+  new_entries(e);
+  InitTables();
+
+  for (k = 0; success && (k < numfiles); k++) {
+    struct stat fs_buffer;
+    FILE *ifp = fopen(filenames[k], "r");
+    unsigned char *text = NULL;
+    long size;
+
+    if ((ifp == NULL) || stat(filenames[k], &fs_buffer) ||
+	((text = ReadWhole(ifp, &size)) == NULL)) {
+      open_err(filenames[k]);
+      success = false;
+      }
+    else {
+      files[k].name = filenames[k];
+      files[k].mod_time = fs_buffer.st_mtime;
+      files[k].base = base;
+      success = ReadBibFile(text, size, files + k, &e);
+      base += size;
+      }
+    if (text != NULL) free(text);
+    closef(ifp);
+    }
+
+  if (success && (e.count > 0)) {
+    Segment seg;
+
+    seg.first = seg.replaced = 0;
+    seg.size = base;
+    seg.delta = false;
+    fprintf(ofp, btxindex_header_fmt, FILE_VERSION, MAJOR_VERSION,
+	    MINOR_VERSION, collection);
+    success = OutputTables(ofp, files, numfiles, &e, &seg);
+    }
+
+  free(files);
+  free_entries(e);
+  FreeTables();
+  FreeMacros();
+
+  return success;
+
+  } /* IndexCollection */
+
+
+static bool install_index(const char * tmpfn, const char * bixfn) {
+
+  /* Make the temp index file tmpfn the index file bixfn; return true if it
+     worked.  The rename replaces any old index in one step, so the index is
+     never missing; with -f, the directory is flushed to disk after. */
+
+  char dir[MAXPATHLEN], * slash;
+  int fd;
+
+  if (rename(tmpfn, bixfn)) {
+    verbage(2, (stderr, "btxindex:  error %d during %s create.\n", errno,
+		bixfn));
+    return false;
+    }
+
+  if (syncing) {
+    copy_fname(bixfn, dir);
+    if ((slash = strrchr(dir, '/')) == NULL) strcpy(dir, ".");
+    else if (slash == dir) dir[1] = '\0';
+    else *slash = '\0';
+    if ((fd = open(dir, O_RDONLY)) >= 0) {
+      fsync(fd);
+      close(fd);
+      }
+    }
+
+  return true;
+
+  } /* install_index */
+
+
+
 static int doit(const char * dir, const char * fname, const char * bixdir) {
 
   /* If dir/fname is a bibliography file, create an index for it in directory
@@ -1106,50 +4264,368 @@ static int doit(const char * dir, const char * fname, const char * bixdir) {
      if it gets trashed, there's no way to figure out where the bib file is.
      This isn't a problem for btxindex (because it has search paths), but it
      does make things sticky for btxlook when it updates an index file (since
-     it specifies absolute paths to btxindex).  Note this code is not interrupt
-     clean. */
+     it specifies absolute paths to btxindex).  The temp file replaces the
+     index file in one rename, so an interrupted run leaves at most the temp
+     file behind. */
 
      copy_fname(make_fullpath(bixd, fp->name, "bix"), bixfn);
      copy_fname(make_fullpath(bixd, fp->name, "tbx"), tmpfn);
 
+  /* With -i, try adding a segment to the index first. */
+
+     if (incremental) {
+       if (UpdateIndex(bibf, bibfn, bixfn)) {
+	 closef(bibf);
+	 verbage(2, (stdout, "Updated %s.\n", bixfn));
+	 return 0;
+	 }
+       if (fseek(bibf, 0L, SEEK_SET)) {
+	 open_err(bibfn);
+	 closef(bibf);
+	 return -2;
+	 }
+       }
+
      bixf = fopen(tmpfn, "w");
      if (bixf == NULL) {
        open_err(bixfn);
        success = false;
        }
-     else success = IndexBibFile(bibf, bixf, bibfn);
+     else success = IndexBibFile(bibf, bixf, bibfn) && SyncFile(bixf);
     
   closef(bibf);
   closef(bixf);
 
   /* If everything went well, make the temp index file the final index file. */
 
-     if (success) {
-       delete(bixfn);
-       if (link(tmpfn, bixfn)) {
-	   verbage(2, (stderr, "btxindex:  error %d during %s create.\n", \
-		       errno, bixfn));
-	   success = false;
+     if (success) success = install_index(tmpfn, bixfn);
+     if (success)
+       verbage(2, (stdout, "Indexed %s in%s %s.\n", bibfn,
+		   ((strlen(bibfn) + strlen(bixfn)) > 70 ? "\n " : ""),
+		   bixfn));
+     delete(tmpfn);
+
+  return (success ? 0 : -2);
+
+  } /* doit */
+
+
+
+static int collect(sblock bib_dirs, sblock bib_files, const char * bixdir) {
+
+  /* Index the bibliography files bib_files, found in the directories
+     bib_dirs, in the collection index named by collection.  The index goes in
+     the directory given with the collection's name, or bixdir if given, or
+     the current directory.  Return 0 if everything went well, -2 if not. */
+
+  sblock bibfns = sblock_nil;
+  FILE * bixf;
+  full_path fp;
+  const char * bixd;
+  char bixfn[MAXPATHLEN], tmpfn[MAXPATHLEN];
+  bool success = true;
+  int i, j;
+
+  /* Find the bibliography files; they're named in the index by full path. */
+
+     for (i = 0; i < size_sblock(bib_files); i++) {
+       for (j = 0; j < size_sblock(bib_dirs); j++) {
+	 struct stat st;
+	 const char * bibfn;
+
+	 fp = unmake_fullpath(bib_files[i]);
+	 bibfn = make_fullpath(*(fp->path) ? fp->path : bib_dirs[j], fp->name,
+			       "bib");
+	 if (stat(bibfn, &st) == 0) {
+	   bibfns = add_sblock(bibfns, bibfn);
+	   break;
 	   }
-       else
-	 verbage(2, (stdout, "Indexed %s in%s %s.\n", bibfn,
-		     ((strlen(bibfn) + strlen(bixfn)) > 70 ? "\n " : ""),
+	 }
+       if (j >= size_sblock(bib_dirs)) {
+	 success = false;
+	 verbage(1, (stderr, "Can't find %s.\n",
+		     make_fullpath("", bib_files[i], "bib")));
+	 }
+       }
+
+  /* Index the files into a temp file, as doit() does. */
+
+     fp = unmake_fullpath(collection);
+     bixd = *(fp->path) ? fp->path : (bixdir != NULL && *bixdir) ? bixdir : ".";
+     copy_fname(make_fullpath(bixd, fp->name, "bix"), bixfn);
+     copy_fname(make_fullpath(bixd, fp->name, "tbx"), tmpfn);
+
+     if (success && (size_sblock(bibfns) > 0)) {
+       bixf = fopen(tmpfn, "w");
+       if (bixf == NULL) {
+	 open_err(bixfn);
+	 success = false;
+	 }
+       else success = IndexCollection(bibfns, bixf) && SyncFile(bixf);
+       closef(bixf);
+
+       if (success) success = install_index(tmpfn, bixfn);
+       if (success)
+	 verbage(2, (stdout, "Indexed %d files in %s.\n", size_sblock(bibfns),
 		     bixfn));
+       delete(tmpfn);
        }
-     delete(tmpfn);
+
+  if (bibfns != sblock_nil) free_sblock(bibfns);
 
   return (success ? 0 : -2);
 
-  } /* doit */
+  } /* collect */
+
+
+/* A string library is a bib file whose string definitions are wanted in
+   every file indexed, such as a file of journal abbreviations.  Its
+   definitions are kept, expanded, in a library file beside the index files,
+   name.bsx:
+
+	header line			-- btxstrings_header_fmt
+	name, value			-- nul-terminated, for each definition
+
+   The definitions are in the order made, so adding them to the string table
+   again redefines strings the same way.  Each library is read with the
+   strings of the ones before it, so a library file is compiled again when
+   it's no newer than its bib file or any earlier library's.  An index
+   updated with -i is rewritten instead if a library's bib file is newer. */
+
+#define btxstrings_header_fmt "bibstrings %d %d\n"
+
+static bool ReadLibrary(const char * libfn) {
+
+  /* Add the string definitions in the library file libfn to the string
+     table.  Return false, adding none, if it can't be read or is for another
+     version. */
+
+  FILE * f = fopen(libfn, "r");
+  unsigned char * text = NULL;
+  char * nl, * p, * end;
+  long size;
+  int version, count, k;
+  bool ok;
+
+  if (f != NULL) {
+    text = ReadWhole(f, &size);
+    closef(f);
+    }
+  if (text == NULL) return false;
+
+  end = (char *) text + size;
+  nl = (char *) memchr(text, '\n', size);
+  ok = (nl != NULL) &&
+       (sscanf((char *) text, btxstrings_header_fmt, &version, &count) == 2) &&
+       (version == FILE_VERSION) && (count >= 0);
+  for (k = 0, p = nl + 1; ok && (k < 2*count); k++) {
+    char * z = (char *) memchr(p, eos, end - p);
+
+    ok = (z != NULL);
+    p = z + 1;
+    }
+  ok = ok && (p == end);
+
+  for (k = 0, p = nl + 1; ok && (k < count); k++) {
+    const char * name = p;
+
+    p += strlen(p) + 1;
+    add_strtbl(name, p);
+    p += strlen(p) + 1;
+    }
+
+  free(text);
+
+  return ok;
+
+  } /* ReadLibrary */
+
+
+
+static bool CompileLibrary(
+  const char * bibfn, const char * libfn, const char * tmpfn) {
+
+  /* Add the string definitions in the bib file bibfn to the string table and
+     write them to the library file libfn, through the temp file tmpfn.
+     Return false if bibfn couldn't be read; if libfn can't be written, it's
+     compiled again next time. */
+
+  FILE * f = fopen(bibfn, "r");
+  unsigned char * text = NULL;
+  Entries e;
+  BibFile file;
+  long size;
+  int k;
+  bool ok, written = false;
+
+  if (f != NULL) {
+    text = ReadWhole(f, &size);
+    closef(f);
+    }
+  if (text == NULL) {
+    open_err(bibfn);
+    return false;
+    }
+
+  new_entries(e);
+  InitTables();
+  file.name = (char *) bibfn;
+  file.base = 0;
+  ok = ParseEntries(text, size, 0, &file, &e);
+  free(text);
+  free_entries(e);
+  FreeTables();
+
+  if (ok && ((f = fopen(tmpfn, "w")) != NULL)) {
+    fprintf(f, btxstrings_header_fmt, FILE_VERSION, nummacros);
+    for (k = 0; k < nummacros; k++) {
+      fwrite(macros[k].name, sizeof(char), strlen(macros[k].name) + 1, f);
+      fwrite(macros[k].value, sizeof(char), strlen(macros[k].value) + 1, f);
+      }
+    written = SyncFile(f) && !ferror(f);
+    if (fclose(f)) written = false;
+    if (written) written = install_index(tmpfn, libfn);
+    delete(tmpfn);
+    }
+  if (ok && written)
+    verbage(2, (stdout, "Compiled %s in %s.\n", bibfn, libfn));
+  else if (ok)
+    verbage(1, (stderr, "Can't write %s.\n", libfn));
+
+  FreeMacros();
+
+  return ok;
+
+  } /* CompileLibrary */
+
+
+
+static bool LoadLibraries(arguments args) {
+
+  /* Add the string libraries named in args, in order, to the string table,
+     compiling their library files as needed, and keep them there for every
+     file indexed.  Note each library's bib file, once, in libraries.  Return
+     false if one couldn't be read. */
+
+  char bibfn[MAXPATHLEN], libfn[MAXPATHLEN], tmpfn[MAXPATHLEN];
+  const char * bibd = ".", * bixd;
+  struct stat st;
+  time_t libtime = 0;
+  full_path fp;
+  int i, j;
+
+  libraries = (BibFile *)
+    alloc((size_sblock(args->libraries) + 1)*sizeof(BibFile));
+
+  for (i = 0; i < size_sblock(args->libraries); i++) {
+    fp = unmake_fullpath(args->libraries[i]);
+    for (j = 0; j < size_sblock(args->bib_dirs); j++) {
+      bibd = *(fp->path) ? fp->path : args->bib_dirs[j];
+      copy_fname(make_fullpath(bibd, fp->name, "bib"), bibfn);
+      if (stat(bibfn, &st) == 0) break;
+      }
+    if (j >= size_sblock(args->bib_dirs)) {
+      verbage(1, (stderr, "Can't find %s.\n",
+		  make_fullpath("", args->libraries[i], "bib")));
+      return false;
+      }
+
+    /* btxlook names the library again when it updates an index, from
+       wherever it's run. */
+
+    if (*bibfn != '/') {
+      char wd[MAXPATHLEN];
+
+      if (getcwd(wd, MAXPATHLEN) != NULL)
+	copy_fname(make_fullpath(wd, bibfn, ""), bibfn);
+      }
+    for (j = 0; j < numlibraries; j++)
+      if (!strcmp(libraries[j].name, bibfn)) break;
+    if (j < numlibraries) continue;
+    libraries[numlibraries].name = strdupl(bibfn);
+    libraries[numlibraries++].mod_time = st.st_mtime;
+    libtime = max(libtime, st.st_mtime);
+
+    bixd = (args->bix_dir != NULL && *args->bix_dir) ? args->bix_dir : bibd;
+    copy_fname(make_fullpath(bixd, fp->name, "bsx"), libfn);
+    copy_fname(make_fullpath(bixd, fp->name, "tsx"), tmpfn);
+    if (stat(libfn, &st) || (st.st_mtime <= libtime) || !ReadLibrary(libfn))
+      if (!CompileLibrary(bibfn, libfn, tmpfn)) return false;
+    }
+
+  keep_strtbl();
+
+  return true;
+
+  } /* LoadLibraries */
+
+
+
+static bool index_file(arguments args, const char * fname) {
+
+  /* Search the directories in args for the bibliography file fname and, if
+     it's found, index it.  Return true if that worked. */
+
+  int j, e = -1;
+
+  for (j = 0; j < size_sblock(args->bib_dirs); j++) {
+    e = doit(args->bib_dirs[j], fname, args->bix_dir);
+    if (e != -1) break;
+    }
+
+  if (j >= size_sblock(args->bib_dirs))
+    verbage(1, (stderr, "Can't find %s.\n", make_fullpath("", fname, "bib")));
+
+  return (e == 0);
+
+  } /* index_file */
+
+
+
+static bool index_files(arguments args) {
+
+  /* Index the bibliography files in args, up to jobs of them at once.  With
+     more than one job, each file is indexed in a child process of its own,
+     which has its own tables and string buffer.  Jobs left over are spread
+     over the files as chunks (see ReadChunks()), unless memory is budgeted.
+     Return true if every file was indexed. */
+
+  const int numfiles = size_sblock(args->bib_files);
+  int i = 0, running = 0, status, childpid;
+  bool success = true;
+
+  if ((numfiles > 0) && !membudget) chunks = max(1, jobs/numfiles);
+
+  while ((i < numfiles) || (running > 0))
+    if ((i < numfiles) && (running < jobs)) {
+      fflush(stdout);
+      fflush(stderr);
+      if ((jobs == 1) || ((childpid = fork()) < 0))
+	success = index_file(args, args->bib_files[i]) && success;
+      else if (childpid == 0)
+	exit(index_file(args, args->bib_files[i]) ? 0 : 1);
+      else running++;
+      i++;
+      }
+    else {
+      if (waitpid(-1, &status, 0) < 0) return false;
+      running--;
+      if (status & 0xffff) success = false;
+      }
+
+  return success;
+
+  } /* index_files */
 
 
 
 int main(int argc, char **argv) {
 
   Arguments args;
-  int i, failures;
   
+  messages = stderr;
   do_cla(&args, argc, argv);
+  if (!LoadLibraries(&args)) return 1;
 
   /* If no bibliography files were given, search for them. */
 
@@ -1158,28 +4634,15 @@ int main(int argc, char **argv) {
        args.bib_files = search_directories(args.bib_dirs, "bib");
        }
     
-  /* For each bibliography file name given, search the directories for it and,
-     if found, index it. */
+  /* With -c, index the files together. */
 
-     failures = false;
-     for (i = 0; i < size_sblock(args.bib_files); i++) {
-       char * fname = args.bib_files[i];
-       int j, e;
-       
-       for (j = 0; j < size_sblock(args.bib_dirs); j++) {
-	 e = doit(args.bib_dirs[j], fname, args.bix_dir);
-	 if (e != -1) break;
-	 }
+     if (collection != NULL)
+       return collect(args.bib_dirs, args.bib_files, args.bix_dir) ? 1 : 0;
 
-       if (e == -2) failures = true;
-       if (j >= size_sblock(args.bib_dirs)) {
-	 failures = true;
-	 verbage(1,
-	   (stderr, "Can't find %s.\n", make_fullpath("", fname, "bib")));
-	 }
-       }
+  /* For each bibliography file name given, search the directories for it and,
+     if found, index it. */
 
-  return failures ? 1 : 0;
+  return index_files(&args) ? 0 : 1;
   }
 
 
@@ -27,10 +27,20 @@
 
 */
 
+/* fileno(), pread() and getopt() are only declared under -ansi if POSIX is
+   asked for. */
+
+#define _XOPEN_SOURCE 500
+
 #include "bl-common.h"
+#include "bix.h"
+#include "entry-set.h"
+#include "fsa.h"
+#include "lz.h"
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 /* How to print matched references. */
 
@@ -41,15 +51,6 @@
    static char pager[MAXPATHLEN];
 
 
-/* The set data type. */
-
-#  define SETSCALE (sizeof(unsigned long)*8)
-
-   static int setsize;
-   static unsigned long setmask;	/* used to erase extra bits */
-   typedef unsigned long *Set;
-
-
 /* Some of the command line arguments. */
 
    typedef struct {
@@ -59,31 +60,88 @@
      } Arguments, * arguments;
 
 
-typedef struct {
-  char  theword[16];
-  int   numindex;
-  int * index;
-  } Index, *IndexPtr;
+/* The index tables point into the mapped index file; nothing in them is
+   copied out of the file. */
 
 typedef struct {
-  char     thefield[16];
-  int      numwords;
-  IndexPtr words;
+  const char       * thefield;
+  int                numwords;
+  const Bix_dblock * blocks;
+  Fsa                fsa;		/* data is null without automata */
   } IndexTable;
 
+/* A bib file covered by an index.  The offsets of the file's entries in the
+   index are their offsets in the file plus base. */
+
 typedef struct {
-  FILE 	      * bib_file;  
-  char 	        bib_fname[MAXPATHLEN]; 
+  const char  * name;		/* the file's full path */
+  FILE        * file;		/* null until the file's first needed */
+  long          base;
+  int           first;		/* the file's first entry */
+  } Member;
+
+/* An index's first segment is its Bibindex; any segments added to it have
+   theirs in deltas (see bix.h).  A segment's entries are numbered from 0. */
+
+typedef struct Bibindex {
+  char 	        bib_fname[MAXPATHLEN];	/* or the collection's name */
+  const Bix_file
+              * files;		/* a collection's bib files */
+  int           numfiles;	/* 0 unless the index is a collection */
+  const char  * strings;
+  Member      * members;	/* one for each bib file */
   int  	        numoffsets;
-  long 	      * offsets;   
-  char 	        numfields; 
+  const Bix_block
+              * blocks;
+  const unsigned char
+              * offsets;   
+  int           offsize;
+  int           cached;		/* the block whose entries are in cache */
+  long          cache[BIX_BLOCK],
+                lengths[BIX_BLOCK];
+  const unsigned char
+              * text;		/* the entries' compressed text, if any */
+  int           textsize;
+  const Bix_u32
+              * texts;		/* each entry block's start in text */
+  char        * buf;		/* holds the text being printed */
+  long          bufsize;
+  int           buffered;	/* the entry block whose text is in buf */
+  int 	        numfields; 
   IndexTable  * fieldtable;
-  Set           results;
+  const unsigned char
+              * dict;
+  int           dictsize;
+  bool          terms;		/* one dictionary for all fields? */
+  const unsigned char
+              * refs;
+  int           refsize;
+  char        * map;
+  size_t        mapsize;
+  eset          results;
+  int           first,		/* the first entry the segment replaces */
+                replaced;	/* the number it replaces */
+  long          size,		/* the bib file's size */
+                shift;		/* how far it moved with the segment */
+  struct Bibindex
+              * deltas;		/* the segments added to the first */
+  int           numdeltas;
   } Bibindex, * bibindex;
 
 
 /* Sundries. */
 
+#  define min(_a, _b) \
+     ((_a) > (_b) ? (_b) : (_a))
+
+#  define max(_a, _b) \
+     ((_a) > (_b) ? (_a) : (_b))
+
+/* The number of insertions, deletions, or substitutions allowed between a
+   query word marked with ~ and the words it matches. */
+
+#  define NEAR_EDITS 1
+
 #  define closef(_f) \
      do if (fclose(_f)) \
          verbage(1, (stderr, "btxlook:  error %d during fclose(" #_f ").\n", \
@@ -120,277 +178,539 @@ static void safefread(void *ptr, size_t size, size_t num, FILE *fp)
 }
 
 /* ----------------------------------------------------------------- *\
-|  char safegetc(FILE *fp)
+|  void safepread(void *ptr, size_t num, long offset, FILE *fp)
 |
-|  Get the next character safely.  Used by routines that assume that
-|  they won't run into the end of file.
+|  Read num bytes starting at offset in the file, but die if there
+|  aren't that many.  The file's position is left alone.
 \* ----------------------------------------------------------------- */
-static char safegetc(FILE *fp)
+static void safepread(void *ptr, size_t num, long offset, FILE *fp)
 {
-    if (feof(fp))
+    if (pread(fileno(fp), ptr, num, (off_t) offset) != (ssize_t) num)
 	die("Unexpected EOF in bib file");
-    return fgetc(fp);
 }
 
 
 /* ========================== INDEX TABLES ========================= */
 
-/* ----------------------------------------------------------------- *\
-|  void ReadWord(FILE *ifp, char *word)
-|
-|  Read a "pascal" string into the given buffer
-\* ----------------------------------------------------------------- */
 
-static void 
-ReadWord(FILE *ifp, char *word) {
+static const char * GetSection(
+  bibindex bi, const Bix_section * dir, int sections, int id, int recsize,
+  int * count) {
 
-  char length;
+  /* Return a pointer to the section with the given id in the mapped index
+     file bi; if count isn't null, store the number of recsize-byte records in
+     the section there.  Die if the section's missing or doesn't fit in the
+     file. */
 
-  safefread((void *) &length, sizeof(char), 1, ifp);
-  if (length > MAXWORD)
-    die("Index file is corrupt, word too long");
+  int i;
 
-  safefread((void *) word, sizeof(char), length, ifp);
-  word[(unsigned) length] = 0;
-  }
+  for (i = 0; i < sections; i++)
+    if (bix_get32(dir[i].id) == id) {
+      const long
+	offset = bix_get64(dir[i].offset),
+	size = bix_get64(dir[i].size);
 
+      if ((offset < 0) || (size < 0) || (offset % BIX_ALIGN) ||
+	  (size % recsize) || (offset > (long) bi->mapsize) ||
+	  (size > (long) bi->mapsize - offset))
+	break;
+      if (count != NULL) *count = size/recsize;
+      return bi->map + offset;
+      }
 
+  die("Index file is corrupt, missing section");
+  return NULL;
 
-static void GetOneTable(FILE *ifp, IndexTable *table) {
+  } /* GetSection */
 
-  /* Read an index table from the file ifp into table. */
 
-  int i, num;
 
-  safefread((void *) &table->numwords, sizeof(int), 1, ifp);
+static bool WholeSegment(bibindex bi, long start) {
 
-  /* The following "+ 1" is an egregious hack to take care of the case of a
-     field with no words.  This should be fixed by changing btxindex so it
-     doesn't write such fields to the index file. */
+  /* Return true if there's a segment at start in bi's mapped index file, and
+     all of it's there. */
 
-  table->words = (IndexPtr) alloc(table->numwords*sizeof(Index) + 1);
+  const Bix_preamble * preamble = (const Bix_preamble *) (bi->map + start);
+  const Bix_section * dir = (const Bix_section *) (preamble + 1);
+  long sections, i;
+  bool segment = false;
 
-  for (i = 0; i < table->numwords; i++) {
-    ReadWord(ifp, table->words[i].theword);
-    safefread((void *) &num, sizeof(int), 1, ifp);
-    table->words[i].numindex = num;
-    table->words[i].index = (int *) alloc(num * sizeof(int));
-    safefread((void *) table->words[i].index, sizeof(int), num, ifp);
+  if (start + (long) sizeof(Bix_preamble) > (long) bi->mapsize) return false;
+  sections = bix_get32(preamble->sections);
+  if ((sections < 0) ||
+      ((long) bi->mapsize - start - (long) sizeof(Bix_preamble))/
+        (long) sizeof(Bix_section) < sections)
+    return false;
+  for (i = 0; i < sections; i++) {
+    if (bix_get64(dir[i].offset) + bix_get64(dir[i].size) >
+	(long) bi->mapsize)
+      return false;
+    if (bix_get32(dir[i].id) == bix_segment) segment = true;
     }
-  }
 
+  return segment;
 
+  } /* WholeSegment */
 
-static void GetTables(FILE *ifp, bibindex bi) {
 
-  /* Get the tables from the index file. */
 
-  int i;
+static long GetSegment(bibindex bi, long start) {
+
+  /* Point the tables in bi into the segment at start in its mapped index
+     file, and return where the next segment would start. */
+
+  const char * strings;
+  const Bix_preamble * preamble;
+  const Bix_section * dir;
+  const Bix_field * fields, * terms;
+  const Bix_dblock * dblocks;
+  const Bix_segment * segment;
+  const unsigned char * fsa;
+  const Bix_u32 * roots;
+  int i, numfields, numterms, numdblocks, strsize, numblocks, fsasize,
+      numroots, numtexts, sections;
+
+  start += sizeof(Bix_preamble);
+  if (start > (long) bi->mapsize) die("Index file is corrupt");
+  preamble = (const Bix_preamble *) (bi->map + start - sizeof(Bix_preamble));
+  dir = (const Bix_section *) (preamble + 1);
+  sections = bix_get32(preamble->sections);
+  if ((sections < 0) ||
+      ((long) bi->mapsize - start)/(long) sizeof(Bix_section) < sections)
+    die("Index file is corrupt");
+
+  bi->blocks = (const Bix_block *) GetSection(bi, dir, sections,
+    bix_entries, sizeof(Bix_block), &numblocks);
+  bi->offsets = (const unsigned char *) GetSection(bi, dir, sections,
+    bix_offsets, sizeof(char), &(bi->offsize));
+  fields = (const Bix_field *) GetSection(bi, dir, sections,
+    bix_fields, sizeof(Bix_field), &numfields);
+  dblocks = (const Bix_dblock *) GetSection(bi, dir, sections,
+    bix_blocks, sizeof(Bix_dblock), &numdblocks);
+  bi->dict = (const unsigned char *) GetSection(bi, dir, sections,
+    bix_dict, sizeof(char), &(bi->dictsize));
+  strings = GetSection(bi, dir, sections,
+    bix_strings, sizeof(char), &strsize);
+  bi->refs = (const unsigned char *) GetSection(bi, dir, sections,
+    bix_refs, sizeof(char), &(bi->refsize));
+  terms = (const Bix_field *) GetSection(bi, dir, sections,
+    bix_terms, sizeof(Bix_field), &numterms);
+  fsa = (const unsigned char *) GetSection(bi, dir, sections,
+    bix_fsa, sizeof(char), &fsasize);
+  roots = (const Bix_u32 *) GetSection(bi, dir, sections,
+    bix_roots, sizeof(Bix_u32), &numroots);
+  bi->text = (const unsigned char *) GetSection(bi, dir, sections,
+    bix_text, sizeof(char), &(bi->textsize));
+  bi->texts = (const Bix_u32 *) GetSection(bi, dir, sections,
+    bix_texts, sizeof(Bix_u32), &numtexts);
+  bi->files = (const Bix_file *) GetSection(bi, dir, sections,
+    bix_files, sizeof(Bix_file), &(bi->numfiles));
+  segment = (const Bix_segment *) GetSection(bi, dir, sections,
+    bix_segment, sizeof(Bix_segment), &i);
+  if (i != 1) die("Index file is corrupt, bad segment");
+  bi->strings = strings;
+  bi->members = NULL;
+  bi->results = NULL;
+  bi->first = bix_get32(segment->first);
+  bi->replaced = bix_get32(segment->replaced);
+  bi->size = bix_get64(segment->size);
+  bi->shift = 0;
+  bi->deltas = NULL;
+  bi->numdeltas = 0;
+
+  bi->numoffsets = bix_get32(preamble->entries);
+  bi->cached = -1;
+  bi->buf = NULL;
+  bi->bufsize = 0;
+  bi->buffered = -1;
+  if ((bi->numoffsets < 0) ||
+      (numblocks != (bi->numoffsets + BIX_BLOCK - 1)/BIX_BLOCK))
+    die("Index file is corrupt, bad entry count");
+
+  if (numtexts == 0) bi->text = NULL;
+  else if (numtexts != numblocks)
+    die("Index file is corrupt, bad entry text");
+
+  for (i = 0; i < bi->numfiles; i++) {
+    const long
+      name = bix_get32(bi->files[i].name),
+      first = bix_get32(bi->files[i].first);
+
+    if ((name < 0) || (name >= strsize) || (first < 0) ||
+	(first > bi->numoffsets) || (bix_get64(bi->files[i].base) < 0) ||
+	((i == 0) ? (first != 0) : (first < bix_get32(bi->files[i - 1].first))))
+      die("Index file is corrupt, bad file");
+    }
+
+  if ((strsize > 0) && strings[strsize - 1])
+    die("Index file is corrupt, unterminated string");
+
+  /* With a term dictionary, searching it is searching every field. */
+
+  if (numterms > 1)
+    die("Index file is corrupt, bad term dictionary");
+  bi->terms = (numterms == 1);
+  if (bi->terms) {
+    fields = terms;
+    numfields = 1;
+    }
+  if ((numroots > 0) && (numroots != numfields))
+    die("Index file is corrupt, bad automata");
+
+  /* The "+ 1" takes care of an index with no fields. */
+
+  bi->numfields = numfields;
+  bi->fieldtable = (IndexTable *) alloc(numfields*sizeof(IndexTable) + 1);
+
+  for (i = 0; i < numfields; i++) {
+    IndexTable * t = bi->fieldtable + i;
+    const long
+      name = bix_get32(fields[i].name),
+      first = bix_get32(fields[i].first),
+      numwords = bix_get32(fields[i].numwords);
+
+    if ((!bi->terms && ((name < 0) || (name >= strsize))) ||
+	(first < 0) || (numwords < 0) || (first > numdblocks) ||
+	((numwords + BIX_DICT_BLOCK - 1)/BIX_DICT_BLOCK > numdblocks - first))
+      die("Index file is corrupt, bad field");
+    t->thefield = bi->terms ? "" : strings + name;
+    t->numwords = numwords;
+    t->blocks = dblocks + first;
+    t->fsa.data = NULL;
+    if (numroots > 0) {
+      const long root = bix_get32(roots[i]);
+
+      if ((root < 0) || (root >= fsasize))
+	die("Index file is corrupt, bad automaton");
+      t->fsa.data = fsa;
+      t->fsa.size = fsasize;
+      t->fsa.root = root;
+      t->fsa.words = t->numwords;
+      }
+    }
+
+  return bix_get64(segment->next);
 
-  safefread((void *) &(bi->numoffsets), sizeof(int), 1, ifp);
-  bi->offsets = (long *) alloc((bi->numoffsets)*sizeof(long));
-  safefread((void *) (bi->offsets), sizeof(long), bi->numoffsets, ifp);
+  } /* GetSegment */
 
-  safefread((void *) &(bi->numfields), sizeof(char), 1, ifp);
-  bi->fieldtable = (IndexTable *) alloc((bi->numfields)*sizeof(IndexTable));
 
-  for (i = 0; i < bi->numfields; i++)
-    ReadWord(ifp, (bi->fieldtable)[i].thefield);
 
-  for (i = 0; i < bi->numfields; i++)
-    GetOneTable(ifp, (bi->fieldtable) + i);
+static void GetTables(FILE *ifp, bibindex bi) {
+
+  /* Map the index file ifp and point the tables in bi into it, and those of
+     any segments added to it into bi's deltas. */
+
+  struct stat st;
+  const char * hend;
+  long next;
+  int entries, space = 0;
+
+  if (fstat(fileno(ifp), &st))
+    die("Can't stat index file");
+  bi->mapsize = st.st_size;
+  bi->map = mmap(NULL, bi->mapsize, PROT_READ, MAP_SHARED, fileno(ifp), 0);
+  if (bi->map == MAP_FAILED)
+    die("Can't map index file");
+
+  /* The first preamble follows the nul-padded text header.  A segment that
+     isn't all there is still being added, and is left for next time. */
+
+  hend = memchr(bi->map, eos, bi->mapsize);
+  if (hend == NULL) die("Index file is corrupt");
+  next = GetSegment(bi, bix_start(hend - bi->map));
+  entries = bi->numoffsets;
+
+  while (WholeSegment(bi, next)) {
+    bibindex d;
+
+    if (bi->numdeltas == space) {
+      bibindex old = bi->deltas;
+
+      space = max(2*space, 4);
+      bi->deltas = (bibindex) alloc(space*sizeof(Bibindex));
+      if (old != NULL) {
+	memcpy((char *) bi->deltas, (char *) old,
+	       bi->numdeltas*sizeof(Bibindex));
+	free((char *) old);
+	}
+      }
+    d = bi->deltas + bi->numdeltas;
+    d->map = bi->map;
+    d->mapsize = bi->mapsize;
+    next = GetSegment(d, next);
+    if ((d->numfiles > 0) || (d->first < 0) || (d->replaced < 0) ||
+	(d->first + d->replaced > entries))
+      die("Index file is corrupt, bad segment");
+    d->shift = d->size - (bi->numdeltas ? d[-1].size : bi->size);
+    entries += d->numoffsets - d->replaced;
+    bi->numdeltas++;
+    }
 
   } /* GetTables */
 
 
 
+static long EntryOffset(bibindex bi, int entry, long * length) {
+
+  /* Return the offset of the given entry in bi's bib file, and store the
+     entry's length in bytes in length.  Entries tend to be asked for in order,
+     so the offsets and lengths for the entry's block are decoded all at once
+     and kept. */
+
+  const int b = entry/BIX_BLOCK;
+
+  if (b != bi->cached) {
+    const unsigned char * p;
+    int i, n;
+
+    const long data = bix_get32(bi->blocks[b].data);
+
+    if ((data < 0) || (data > bi->offsize))
+      die("Index file is corrupt, bad entry block");
+
+    p = bi->offsets + data;
+    n = bi->numoffsets - b*BIX_BLOCK;
+    if (n > BIX_BLOCK) n = BIX_BLOCK;
+
+    for (i = 0; i < n; i++) {
+      unsigned long gap, len;
+
+      if (i == 0) bi->cache[i] = bix_get64(bi->blocks[b].offset);
+      else {
+	p = bix_get_varint(p, &gap);
+	bi->cache[i] = bi->cache[i - 1] + bi->lengths[i - 1] + gap;
+	}
+      p = bix_get_varint(p, &len);
+      bi->lengths[i] = len;
+      }
+    if (p > bi->offsets + bi->offsize)
+      die("Index file is corrupt, bad entry block");
+    bi->cached = b;
+    }
+
+  *length = bi->lengths[entry % BIX_BLOCK];
+
+  return bi->cache[entry % BIX_BLOCK];
+
+  } /* EntryOffset */
+
+
+
 static void FreeTables(bibindex bi) {
 
   /* Free the index tables in bi. */
 
-  int i, j;
+  int i;
 
-  for (i = 0; i < bi->numfields; i++) {
-    for (j = 0; j < (bi->fieldtable)[i].numwords; j++)
-      free((bi->fieldtable)[i].words[j].index);
-    free((bi->fieldtable)[i].words);
+  for (i = 0; i < bi->numdeltas; i++) {
+    free((char *) (bi->deltas[i].fieldtable));
+    free(bi->deltas[i].buf);
+    if (bi->deltas[i].results != NULL) free_eset(bi->deltas[i].results);
     }
+  free((char *) (bi->deltas));
+  for (i = 0; (bi->members != NULL) && (i < max(bi->numfiles, 1)); i++)
+    if (bi->members[i].file != NULL) fclose(bi->members[i].file);
+  free(bi->members);
   free((char *) (bi->fieldtable));
-  free((char *) (bi->offsets));
+  free(bi->buf);
+  munmap(bi->map, bi->mapsize);
 
   } /* FreeTables */
 
-
-/* ----------------------------------------------------------------- *\
-|  int Findindex(IndexTable table, char *word, char prefix)
-|
-|  Find the index of a word in a table.  Return -1 if the word isn't
-|  there.  If prefix is true, return the index of the first matching
-|  word.
-\* ----------------------------------------------------------------- */
-int Findindex(IndexTable table, char *word, char prefix)
-{
-    register IndexPtr words = table.words;
-    register int hi, lo, mid, cmp;
 
-    hi = table.numwords-1;
-    lo = 0;
 
-    while (hi>=lo)
-    {
-	mid = (hi+lo)/2;
-	cmp = strcmp(word, words[mid].theword);
+static void SetMembers(bibindex bi, FILE * bibf) {
 
-	if (cmp == 0)
-	    return mid;
-	else if (cmp < 0)
-	    hi = mid-1;
-	else if (cmp > 0)
-	    lo = mid+1;
+  /* Describe the bib files covered by bi; a lone bib file, open as bibf (or
+     null), has the name in bi's header. */
+
+  int i;
+
+  bi->members = (Member *) alloc(max(bi->numfiles, 1)*sizeof(Member));
+  if (bi->numfiles == 0) {
+    bi->members[0].name = bi->bib_fname;
+    bi->members[0].file = bibf;
+    bi->members[0].base = 0;
+    bi->members[0].first = 0;
+    }
+  for (i = 0; i < bi->numfiles; i++) {
+    bi->members[i].name = bi->strings + bix_get32(bi->files[i].name);
+    bi->members[i].file = NULL;
+    bi->members[i].base = bix_get64(bi->files[i].base);
+    bi->members[i].first = bix_get32(bi->files[i].first);
     }
+  for (i = 0; i < bi->numdeltas; i++)
+    bi->deltas[i].members = bi->members;
 
-    if (prefix && !strncmp(word, words[lo].theword, strlen(word)))
-	return lo;
-    else
-	return -1;
-}
+  } /* SetMembers */
 
-
-/* =================== SET MANIPULATION ROUTINES =================== */
 
 
+static Member * MemberOf(bibindex bi, int entry) {
 
-static Set NewSet(const int size) {
+  /* Return the bib file in bi holding the given entry. */
 
-  /* Return a new set capable of holding size elements. */
+  int lo = 0, hi = max(bi->numfiles, 1) - 1;
 
-  assert(size > 0);
+  while (lo < hi) {
+    const int mid = (lo + hi + 1)/2;
 
-  setsize = (size + SETSCALE - 1)/SETSCALE;	/* HACK */
-  setmask = (1<<(size%SETSCALE)) - 1;		/* KLUDGE */
+    if (bi->members[mid].first <= entry) lo = mid;
+    else hi = mid - 1;
+    }
 
-  return (Set) alloc(setsize*SETSCALE);
+  return bi->members + lo;
 
-  } /* NewSet */
+  } /* MemberOf */
 
 
 
-/* ----------------------------------------------------------------- *\
-|  void EmptySet(Set theset)
-|
-|  Empty the set.
-\* ----------------------------------------------------------------- */
-static void EmptySet(Set theset)
-{
-    register int i;
-    for (i=0; i<setsize; i++)
-	theset[i] = 0L;
-}
+static int Forward(bibindex bi, int s, int entry, long * shift) {
 
-/* ----------------------------------------------------------------- *\
-|  void SetUnion(Set src1, Set src2, Set result)
-|
-|  Get the union of two sets
-\* ----------------------------------------------------------------- */
-static void SetUnion(Set src1, Set src2, Set result)
-{
-    register int i;
-    for (i=0; i<setsize; i++)
-	result[i] = src1[i] | src2[i];
-}
+  /* Return the position among all of bi's entries of the given entry in bi's
+     segment s (bi itself is segment 0), and store in shift how far the entry
+     has moved in the bib file since; return -1 if a later segment replaced
+     the entry. */
 
-/* ----------------------------------------------------------------- *\
-|  void SetInsersection(Set src1, Set src2, Set result)
-|
-|  Get the intersection of two sets
-\* ----------------------------------------------------------------- */
-static void SetIntersection(Set src1, Set src2, Set result)
-{
-    register int i;
-    for (i=0; i<setsize; i++)
-	result[i] = src1[i] & src2[i];
-}
+  int p = entry + (s > 0 ? bi->deltas[s - 1].first : 0);
 
-/* ----------------------------------------------------------------- *\
-|  void SetComplement(Set src, Set result)
-|
-|  Get the complement of a set
-\* ----------------------------------------------------------------- */
-static void SetComplement(Set src, Set result)
-{
-    register int i;
-    for (i=0; i<setsize; i++)
-	result[i] = ~src[i];
-    result[setsize-1] &= setmask;	/* clear those last few bits */
-}
+  for (*shift = 0; s < bi->numdeltas; s++) {
+    const bibindex d = bi->deltas + s;
 
+    if (p >= d->first + d->replaced) {
+      p += d->numoffsets - d->replaced;
+      *shift += d->shift;
+      }
+    else if (p >= d->first) return -1;
+    }
+
+  return p;
+
+  } /* Forward */
 
-/* Copy one set into another.
 
-static void CopySet(Set src, Set result) {
+
+static bool Current(bibindex bi, bool embedded) {
+
+  /* Return true if none of the bib files in the collection bi have changed
+     since bi was made.  If bi holds the entries' text, files that can't be
+     found don't count. */
 
   int i;
 
-  for (i = 0; i < setsize; i++) result[i] = src[i];
-}
+  for (i = 0; i < bi->numfiles; i++) {
+    struct stat st;
 
-*/
+    if (stat(bi->strings + bix_get32(bi->files[i].name), &st)) {
+      if (!embedded) return false;
+      }
+    else if (st.st_mtime != bix_get64(bi->files[i].mod_time)) return false;
+    }
 
-
-/* ----------------------------------------------------------------- *\
-|  int CountSet(Set theset)
-|
-|  Get the cardinality of the set
-\* ----------------------------------------------------------------- */
-static int CountSet(Set theset)
-{
-    register unsigned i, j, count;
+  return true;
 
-    count = 0;
-    for (i=0; i<(unsigned)setsize; i++)
-	for (j=0; j<(unsigned)SETSCALE; j++)
-	    if (theset[i] & (1<<j))
-		count++;
+  } /* Current */
 
-    return count;
-}
 
 /* ----------------------------------------------------------------- *\
-|  void BuildSet(Set theset, int *thelist, int length)
+|  int Findindex(bibindex bi, const IndexTable *table, const char *word,
+|                int mode, Bix_dict *d)
 |
-|  Build a set out of a list of integers
+|  Find a word in a table, leaving d at it, and return the number of
+|  matching words; return 0 if the word isn't there.  If mode is
+|  match_prefix, leave d at the first of the words having word as a
+|  prefix, which follow one another.
 \* ----------------------------------------------------------------- */
-static void BuildSet(Set theset, int *thelist, int length)
+static int Findindex(bibindex bi, const IndexTable *table, const char *word,
+		     int mode, Bix_dict *d)
 {
-    register unsigned i;
+    const int len = strlen(word);
+    int ord, n;
+    Bix_dict e;
+
+    bix_open_dict(d, table->blocks, bi->dict, bi->dictsize, table->numwords,
+		  table->fsa.data == NULL);
 
-    EmptySet(theset);
-    for (i=0; i<(unsigned)length; i++)
-	theset[thelist[i]/SETSCALE] |= 1 << (thelist[i] % SETSCALE);
+    if (table->fsa.data != NULL) {
+	if (mode == match_prefix) {
+	    if (!prefix_fsa(&(table->fsa), word, &ord, &n))
+		return 0;
+	}
+	else if (find_fsa(&(table->fsa), word, &ord))
+	    n = 1;
+	else
+	    return 0;
+	return bix_seek_ordinal(d, ord) ? n : 0;
+    }
+
+    if (!bix_seek_word(d, word))
+	return 0;
+    else if (mode != match_prefix)
+	return !strcmp(word, d->word);
+
+    for (n = 0, e = *d; !strncmp(word, e.word, len); n++)
+	if (!bix_next_word(&e))
+	    return n + 1;
+    return n;
 }
 
-
-/* ======================== SEARCH ROUTINES ======================== */
 
-static Set results, oldresults, oneword, onefield;
+/* =================== SET MANIPULATION ROUTINES =================== */
 
-static void InitSearch(bblock indices) {
+/* Sets of entries are held in hybrid containers (see entry-set.c), so the
+   work done for a word is proportional to the number of entries it touches,
+   not to the number of entries in the index. */
 
-  int max, i;
 
-  max = ((bibindex) indices[0])->numoffsets;
-  for (i = 1; i < size_bblock(indices); i++) {
-    const int m = ((bibindex) indices[i])->numoffsets;
-    if (m > max) max = m;
+static eset BuildSet(const unsigned char *thelist, int length) {
+
+  /* Return the set of entries in the compressed entry list thelist. */
+
+  eset theset = new_eset();
+  Bix_cursor c;
+
+  bix_open_refs(&c, thelist, length);
+  while (bix_next_ref(&c)) append_eset(theset, c.value);
+  optimize_eset(theset);
+
+  return theset;
+
+  } /* BuildSet */
+
+
+
+static eset FilterSet(const eset candidates, const unsigned char *thelist,
+		      int length) {
+
+  /* Return the set of entries in candidates that are also in the compressed
+     entry list thelist.  The list's skip table lets this decode only the
+     blocks that might hold a candidate. */
+
+  eset theset = new_eset();
+  Bix_cursor c;
+  Eset_iter it;
+  int e;
+
+  bix_open_refs(&c, thelist, length);
+  start_eset(candidates, &it);
+  while (next_eset(&it, &e)) {
+    if (!bix_seek_ref(&c, e)) break;
+    if (c.value == e) append_eset(theset, e);
     }
 
-  results = NewSet(max);
-  oldresults = NewSet(max);
-  oneword = NewSet(max);
-  onefield = NewSet(max);
+  return theset;
+
+  } /* FilterSet */
+
+
+/* ======================== SEARCH ROUTINES ======================== */
+
+static void InitSearch(bblock indices) {
+
+  int i;
 
   for (i = 0; i < size_bblock(indices); i++)
-    ((bibindex) indices[i])->results = NewSet(max);
+    ((bibindex) indices[i])->results = NULL;
 
   } /* InitSearch */
 
@@ -400,13 +720,12 @@ static void Free(bblock indices) {
 
   int i;
 
-  for (i = 0; i < size_bblock(indices); i++)
-    FreeTables((bibindex) indices[i]);
+  for (i = 0; i < size_bblock(indices); i++) {
+    bibindex bi = (bibindex) indices[i];
 
-  free(results);
-  free(oldresults);
-  free(oneword);
-  free(onefield);
+    FreeTables(bi);
+    if (bi->results != NULL) free_eset(bi->results);
+    }
 
   free_bblock(indices);
 
@@ -414,110 +733,310 @@ static void Free(bblock indices) {
 
 
 
-static bool FindWord(bibindex bi, register char *word, char prefix) {
+static void AddWord(bibindex bi, const Bix_dict * w, eset oneword) {
 
-  /* Find all entries in bi containing word.  If the prefix flag is set,
-     find all words having word as a prefix. Return true iff at least one
-     match was found. */
+  /* Add the entries containing w's current word to oneword.  Entries that
+     aren't in bi's current results don't matter, so if there are fewer of
+     those than entries containing w, look for them in w's entry list instead
+     of decoding all of it. */
+
+  const unsigned char * list;
+  eset onefield;
+
+  if ((w->refs < 0) || (w->numrefs < 0) || (w->refs >= bi->refsize) ||
+      (w->numrefs > bi->numoffsets))
+    die("Index file is corrupt, bad word");
+
+  list = bi->refs + w->refs;
+  if (bi->terms) list = bix_term_refs(list);
+
+  if (count_eset(bi->results) < w->numrefs)
+    onefield = FilterSet(bi->results, list, w->numrefs);
+  else
+    onefield = BuildSet(list, w->numrefs);
+  union_eset(oneword, onefield);
+  free_eset(onefield);
+
+  } /* AddWord */
+
+
+
+static bool Near(const char * a, const char * b, int edits) {
+
+  /* Return true iff a and b are no more than edits insertions, deletions, or
+     substitutions apart. */
+
+  int rows[2][max_word_size + 1], * up = rows[0], * row = rows[1], i, j;
+  const int alen = strlen(a), blen = strlen(b);
+
+  if ((alen > max_word_size) || (alen - blen > edits) || (blen - alen > edits))
+    return false;
+
+  for (j = 0; j <= alen; j++) up[j] = j;
+  for (i = 1; i <= blen; i++) {
+    int best = row[0] = i, * t;
+
+    for (j = 1; j <= alen; j++) {
+      row[j] = min(min(up[j], row[j - 1]) + 1,
+		   up[j - 1] + (a[j - 1] != b[i - 1]));
+      best = min(best, row[j]);
+      }
+    if (best > edits) return false;
+    t = up, up = row, row = t;
+    }
+
+  return up[alen] <= edits;
+
+  } /* Near */
+
+
+
+typedef struct {
+  bibindex   bi;
+  Bix_dict * d;
+  eset       oneword;
+  bool       found;
+  } Near_words;
+
+
+static void AddNear(int ordinal, void * arg) {
+
+  /* Add the entries containing the word at the given position in the
+     dictionary being searched by near_fsa() to the entries in arg. */
+
+  Near_words * nw = (Near_words *) arg;
+
+  if (bix_seek_ordinal(nw->d, ordinal)) {
+    AddWord(nw->bi, nw->d, nw->oneword);
+    nw->found = true;
+    }
+
+  } /* AddNear */
 
-  int i;
-  const int len = strlen(word);
+
+
+static bool FindNear(
+  bibindex bi, const IndexTable * t, const char * word, eset oneword) {
+
+  /* Add the entries containing words in t close to word to oneword; return
+     true iff there was at least one such word.  A table with an automaton
+     has it search for the close words; otherwise every word in the table is
+     tried. */
+
+  Bix_dict d;
+  Near_words nw;
+
+  bix_open_dict(&d, t->blocks, bi->dict, bi->dictsize, t->numwords,
+		t->fsa.data == NULL);
+
+  nw.bi = bi;
+  nw.d = &d;
+  nw.oneword = oneword;
+  nw.found = false;
+
+  if (t->fsa.data != NULL)
+    near_fsa(&(t->fsa), word, NEAR_EDITS, AddNear, &nw);
+  else
+    while (bix_next_word(&d))
+      if (Near(word, d.word, NEAR_EDITS)) {
+	AddWord(bi, &d, oneword);
+	nw.found = true;
+	}
+
+  return nw.found;
+
+  } /* FindNear */
+
+
+
+static bool FindWord(bibindex bi, register char *word, int mode) {
+
+  /* Find all entries in bi containing word.  If mode is match_prefix, find
+     all words having word as a prefix; if it's match_near, find all words
+     close to word.  Return true iff at least one match was found. */
+
+  int i, n;
+  bool found = false;
+  eset oneword;
 
   static char badwords[][5] = {
     "an", "and", "for", "in", "of", "on", "the", "to", "with", ""};
 
-  if (!prefix) {
+  if (mode == match_exact) {
     if (!word[0] || !word[1]) return false;
 
     for (i = 0; *badwords[i]; i++)
       if (!strcmp(badwords[i], word)) return false;
     }
 
-  EmptySet(oneword);
+  oneword = new_eset();
 
   for (i = 0; i < bi->numfields; i++) {
-    IndexPtr words = (bi->fieldtable)[i].words;
-    int win = Findindex((bi->fieldtable)[i], word, prefix);
-
-    if (win != -1) {
-      if (prefix) {
-	while ((win < (bi->fieldtable)[i].numwords) &&
-		       !strncmp(words[win].theword, word, len)) {
-	  BuildSet(onefield, words[win].index, words[win].numindex);
-	  SetUnion(oneword, onefield, oneword);
-	  win++;
-	  }
-	}
-      else {
-	BuildSet(onefield, words[win].index, words[win].numindex);
-	SetUnion(oneword, onefield, oneword);
-	}
+    Bix_dict d;
+
+    if (mode == match_near)
+      found = FindNear(bi, bi->fieldtable + i, word, oneword) || found;
+    else if ((n = Findindex(bi, bi->fieldtable + i, word, mode, &d)) > 0) {
+      found = true;
+      do AddWord(bi, &d, oneword);
+      while ((--n > 0) && bix_next_word(&d));
       }
     }
 
-  SetIntersection(oneword, bi->results, bi->results);
+  intersect_eset(bi->results, oneword);
+  free_eset(oneword);
 
-  return (CountSet(oneword) ? true : false);
+  return found;
 
   } /* FindWord */
 
 
 /* ============================= OUTPUT ============================ */
 
-static void PrintEntry(bibindex bi, int entry, FILE *ofp) {
+static char * GetBuffer(bibindex bi, long size) {
 
-  /* Print the entry. */
+  /* Return bi's text buffer, making sure it holds at least size bytes. */
 
-  char ch;
-  char braces;
-  char quotes;
+  if (size > bi->bufsize) {
+    free(bi->buf);
+    bi->bufsize = max(size, 2*bi->bufsize);
+    bi->buf = alloc(bi->bufsize);
+    }
 
-  if (entry >= bi->numoffsets) return;
+  return bi->buf;
+
+  } /* GetBuffer */
 
-  fprintf(ofp, "\n%s\n", bi->bib_fname);
-  if (fseek(bi->bib_file, bi->offsets[entry], 0))
-    die("Index file is corrupt");
 
-  ch = safegetc(bi->bib_file);
 
-  while (ch != '@') {
-    fputc(ch, ofp);
-    ch = safegetc(bi->bib_file);
+static const char * EntryText(bibindex bi, int entry) {
+
+  /* Return the text of the given entry, kept in bi's index file.  Entries tend
+     to be asked for in order, so the text of the entry's whole block is
+     expanded at once and kept. */
+
+  const int b = entry/BIX_BLOCK, first = b*BIX_BLOCK;
+  long length, start;
+  int i;
+
+  if (b != bi->buffered) {
+    const int n = min(bi->numoffsets - first, BIX_BLOCK);
+    const long
+      start = bix_get32(bi->texts[b]),
+      end = (first + n < bi->numoffsets) ?
+	      bix_get32(bi->texts[b + 1]) : bi->textsize;
+    long size;
+
+    for (i = 0, size = 0; i < n; i++) {
+      EntryOffset(bi, first + i, &length);
+      size += length;
+      }
+    if ((start < 0) || (end < start) || (end > bi->textsize) ||
+	!lz_expand((unsigned char *) GetBuffer(bi, size), size,
+		   bi->text + start, end - start))
+      die("Index file is corrupt, bad entry text");
+    bi->buffered = b;
     }
-  while ((ch != '{') && (ch != '(')) {
-    fputc(ch, ofp);
-    ch = safegetc(bi->bib_file);
+
+  for (i = first, start = 0; i < entry; i++) {
+    EntryOffset(bi, i, &length);
+    start += length;
     }
 
-  braces = quotes = 0;
+  return bi->buf + start;
+
+  } /* EntryText */
+
+
+
+static void PrintEntry(bibindex bi, int entry, long shift, FILE *ofp) {
+
+  /* Print the entry, which has moved shift bytes in the bib file since its
+     segment was added.  The index gives the entry's extent in the bib file,
+     from the '@' through the closing bracket, so the entry is read in one go,
+     or taken from the index if it's there. */
+
+  const char * text;
+  long offset, length;
+  Member * m;
 
-  fputc(ch, ofp);
-  ch = safegetc(bi->bib_file);
-  while (braces || quotes || ((ch != '}') && (ch != ')'))) {
-         if (ch == '{') braces++;
-    else if (ch == '}') braces--;
-    else if ((ch == '"') && !braces) quotes = !quotes;
-    fputc(ch, ofp);
-    ch = safegetc(bi->bib_file);
+  if (entry >= bi->numoffsets) return;
+
+  offset = EntryOffset(bi, entry, &length) + shift;
+  m = MemberOf(bi, entry);
+  if ((offset < m->base) || (length <= 0)) die("Index file is corrupt");
+
+  if (bi->text != NULL) text = EntryText(bi, entry);
+  else {
+    if (m->file == NULL) {
+      m->file = fopen(m->name, "r");
+      if (m->file == NULL) die("Can't open bib file");
+      }
+    text = GetBuffer(bi, length);
+    safepread(bi->buf, length, offset - m->base, m->file);
     }
 
-  fputc(ch, ofp);
+  fprintf(ofp, "\n%s\n", m->name);
+  fwrite(text, sizeof(char), length, ofp);
   fputc('\n', ofp);
 
   } /* PrintEntry */
 
 
 
+typedef struct {
+  int      position;	/* among all the index's entries */
+  int      entry;	/* in its segment */
+  bibindex segment;
+  long     shift;
+  } Hit;
+
+
+static int CompareHits(const void * a, const void * b) {
+
+  return ((const Hit *) a)->position - ((const Hit *) b)->position;
+
+  } /* CompareHits */
+
+
+
 static void DoForSet(bibindex bi, FILE * ofp) {
 
-  /* Do something to every element in a set */
+  /* Do something to every element in a set.  The entries found in an index
+     with added segments are put in order, leaving out those replaced. */
+
+  Eset_iter it;
+  Hit * hits;
+  int entry, n, s;
+
+  if (bi->numdeltas == 0) {
+    start_eset(bi->results, &it);
+    while (next_eset(&it, &entry))
+      PrintEntry(bi, entry, 0, ofp);
+    return;
+    }
+
+  for (s = 0, n = count_eset(bi->results); s < bi->numdeltas; s++)
+    n += count_eset(bi->deltas[s].results);
+  hits = (Hit *) alloc(n*sizeof(Hit) + 1);
+
+  for (s = 0, n = 0; s <= bi->numdeltas; s++) {
+    const bibindex seg = s ? bi->deltas + s - 1 : bi;
+
+    start_eset(seg->results, &it);
+    while (next_eset(&it, &entry)) {
+      hits[n].position = Forward(bi, s, entry, &(hits[n].shift));
+      hits[n].entry = entry;
+      hits[n].segment = seg;
+      if (hits[n].position >= 0) n++;
+      }
+    }
 
-  register unsigned i, j;
+  qsort((char *) hits, n, sizeof(Hit), CompareHits);
+  for (s = 0; s < n; s++)
+    PrintEntry(hits[s].segment, hits[s].entry, hits[s].shift, ofp);
+  free((char *) hits);
 
-  for (i = 0; i < (unsigned) setsize; i++)
-    for (j = 0; j < (unsigned) SETSCALE; j++)
-      if ((bi->results)[i] & (1<<j))
-	PrintEntry(bi, SETSCALE*i + j, ofp);
   }
 
 
@@ -572,7 +1091,6 @@ static arguments do_cla(int argc, char ** argv) {
   extern int
     optind,
     do_rcfile(char **, int *, int *, char *);
-  extern int getopt(int, char ** const, const char *);
 
   bix_dirs = getenv("BIBINPUTS");
   cla.update = 0;
@@ -637,24 +1155,151 @@ static arguments do_cla(int argc, char ** argv) {
 
 
 
-static int update_file(const char * bixfn, const char * bibfn) {
+static bool ReadLibraries(
+  FILE * bixf, long libs, long numlibs, long strings, long strsize,
+  bool embedded, bool * stale, sblock * options) {
+
+  /* Add a -l option to options for each of the numlibs string libraries
+     described at libs in the index file bixf, whose names are in the strsize
+     bytes at strings.  Set stale if a library has changed since the index
+     was made; if the index holds its entries' text, libraries that can't be
+     found don't count.  Return false if the index file is corrupt. */
+
+  struct stat st;
+  Bix_library lib;
+  char name[MAXPATHLEN];
+  long i, n;
+  size_t len;
+
+  for (i = 0; i < numlibs; i++) {
+    if (fseek(bixf, libs + i*(long) sizeof(Bix_library), SEEK_SET) ||
+	(fread(&lib, sizeof(Bix_library), 1, bixf) < 1))
+      return false;
+    n = bix_get32(lib.name);
+    if ((n < 0) || (n >= strsize) || fseek(bixf, strings + n, SEEK_SET))
+      return false;
+    len = fread(name, sizeof(char), min(strsize - n, MAXPATHLEN), bixf);
+    if (memchr(name, eos, len) == NULL) return false;
+    if (stat(name, &st)) {
+      if (!embedded) *stale = true;
+      }
+    else if (st.st_mtime != bix_get64(lib.mod_time)) *stale = true;
+    *options = add_sblock(add_sblock(*options, "-l"), name);
+    }
+
+  return true;
+
+  } /* ReadLibraries */
+
+
+
+static bool ReadModTime(
+  FILE * bixf, time_t * mod_time, bool * embedded, bool * collection,
+  bool * stale, sblock * options) {
+
+  /* Read the preamble and section directory of each segment in the index file
+     bixf, positioned just after its text header.  Store the modification time
+     from the last whole segment in mod_time, and whether the index holds its
+     entries' text or is a collection in embedded and collection, and whether
+     any of its string libraries have changed in stale.  Store in options the
+     other btxindex options that write the index the same way.  Return false
+     if the index file is corrupt. */
+
+  struct stat st;
+  long start = bix_start(ftell(bixf)), segment, end, i,
+       libs = 0, numlibs = 0, strings = 0, strsize = 0;
+  bool first = true;
+
+  *embedded = *collection = *stale = false;
+  if (*options != sblock_nil) free_sblock(*options);
+  *options = sblock_nil;
+  if (fstat(fileno(bixf), &st)) return false;
+
+  loop {
+    Bix_preamble p;
+    Bix_section s;
+    Bix_segment seg;
+
+    if (fseek(bixf, start, SEEK_SET)) return !first;
+    if (first) safefread(&p, sizeof(Bix_preamble), 1, bixf);
+    else if (fread(&p, sizeof(Bix_preamble), 1, bixf) < 1) return true;
+
+    for (i = bix_get32(p.sections), segment = -1, end = 0; i > 0; i--) {
+      if (first) safefread(&s, sizeof(Bix_section), 1, bixf);
+      else if (fread(&s, sizeof(Bix_section), 1, bixf) < 1) return true;
+      end = max(end, bix_get64(s.offset) + bix_get64(s.size));
+      if (bix_get32(s.id) == bix_segment) segment = bix_get64(s.offset);
+      if (first && (bix_get32(s.id) == bix_text) && (bix_get64(s.size) > 0))
+	*embedded = true;
+      if (first && (bix_get32(s.id) == bix_files) && (bix_get64(s.size) > 0))
+	*collection = true;
+      if (first && (bix_get32(s.id) == bix_terms) && (bix_get64(s.size) > 0))
+	*options = add_sblock(*options, "-t");
+      if (first && (bix_get32(s.id) == bix_roots) && (bix_get64(s.size) > 0))
+	*options = add_sblock(*options, "-a");
+      if (first && (bix_get32(s.id) == bix_libraries)) {
+	libs = bix_get64(s.offset);
+	numlibs = bix_get64(s.size)/sizeof(Bix_library);
+	}
+      if (first && (bix_get32(s.id) == bix_strings)) {
+	strings = bix_get64(s.offset);
+	strsize = bix_get64(s.size);
+	}
+      }
+    if (end > st.st_size) return !first;
+    if (first && !ReadLibraries(bixf, libs, numlibs, strings, strsize,
+				*embedded, stale, options))
+      return false;
+
+    if (segment < 0) return !first;
+    *mod_time = bix_get64(p.mod_time);
+    if (fseek(bixf, segment, SEEK_SET) ||
+	(fread(&seg, sizeof(Bix_segment), 1, bixf) < 1))
+      return false;
+    start = bix_get64(seg.next);
+    first = false;
+    }
+
+  } /* ReadModTime */
+
+
+
+static int update_file(const char * bixfn, const char * bibfn,
+		       bool embedded, sblock options) {
 
   /* Return 1 if the bibliography file bibfn could be updated into the
-     index file bixfn, 0 otherwise. */
+     index file bixfn, 0 otherwise.  If embedded, the new index holds the
+     entries' text too; the btxindex options in options are passed on.  The
+     index is updated by adding a segment for what's changed, if it can
+     be. */
   
   char bixdir[MAXPATHLEN], * dp;
-  int status, childpid;
+  const char ** argv;
+  int status, childpid, argc, i;
 
   copy_str(bixfn, bixdir);
   dp = strrchr(bixdir, '/');
   assert(dp != NULL);
   *dp = eos;
 
+  argv = (const char **) alloc((size_sblock(options) + 8)*sizeof(char *));
+  argc = 0;
+  argv[argc++] = "btxindex";
+  argv[argc++] = "-i";
+  if (embedded) argv[argc++] = "-e";
+  for (i = 0; i < size_sblock(options); i++) argv[argc++] = options[i];
+  argv[argc++] = "-w";
+  argv[argc++] = bixdir;
+  argv[argc++] = "-p0";
+  argv[argc++] = bibfn;
+  argv[argc] = NULL;
+
   if ((childpid = fork())) waitpid(childpid, &status, 0);
   else {
-    execlp("btxindex", "btxindex", "-w", bixdir, "-p0", bibfn, NULL);
+    execvp("btxindex", (char * const *) argv);
     status = 1;
     }
+  free((char *) argv);
 
   return (!(status & 0xffff));
 
@@ -662,10 +1307,56 @@ static int update_file(const char * bixfn, const char * bibfn) {
 
 
 
+static int update_collection(const char * bixfn, const char * name,
+			     bibindex bi, bool embedded, sblock options) {
+
+  /* Return 1 if the bib files in the collection bi could be reindexed into
+     the collection name's index file bixfn, 0 otherwise.  If embedded, the
+     new index holds the entries' text too; the btxindex options in options
+     are passed on. */
+
+  char bixdir[MAXPATHLEN], * dp;
+  const char ** argv;
+  int status, childpid, argc, i;
+
+  copy_str(bixfn, bixdir);
+  dp = strrchr(bixdir, '/');
+  assert(dp != NULL);
+  *dp = eos;
+
+  argv = (const char **)
+    alloc((bi->numfiles + size_sblock(options) + 8)*sizeof(char *));
+  argc = 0;
+  argv[argc++] = "btxindex";
+  if (embedded) argv[argc++] = "-e";
+  for (i = 0; i < size_sblock(options); i++) argv[argc++] = options[i];
+  argv[argc++] = "-w";
+  argv[argc++] = bixdir;
+  argv[argc++] = "-p0";
+  argv[argc++] = "-c";
+  argv[argc++] = name;
+  for (i = 0; i < bi->numfiles; i++)
+    argv[argc++] = bi->strings + bix_get32(bi->files[i].name);
+  argv[argc] = NULL;
+
+  if ((childpid = fork())) waitpid(childpid, &status, 0);
+  else {
+    execvp("btxindex", (char * const *) argv);
+    status = 1;
+    }
+  free((char *) argv);
+
+  return (!(status & 0xffff));
+
+  } /* update_collection */
+
+
+
 #define openerr(_m, _d, _f, _e) \
   do {verbage(1, (stderr, "\"%s\" ignored:  " _m  ".\n", \
                   make_fullpath(_d, _f, _e))); \
       if (bixf != NULL) closef(bixf); if (bibf != NULL) closef(bixf); \
+      if (options != sblock_nil) free_sblock(options); \
       return indices; } while (0)
 
 #define do_stat(_f, _s) \
@@ -677,11 +1368,16 @@ static int update_file(const char * bixfn, const char * bibfn) {
      if (i < 4) openerr("index file is corrupted", "", fp->name, ""); \
     } while (0)
 
+#define read_mod_time(_t, _e, _c, _s) \
+ do if (!ReadModTime(bixf, &(_t), &(_e), &(_c), &(_s), &options)) \
+      openerr("index file is corrupted", "", fp->name, ""); \
+    while (0)
+
 #define update_index_file(_what) \
   if (!(cla->update)) openerr("index file is " #_what, "", fp->name, ""); \
   else {closef(bixf); \
         bixf = NULL; \
-        if (!update_file(full_bixfn, bibfn)) \
+        if (!update_file(full_bixfn, bibfn, embedded, options)) \
 	  openerr("can't update " #_what " index file", "", fp->name, ""); \
         bixf = fopen(full_bixfn, "r"); \
         if (bixf == NULL) \
@@ -702,6 +1398,9 @@ open_index(arguments cla, const char * fname, bblock indices) {
   struct stat bibstat;
   bibindex bi;
   time_t mod_time;
+  bool embedded = false, collection, stale;
+  sblock options = sblock_nil;
+  Bibindex members;
 
   /* Pick apart the file name. */
 
@@ -726,7 +1425,10 @@ open_index(arguments cla, const char * fname, bblock indices) {
        openerr("can't find index file", "", fp->name, "");
 
   /* Find the associated bibliography file, make sure its older than the index
-     file, and open it. */
+     file, and open it.  An index holding the entries' text doesn't need the
+     bibliography file, which may have moved or be out of reach; if it can't be
+     found, the index is used as is.  The index is out of date, too, if a
+     string library it was made with has changed. */
 
      scan_file(&filev, &majorv, &minorv, bibfn);
 
@@ -735,27 +1437,66 @@ open_index(arguments cla, const char * fname, bblock indices) {
        update_index_file(obsolete);
        }
 
-     do_stat(bibfn, bibstat);
-     safefread(&mod_time, sizeof(time_t), 1, bixf);
+     read_mod_time(mod_time, embedded, collection, stale);
+
+     if (!collection) {
+       if (!embedded) do_stat(bibfn, bibstat);
+       else if (stat(bibfn, &bibstat)) bibstat.st_mtime = mod_time;
+
+       if ((bibstat.st_mtime != mod_time) || stale) {
+	 update_index_file(out-of-date);
+	 read_mod_time(mod_time, embedded, collection, stale);
+	 }
+
+       if (!embedded) {
+	 bibf = fopen(bibfn, "r");
+	 if (bibf == NULL) {
+	   if (errno != ENOENT)
+	     openerr("can't open bibliography file", "", fp->name, "");
+	   else
+	     openerr("can't find bibliography file", "", fp->name, "");
+	   }
+	 }
+
+       indices = add_bblock(indices, (char **) &bi);
+       strcpy(bi->bib_fname, bibfn);
+       GetTables(bixf, bi);
+       SetMembers(bi, bibf);
 
-     if (bibstat.st_mtime != mod_time) {
-       update_index_file(out-of-date);
-       safefread(&mod_time, sizeof(time_t), 1, bixf);
+       if (options != sblock_nil) free_sblock(options);
+       return indices;
        }
 
-     bibf = fopen(bibfn, "r");
-     if (bibf == NULL) {
-       if (errno != ENOENT)
-	 openerr("can't open bibliography file", "", fp->name, "");
-       else
-	 openerr("can't find bibliography file", "", fp->name, "");
+  /* A collection's bib files are checked against the index one by one, and
+     the collection is reindexed if any of them, or any of its string
+     libraries, have changed.  They're opened as needed. */
+
+     GetTables(bixf, &members);
+     if (stale || !Current(&members, embedded)) {
+       if (!(cla->update)) {
+	 FreeTables(&members);
+	 openerr("index file is out-of-date", "", fp->name, "");
+	 }
+       closef(bixf);
+       bixf = NULL;
+       i = update_collection(full_bixfn, fp->name, &members, embedded,
+			     options);
+       FreeTables(&members);
+       if (!i) openerr("can't update out-of-date index file", "", fp->name, "");
+       bixf = fopen(full_bixfn, "r");
+       if (bixf == NULL)
+	 openerr("can't re-open index file", "", fp->name, "");
+       verbage(2, (stdout, "Updated out-of-date %s.bix.\n", fp->name));
+       scan_file(&filev, &majorv, &minorv, bibfn);
+       GetTables(bixf, &members);
        }
-	
+
   indices = add_bblock(indices, (char **) &bi);
-  bi->bib_file = bibf;
+  *bi = members;
   strcpy(bi->bib_fname, bibfn);
-  GetTables(bixf, bi);
+  SetMembers(bi, NULL);
 
+  if (options != sblock_nil) free_sblock(options);
   return indices;
 
   } /* open_index */
@@ -764,18 +1505,21 @@ open_index(arguments cla, const char * fname, bblock indices) {
 
 static void match_index(bibindex bi, bblock words) {
 
-  /* Look in index file bi for entries containing the match keys words. 
-     Return true iff at least one of the words went unmatched. */
+  /* Look in index file bi, and any segments added to it, for entries
+     containing the match keys words.  Return true iff at least one of the
+     words went unmatched. */
 
   int i;
 
-  EmptySet(bi->results);
-  SetComplement(bi->results, bi->results);
+  if (bi->results != NULL) free_eset(bi->results);
+  bi->results = full_eset(bi->numoffsets);
   for (i = 0; i < size_bblock(words); i++) {
     match_word mwp = (match_word) words[i];
    
-    mwp->matched = FindWord(bi, mwp->word, 0) || mwp->matched;
+    mwp->matched = FindWord(bi, mwp->word, mwp->mode) || mwp->matched;
     }
+  for (i = 0; i < bi->numdeltas; i++)
+    match_index(bi->deltas + i, words);
    
   } /* match_index */
 	
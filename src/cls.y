@@ -3,11 +3,12 @@
 
 extern void match_indices(bblock);
 
-#define add_word(_w, _wb) \
+#define add_word(_w, _m, _wb) \
   do {if (strlen(_w) > 1) { \
         match_word mwp; \
         _wb = add_bblock(_wb, (char **) &mwp); \
         copy_str(_w, mwp->word); \
+        mwp->mode = _m; \
         mwp->matched = false; } } while (false)
 
 %}
@@ -17,7 +18,7 @@ extern void match_indices(bblock);
   bblock words;
   }
 
-%token  <word> word_t
+%token  <word> word_t prefix_t near_t
 
 %type	<words> word_list
 
@@ -40,12 +41,32 @@ command_line
 word_list
   : word_t
       { $$ = new_bblock(sizeof(Match_word));
-	add_word($1, $$);
+	add_word($1, match_exact, $$);
+      }
+
+  | prefix_t
+      { $$ = new_bblock(sizeof(Match_word));
+	add_word($1, match_prefix, $$);
+      }
+
+  | near_t
+      { $$ = new_bblock(sizeof(Match_word));
+	add_word($1, match_near, $$);
       }
 
   | word_t word_list
       { $$ = $2;
-	add_word($1, $$);
+	add_word($1, match_exact, $$);
+       }
+
+  | prefix_t word_list
+      { $$ = $2;
+	add_word($1, match_prefix, $$);
+       }
+
+  | near_t word_list
+      { $$ = $2;
+	add_word($1, match_near, $$);
        }
   ;
 
@@ -179,10 +179,11 @@ full_path unmake_fullpath(const char * fname) {
      strncpy(fp.name, np, ep - np);
      fp.name[ep - np] = eos;
 
-  /* Copy the extension. */
+  /* Copy the extension, if any. */
 
-     assert(strlen(ep + 1) < MAXPATHLEN);
-     strcpy(fp.ext, ep + 1);
+     if (*ep == '.') ep++;
+     assert(strlen(ep) < MAXPATHLEN);
+     strcpy(fp.ext, ep);
 
   return &fp;
 
@@ -33,7 +33,7 @@ typedef unsigned char bool;
      do {if ((_l) <= verbage_level) fprintf _a; } while (0)
 
 
-#define FILE_VERSION	 3	
+#define FILE_VERSION	 12	
 #define MAJOR_VERSION	 3
 #define MINOR_VERSION	 1
 
@@ -0,0 +1,672 @@
+#include "common.h"
+#include "entry-set.h"
+
+#  define max(_a, _b) \
+     ((_a) < (_b) ? (_b) : (_a))
+
+#  define min(_a, _b) \
+     ((_a) > (_b) ? (_b) : (_a))
+
+/* The chunks.  A chunk holds the members of a set sharing the same
+   high-order bits (the key); the low-order CHUNK_BITS bits of each member are
+   held in one of three containers:
+
+     array   a sorted array of no more than ARRAY_MAX values.
+     bitmap  one bit per possible value.
+     run     a sorted array of (start, length - 1) pairs.  */
+
+#  define CHUNK_BITS	16
+#  define CHUNK_SIZE	(1L << CHUNK_BITS)
+#  define ARRAY_MAX	4096
+#  define WORD_BITS	(sizeof(unsigned long)*8)
+#  define BITMAP_WORDS	(CHUNK_SIZE/WORD_BITS)
+
+   enum { array_chunk, bitmap_chunk, run_chunk };
+
+   typedef struct Eset_chunk {
+     int              key;
+     int              type;
+     int              card;	/* number of members */
+     int              n;	/* number of array values or runs */
+     int              size;	/* allocated array values or runs */
+     unsigned short * vals;	/* array and run containers */
+     unsigned long  * bits;	/* bitmap containers */
+     } Eset_chunk;
+
+#  define has_bit(_b, _i) \
+     (((_b)[(_i)/WORD_BITS] >> ((_i) % WORD_BITS)) & 1UL)
+
+#  define set_bit(_b, _i) \
+     ((_b)[(_i)/WORD_BITS] |= 1UL << ((_i) % WORD_BITS))
+
+#  define run_start(_c, _r) ((int) (_c)->vals[2*(_r)])
+#  define run_end(_c, _r) \
+     ((int) (_c)->vals[2*(_r)] + (_c)->vals[2*(_r) + 1])
+
+
+/* ============================ CONTAINERS ============================ */
+
+
+static void grow_vals(eset_chunk c, const int n) {
+
+  /* Make sure c's vals array has room for n values or runs. */
+
+  const int width = (c->type == run_chunk ? 2 : 1);
+
+  if (n > c->size) {
+    unsigned short * v;
+
+    c->size = (c->size ? 2*c->size : 4);
+    if (c->size < n) c->size = n;
+    v = (unsigned short *) alloc(c->size*width*sizeof(unsigned short));
+    if (c->vals != NULL) {
+      memcpy((char *) v, (char *) c->vals, c->n*width*sizeof(unsigned short));
+      free(c->vals);
+      }
+    c->vals = v;
+    }
+
+  } /* grow_vals */
+
+
+
+static void add_run(eset_chunk c, const int start, const int end) {
+
+  /* Add the run start..end to the end of the run chunk c, merging it with the
+     last run if they touch. */
+
+  if (c->n && (run_end(c, c->n - 1) + 1 >= start)) {
+    if (end > run_end(c, c->n - 1))
+      c->vals[2*(c->n - 1) + 1] = end - run_start(c, c->n - 1);
+    return;
+    }
+
+  grow_vals(c, c->n + 1);
+  c->vals[2*c->n] = start;
+  c->vals[2*c->n + 1] = end - start;
+  c->n++;
+
+  } /* add_run */
+
+
+
+static int count_bits(const unsigned long * bits) {
+
+  /* Return the number of bits set in the bitmap bits. */
+
+  int i, n = 0;
+
+  for (i = 0; i < (int) BITMAP_WORDS; i++) {
+    unsigned long w = bits[i];
+    for (; w; w &= w - 1) n++;
+    }
+
+  return n;
+
+  } /* count_bits */
+
+
+
+static void set_range(unsigned long * bits, int lo, const int hi) {
+
+  /* Set bits lo through hi in the bitmap bits. */
+
+  for (; (lo <= hi) && (lo % WORD_BITS); lo++) set_bit(bits, lo);
+  for (; lo + (int) WORD_BITS - 1 <= hi; lo += WORD_BITS)
+    bits[lo/WORD_BITS] = ~0UL;
+  for (; lo <= hi; lo++) set_bit(bits, lo);
+
+  } /* set_range */
+
+
+
+static unsigned long * new_bits(void) {
+
+  /* Return a new, empty bitmap. */
+
+  unsigned long * b;
+
+  b = (unsigned long *) alloc(BITMAP_WORDS*sizeof(unsigned long));
+  memset((char *) b, 0, BITMAP_WORDS*sizeof(unsigned long));
+
+  return b;
+
+  } /* new_bits */
+
+
+
+static void to_bitmap(eset_chunk c) {
+
+  /* Convert c into a bitmap container. */
+
+  int i;
+
+  if (c->type == bitmap_chunk) return;
+
+  c->bits = new_bits();
+  if (c->type == array_chunk)
+    for (i = 0; i < c->n; i++) set_bit(c->bits, c->vals[i]);
+  else
+    for (i = 0; i < c->n; i++)
+      set_range(c->bits, run_start(c, i), run_end(c, i));
+
+  if (c->vals != NULL) free(c->vals);
+  c->vals = NULL;
+  c->n = c->size = 0;
+  c->type = bitmap_chunk;
+
+  } /* to_bitmap */
+
+
+
+static void to_array(eset_chunk c) {
+
+  /* Convert the bitmap container c, which should have no more than ARRAY_MAX
+     members, into an array container. */
+
+  int i;
+
+  assert((c->type == bitmap_chunk) && (c->card <= ARRAY_MAX));
+
+  c->type = array_chunk;
+  c->n = c->size = 0;
+  grow_vals(c, c->card);
+  for (i = 0; i < CHUNK_SIZE; i++)
+    if (has_bit(c->bits, i)) c->vals[c->n++] = i;
+
+  free(c->bits);
+  c->bits = NULL;
+
+  } /* to_array */
+
+
+
+static void bitmap_done(eset_chunk c) {
+
+  /* Recount the members of the bitmap container c, and turn it into an array
+     container if it has become sparse. */
+
+  c->card = count_bits(c->bits);
+  if (c->card <= ARRAY_MAX) to_array(c);
+
+  } /* bitmap_done */
+
+
+
+static bool has_value(const eset_chunk c, const int v) {
+
+  /* Return true iff v is in the container c. */
+
+  int lo, hi;
+
+  if (c->type == bitmap_chunk) return has_bit(c->bits, v) ? true : false;
+
+  lo = 0;
+  hi = c->n - 1;
+  while (lo <= hi) {
+    const int mid = (lo + hi)/2;
+
+    if (c->type == array_chunk) {
+      if (c->vals[mid] == v) return true;
+      if (c->vals[mid] < v) lo = mid + 1; else hi = mid - 1;
+      }
+    else {
+      if (v < run_start(c, mid)) hi = mid - 1;
+      else if (v > run_end(c, mid)) lo = mid + 1;
+      else return true;
+      }
+    }
+
+  return false;
+
+  } /* has_value */
+
+
+
+static void free_chunk(eset_chunk c) {
+
+  /* Free the containers in c. */
+
+  if (c->vals != NULL) free(c->vals);
+  if (c->bits != NULL) free(c->bits);
+  c->vals = NULL;
+  c->bits = NULL;
+
+  } /* free_chunk */
+
+
+
+static void copy_chunk(eset_chunk to, const eset_chunk from) {
+
+  /* Make to a copy of from. */
+
+  const int width = (from->type == run_chunk ? 2 : 1);
+
+  *to = *from;
+  to->vals = NULL;
+  to->bits = NULL;
+  if (from->type == bitmap_chunk) {
+    to->bits = new_bits();
+    memcpy((char *) to->bits, (char *) from->bits,
+	   BITMAP_WORDS*sizeof(unsigned long));
+    }
+  else if (from->n) {
+    to->size = 0;
+    grow_vals(to, from->n);
+    memcpy((char *) to->vals, (char *) from->vals,
+	   from->n*width*sizeof(unsigned short));
+    }
+  else to->size = 0;
+
+  } /* copy_chunk */
+
+
+
+static void union_chunk(eset_chunk a, const eset_chunk b) {
+
+  /* Add the members of b to a. */
+
+  int i;
+
+  if ((a->type == array_chunk) && (b->type == array_chunk) &&
+      (a->card + b->card <= ARRAY_MAX)) {
+    unsigned short * av = a->vals;
+    const int an = a->n;
+    int j;
+
+    a->vals = NULL;
+    a->n = a->size = 0;
+    grow_vals(a, an + b->n);
+    for (i = j = 0; (i < an) || (j < b->n); ) {
+      int v;
+
+           if (j >= b->n) v = av[i++];
+      else if (i >= an) v = b->vals[j++];
+      else if (av[i] < b->vals[j]) v = av[i++];
+      else if (av[i] > b->vals[j]) v = b->vals[j++];
+      else { v = av[i++]; j++; }
+      a->vals[a->n++] = v;
+      }
+    a->card = a->n;
+    if (av != NULL) free(av);
+    return;
+    }
+
+  to_bitmap(a);
+  if (b->type == bitmap_chunk)
+    for (i = 0; i < (int) BITMAP_WORDS; i++) a->bits[i] |= b->bits[i];
+  else if (b->type == array_chunk)
+    for (i = 0; i < b->n; i++) set_bit(a->bits, b->vals[i]);
+  else
+    for (i = 0; i < b->n; i++)
+      set_range(a->bits, run_start(b, i), run_end(b, i));
+  a->card = count_bits(a->bits);
+
+  } /* union_chunk */
+
+
+
+static void intersect_chunk(eset_chunk a, const eset_chunk b) {
+
+  /* Remove from a the members not in b. */
+
+  int i, j;
+
+  if (a->type == array_chunk) {
+
+    /* Filter the array in place. */
+
+    for (i = j = 0; i < a->n; i++)
+      if (has_value(b, a->vals[i])) a->vals[j++] = a->vals[i];
+    a->n = a->card = j;
+    }
+
+  else if (b->type == array_chunk) {
+
+    /* The result is no bigger than b's array. */
+
+    Eset_chunk r;
+
+    memset((char *) &r, 0, sizeof(r));
+    r.key = a->key;
+    r.type = array_chunk;
+    grow_vals(&r, b->n ? b->n : 1);
+    for (i = 0; i < b->n; i++)
+      if (has_value(a, b->vals[i])) r.vals[r.n++] = b->vals[i];
+    r.card = r.n;
+    free_chunk(a);
+    *a = r;
+    }
+
+  else if ((a->type == run_chunk) && (b->type == run_chunk)) {
+
+    /* Intersect the runs pairwise. */
+
+    Eset_chunk r;
+
+    memset((char *) &r, 0, sizeof(r));
+    r.key = a->key;
+    r.type = run_chunk;
+    for (i = j = 0; (i < a->n) && (j < b->n); ) {
+      const int
+	lo = max(run_start(a, i), run_start(b, j)),
+	hi = min(run_end(a, i), run_end(b, j));
+
+      if (lo <= hi) {
+	add_run(&r, lo, hi);
+	r.card += hi - lo + 1;
+	}
+      if (run_end(a, i) < run_end(b, j)) i++; else j++;
+      }
+    free_chunk(a);
+    *a = r;
+    }
+
+  else {
+
+    /* Do it with bitmaps. */
+
+    Eset_chunk t;
+
+    copy_chunk(&t, b);
+    to_bitmap(&t);
+    to_bitmap(a);
+    for (i = 0; i < (int) BITMAP_WORDS; i++) a->bits[i] &= t.bits[i];
+    free_chunk(&t);
+    bitmap_done(a);
+    }
+
+  } /* intersect_chunk */
+
+
+
+static void optimize_chunk(eset_chunk c) {
+
+  /* Turn c into a run container if that's smaller. */
+
+  int i, runs, bytes;
+  Eset_chunk r;
+
+  if (c->type == run_chunk) return;
+
+  runs = 0;
+  if (c->type == array_chunk) {
+    for (i = 0; i < c->n; i++)
+      if (!i || (c->vals[i] != c->vals[i - 1] + 1)) runs++;
+    bytes = c->n*sizeof(unsigned short);
+    }
+  else {
+    for (i = 0; i < CHUNK_SIZE; i++)
+      if (has_bit(c->bits, i) && (!i || !has_bit(c->bits, i - 1))) runs++;
+    bytes = BITMAP_WORDS*sizeof(unsigned long);
+    }
+
+  if (2*runs*sizeof(unsigned short) >= (unsigned) bytes) return;
+
+  memset((char *) &r, 0, sizeof(r));
+  r.key = c->key;
+  r.type = run_chunk;
+  r.card = c->card;
+  grow_vals(&r, runs);
+  if (c->type == array_chunk)
+    for (i = 0; i < c->n; i++) add_run(&r, c->vals[i], c->vals[i]);
+  else
+    for (i = 0; i < CHUNK_SIZE; i++)
+      if (has_bit(c->bits, i)) add_run(&r, i, i);
+
+  free_chunk(c);
+  *c = r;
+
+  } /* optimize_chunk */
+
+
+/* ============================== SETS ============================== */
+
+
+static eset_chunk add_chunk(eset s, const int key, const int type) {
+
+  /* Add an empty chunk with the given key and container type to the end of
+     s; return the new chunk. */
+
+  eset_chunk c;
+
+  if (s->count == s->size) {
+    eset_chunk cs;
+
+    s->size = (s->size ? 2*s->size : 4);
+    cs = (eset_chunk) alloc(s->size*sizeof(Eset_chunk));
+    if (s->chunks != NULL) {
+      memcpy((char *) cs, (char *) s->chunks, s->count*sizeof(Eset_chunk));
+      free(s->chunks);
+      }
+    s->chunks = cs;
+    }
+
+  c = s->chunks + s->count++;
+  memset((char *) c, 0, sizeof(Eset_chunk));
+  c->key = key;
+  c->type = type;
+
+  return c;
+
+  } /* add_chunk */
+
+
+
+eset new_eset(void) {
+
+  /* Return a new, empty set. */
+
+  eset s = (eset) alloc(sizeof(Eset));
+
+  s->count = s->size = 0;
+  s->chunks = NULL;
+
+  return s;
+
+  } /* new_eset */
+
+
+
+eset full_eset(const int n) {
+
+  /* Return a new set containing 0 through n - 1. */
+
+  eset s = new_eset();
+  long base;
+
+  for (base = 0; base < n; base += CHUNK_SIZE) {
+    eset_chunk c = add_chunk(s, base >> CHUNK_BITS, run_chunk);
+    const int end = (n - base > CHUNK_SIZE ? CHUNK_SIZE : n - base) - 1;
+
+    add_run(c, 0, end);
+    c->card = end + 1;
+    }
+
+  return s;
+
+  } /* full_eset */
+
+
+
+void free_eset(eset s) {
+
+  /* Free s. */
+
+  int i;
+
+  for (i = 0; i < s->count; i++) free_chunk(s->chunks + i);
+  if (s->chunks != NULL) free(s->chunks);
+  free(s);
+
+  } /* free_eset */
+
+
+
+void append_eset(eset s, const int v) {
+
+  /* Add v to s; v must be larger than any member of s. */
+
+  const int key = v >> CHUNK_BITS, low = v & (CHUNK_SIZE - 1);
+  eset_chunk c;
+
+  if (!s->count || (s->chunks[s->count - 1].key != key))
+    c = add_chunk(s, key, array_chunk);
+  else
+    c = s->chunks + s->count - 1;
+
+  if ((c->type == array_chunk) && (c->n == ARRAY_MAX)) to_bitmap(c);
+
+  if (c->type == array_chunk) {
+    grow_vals(c, c->n + 1);
+    c->vals[c->n++] = low;
+    }
+  else if (c->type == bitmap_chunk) set_bit(c->bits, low);
+  else add_run(c, low, low);
+  c->card++;
+
+  } /* append_eset */
+
+
+
+void union_eset(eset a, const eset b) {
+
+  /* Add the members of b to a. */
+
+  Eset r;
+  int i, j;
+
+  r.count = r.size = 0;
+  r.chunks = NULL;
+
+  for (i = j = 0; (i < a->count) || (j < b->count); ) {
+    eset_chunk c;
+
+    if ((j >= b->count) ||
+	((i < a->count) && (a->chunks[i].key < b->chunks[j].key))) {
+      c = add_chunk(&r, 0, 0);
+      *c = a->chunks[i++];
+      }
+    else if ((i >= a->count) || (b->chunks[j].key < a->chunks[i].key)) {
+      c = add_chunk(&r, 0, 0);
+      copy_chunk(c, b->chunks + j++);
+      }
+    else {
+      c = add_chunk(&r, 0, 0);
+      *c = a->chunks[i++];
+      union_chunk(c, b->chunks + j++);
+      }
+    }
+
+  if (a->chunks != NULL) free(a->chunks);
+  *a = r;
+
+  } /* union_eset */
+
+
+
+void intersect_eset(eset a, const eset b) {
+
+  /* Remove from a the members that aren't in b. */
+
+  int i, j, k;
+
+  for (i = j = k = 0; i < a->count; i++) {
+    eset_chunk c = a->chunks + i;
+
+    while ((j < b->count) && (b->chunks[j].key < c->key)) j++;
+    if ((j < b->count) && (b->chunks[j].key == c->key))
+      intersect_chunk(c, b->chunks + j);
+    else
+      c->card = 0;
+
+    if (c->card) a->chunks[k++] = *c;
+    else free_chunk(c);
+    }
+  a->count = k;
+
+  } /* intersect_eset */
+
+
+
+void optimize_eset(eset s) {
+
+  /* Use run containers wherever they're smaller. */
+
+  int i;
+
+  for (i = 0; i < s->count; i++) optimize_chunk(s->chunks + i);
+
+  } /* optimize_eset */
+
+
+
+int count_eset(const eset s) {
+
+  /* Return the number of members in s. */
+
+  int i, n = 0;
+
+  for (i = 0; i < s->count; i++) n += s->chunks[i].card;
+
+  return n;
+
+  } /* count_eset */
+
+
+
+void start_eset(const eset s, Eset_iter * it) {
+
+  /* Set it to run through the members of s in increasing order. */
+
+  it->s = s;
+  it->chunk = it->i = it->run = 0;
+
+  } /* start_eset */
+
+
+
+bool next_eset(Eset_iter * it, int * v) {
+
+  /* Store the next member of it's set in v; return false if there isn't
+     one. */
+
+  while (it->chunk < it->s->count) {
+    const eset_chunk c = it->s->chunks + it->chunk;
+    const int base = c->key << CHUNK_BITS;
+
+    if (c->type == array_chunk) {
+      if (it->i < c->n) {
+	*v = base + c->vals[it->i++];
+	return true;
+	}
+      }
+    else if (c->type == bitmap_chunk) {
+      while (it->i < CHUNK_SIZE) {
+	if (!(it->i % WORD_BITS) && !c->bits[it->i/WORD_BITS]) {
+	  it->i += WORD_BITS;
+	  continue;
+	  }
+	if (has_bit(c->bits, it->i)) {
+	  *v = base + it->i++;
+	  return true;
+	  }
+	it->i++;
+	}
+      }
+    else if (it->run < c->n) {
+      *v = base + run_start(c, it->run) + it->i;
+      if (run_start(c, it->run) + it->i++ == run_end(c, it->run)) {
+	it->run++;
+	it->i = 0;
+	}
+      return true;
+      }
+
+    it->chunk++;
+    it->i = it->run = 0;
+    }
+
+  return false;
+
+  } /* next_eset */
@@ -0,0 +1,45 @@
+#ifndef _entry_set_h_defined
+#define _entry_set_h_defined
+
+#include "common.h"
+
+/* A set of entry numbers.  The numbers are split into chunks of 2^16
+   consecutive values, and each non-empty chunk is held in whichever of three
+   containers suits it: a sorted array when the chunk is sparse, a bitmap when
+   it's dense, or a list of runs when its members are clustered.  The cost of
+   an operation is roughly proportional to the sizes of the containers
+   involved, not to the range of the numbers. */
+
+   typedef struct Eset_chunk * eset_chunk;
+
+   typedef struct {
+     int        count;		/* number of chunks */
+     int        size;		/* allocated size of chunks */
+     eset_chunk chunks;		/* in increasing key order */
+     } Eset, * eset;
+
+   typedef struct {
+     eset s;
+     int  chunk;
+     int  i, run;
+     } Eset_iter;
+
+extern eset
+  new_eset(void),
+  full_eset(const int);
+
+extern void
+  free_eset(eset),
+  append_eset(eset, const int),
+  union_eset(eset, const eset),
+  intersect_eset(eset, const eset),
+  optimize_eset(eset),
+  start_eset(const eset, Eset_iter *);
+
+extern bool
+  next_eset(Eset_iter *, int *);
+
+extern int
+  count_eset(const eset);
+
+#endif
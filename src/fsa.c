@@ -0,0 +1,467 @@
+#include "fsa.h"
+#include "bix.h"
+
+#  define min(_a, _b) \
+     ((_a) > (_b) ? (_b) : (_a))
+
+/* The stored form.  A state is
+
+	# arcs, times two, plus one if the state is final
+	array of arcs			-- in increasing label order
+	    label			-- one byte
+	    output			-- not for the first arc
+	    offset of the state less offset of the arc's target
+
+   All the numbers but the labels are variable-byte integers (see bix.c).  A
+   state is stored after every state it leads to, so the targets' offsets are
+   always less than the state's.  The ordinal of a word is the sum of the
+   outputs on its path; an arc's output is the number of words accepted before
+   the arc is taken: one if the state's final, plus the words accepted through
+   the state's earlier arcs.  The first arc's output is implied by the state's
+   finality.  The number of words accepted from a state isn't stored; it's the
+   difference between the outputs of the arc leading to the state and the arc
+   after it, or, for a state's last arc, what's left of the state's own
+   count. */
+
+#  define LABELS 256
+
+   typedef struct {
+     int label;
+     int target;	/* offset of the target state, once stored */
+     int count;		/* words accepted from the target */
+     } Arc;
+
+/* The builder keeps the path spelling the last word added; path[d] is the
+   state reached after the word's first d characters.  The states along the
+   path may still get arcs, so they're held open.  When a word arrives, the
+   open states past the prefix it shares with the last word can't change any
+   more and are closed.  A closing state equal to a stored state (equally
+   final with the same arcs) is replaced by it; otherwise it's stored and
+   entered in the register. */
+
+   typedef struct {
+     bool final;
+     int  narcs;
+     Arc  arcs[LABELS];
+     } Open_state;
+
+   typedef struct {
+     int           offset;	/* of the stored state, -1 if the slot's empty */
+     unsigned long hash;
+     } Slot;
+
+   struct Fsa_builder {
+     Open_state      path[MAXWORD + 1];
+     char            last[MAXWORD + 1];
+     unsigned char * data;	/* the stored states */
+     int             size,
+                     space;
+     Slot          * slots;	/* the register, open addressed */
+     int             nslots,
+                     used;
+     };
+
+
+static unsigned long hash_state(const Open_state * s) {
+
+  /* Return a hash of the given state's finality and arcs. */
+
+  unsigned long h = s->final;
+  int i;
+
+  for (i = 0; i < s->narcs; i++)
+    h = (h*31 + s->arcs[i].label)*1000003 + s->arcs[i].target;
+
+  return h;
+
+  } /* hash_state */
+
+
+
+static const unsigned char * get_state(
+  const unsigned char * data, int size, int offset, int * final, int * narcs) {
+
+  /* Decode the header of the state stored at offset in the size-byte data;
+     return a pointer to the state's arcs, or null if there's no such
+     state. */
+
+  const unsigned char * p;
+  unsigned long v;
+
+  if ((offset < 0) || (offset >= size)) return NULL;
+
+  p = bix_get_varint(data + offset, &v);
+  *final = v & 1;
+  *narcs = v >> 1;
+
+  return p;
+
+  } /* get_state */
+
+
+
+static const unsigned char * get_arc(
+  const unsigned char * p, int offset, bool first, int * label, int * output,
+  int * target) {
+
+  /* Decode the arc at p, which belongs to the state stored at offset; return
+     a pointer to the next arc.  If the arc's the state's first, *output
+     should hold whether the state's final. */
+
+  unsigned long v;
+
+  *label = *p++;
+  if (!first) {
+    p = bix_get_varint(p, &v);
+    *output = v;
+    }
+  p = bix_get_varint(p, &v);
+  *target = (v > 0) ? offset - (int) v : -1;
+
+  return p;
+
+  } /* get_arc */
+
+
+
+static bool same_state(fsa_builder b, int offset, const Open_state * s) {
+
+  /* Return true iff the state stored at offset is equal to s. */
+
+  const unsigned char * p;
+  int final, narcs, i, label, output, target;
+
+  p = get_state(b->data, b->size, offset, &final, &narcs);
+  if ((final != s->final) || (narcs != s->narcs)) return false;
+
+  for (i = 0, output = final; i < narcs; i++) {
+    p = get_arc(p, offset, i == 0, &label, &output, &target);
+    if ((label != s->arcs[i].label) || (target != s->arcs[i].target))
+      return false;
+    }
+
+  return true;
+
+  } /* same_state */
+
+
+
+static void grow_register(fsa_builder b) {
+
+  /* Double the size of b's register. */
+
+  Slot * old = b->slots;
+  const int oldn = b->nslots;
+  int i;
+
+  b->nslots = oldn ? 2*oldn : 1024;
+  b->slots = (Slot *) alloc(b->nslots*sizeof(Slot));
+  for (i = 0; i < b->nslots; i++) b->slots[i].offset = -1;
+
+  for (i = 0; i < oldn; i++)
+    if (old[i].offset != -1) {
+      int j = old[i].hash & (b->nslots - 1);
+
+      while (b->slots[j].offset != -1) j = (j + 1) & (b->nslots - 1);
+      b->slots[j] = old[i];
+      }
+
+  if (old != NULL) free(old);
+
+  } /* grow_register */
+
+
+
+static int store_state(fsa_builder b, const Open_state * s, int * count) {
+
+  /* Close s, returning the offset of the stored state equal to it and the
+     number of words it accepts in *count. */
+
+  const unsigned long h = hash_state(s);
+  int i, j, offset, output;
+
+  for (i = 0, *count = s->final; i < s->narcs; i++)
+    *count += s->arcs[i].count;
+
+  if (2*(b->used + 1) > b->nslots) grow_register(b);
+  for (j = h & (b->nslots - 1); b->slots[j].offset != -1;
+       j = (j + 1) & (b->nslots - 1))
+    if ((b->slots[j].hash == h) && same_state(b, b->slots[j].offset, s))
+      return b->slots[j].offset;
+
+  if (b->size + 20 + 16*s->narcs > b->space) {
+    unsigned char * d;
+
+    b->space = 2*b->space + 20 + 16*s->narcs;
+    d = (unsigned char *) alloc(b->space);
+    if (b->data != NULL) {
+      memcpy((char *) d, (char *) b->data, b->size);
+      free(b->data);
+      }
+    b->data = d;
+    }
+
+  offset = b->size;
+  b->size += bix_put_varint(b->data + b->size, 2*s->narcs + s->final);
+  for (i = 0, output = s->final; i < s->narcs; i++) {
+    b->data[b->size++] = s->arcs[i].label;
+    if (i > 0) b->size += bix_put_varint(b->data + b->size, output);
+    b->size += bix_put_varint(b->data + b->size, offset - s->arcs[i].target);
+    output += s->arcs[i].count;
+    }
+
+  b->slots[j].offset = offset;
+  b->slots[j].hash = h;
+  b->used++;
+
+  return offset;
+
+  } /* store_state */
+
+
+
+static void close_path(fsa_builder b, int depth) {
+
+  /* Close the open states on b's path deeper than depth. */
+
+  int d;
+
+  for (d = strlen(b->last); d > depth; d--) {
+    Open_state * up = b->path + d - 1;
+    Arc * a = up->arcs + up->narcs - 1;
+
+    a->target = store_state(b, b->path + d, &(a->count));
+    }
+
+  } /* close_path */
+
+
+
+fsa_builder new_fsa_builder(void) {
+
+  /* Return a builder for an automaton accepting no words. */
+
+  fsa_builder b = (fsa_builder) alloc(sizeof(struct Fsa_builder));
+
+  b->path[0].final = false;
+  b->path[0].narcs = 0;
+  b->last[0] = eos;
+  b->data = NULL;
+  b->size = b->space = 0;
+  b->slots = NULL;
+  b->nslots = b->used = 0;
+  grow_register(b);
+
+  return b;
+
+  } /* new_fsa_builder */
+
+
+
+void add_fsa_builder(fsa_builder b, const char * word) {
+
+  /* Add word, which follows every word already added in strcmp() order, to
+     the words b's automaton accepts. */
+
+  const int len = strlen(word);
+  int d;
+
+  assert(len <= MAXWORD);
+  assert(!b->last[0] || (strcmp(b->last, word) < 0));
+
+  for (d = 0; b->last[d] && (b->last[d] == word[d]); d++) { }
+  close_path(b, d);
+
+  for (; d < len; d++) {
+    Open_state * s = b->path + d;
+
+    s->arcs[s->narcs].label = (unsigned char) word[d];
+    s->narcs++;
+    b->path[d + 1].final = false;
+    b->path[d + 1].narcs = 0;
+    }
+  b->path[len].final = true;
+
+  strcpy(b->last, word);
+
+  } /* add_fsa_builder */
+
+
+
+const unsigned char * end_fsa_builder(fsa_builder b, int * size, int * root) {
+
+  /* Finish b's automaton; return the stored automaton, which is *size bytes
+     with the start state at offset *root.  The bytes belong to b. */
+
+  int count;
+
+  close_path(b, 0);
+  *root = store_state(b, b->path, &count);
+  *size = b->size;
+
+  return b->data;
+
+  } /* end_fsa_builder */
+
+
+
+void free_fsa_builder(fsa_builder b) {
+
+  /* Free b and its stored automaton. */
+
+  if (b->data != NULL) free(b->data);
+  free(b->slots);
+  free(b);
+
+  } /* free_fsa_builder */
+
+
+
+static bool walk(
+  const Fsa * a, const char * word, int * offset, int * ord, int * n) {
+
+  /* Follow word from a's start state; if its path exists, return true with
+     the offset of the state reached in *offset, the sum of the outputs along
+     the path in *ord, and the number of words accepted from the state in
+     *n. */
+
+  int final, narcs, i, label, output, target;
+
+  *offset = a->root;
+  *ord = 0;
+  *n = a->words;
+
+  for (; *word; word++) {
+    const int c = (unsigned char) *word;
+    const unsigned char * p =
+      get_state(a->data, a->size, *offset, &final, &narcs);
+
+    if (p == NULL) return false;
+    for (i = 0, output = final; i < narcs; i++) {
+      p = get_arc(p, *offset, i == 0, &label, &output, &target);
+      if (label >= c) break;
+      }
+    if ((i == narcs) || (label != c)) return false;
+
+    if (i + 1 < narcs) {
+      int next, ignore;
+
+      get_arc(p, *offset, false, &ignore, &next, &ignore);
+      *n = next - output;
+      }
+    else *n -= output;
+    *offset = target;
+    *ord += output;
+    }
+
+  return true;
+
+  } /* walk */
+
+
+
+bool find_fsa(const Fsa * a, const char * word, int * ordinal) {
+
+  /* Return true iff a accepts word, storing the word's ordinal in
+     *ordinal. */
+
+  int offset, final, narcs, n;
+
+  if (!walk(a, word, &offset, ordinal, &n) ||
+      !get_state(a->data, a->size, offset, &final, &narcs))
+    return false;
+
+  return final;
+
+  } /* find_fsa */
+
+
+
+bool prefix_fsa(const Fsa * a, const char * prefix, int * first, int * n) {
+
+  /* Return true iff a accepts a word starting with prefix.  The *n words
+     that do have ordinals starting at *first. */
+
+  int offset;
+
+  return walk(a, prefix, &offset, first, n) && (*n > 0);
+
+  } /* prefix_fsa */
+
+
+
+/* Approximate matching.  The automaton is searched depth first, keeping the
+   row of the edit-distance table between the query word and each path
+   followed.  A path is abandoned as soon as every entry in its row exceeds
+   the allowed edits, since extending it can only make things worse. */
+
+   typedef struct {
+     const Fsa  * a;
+     const char * word;
+     int          len,
+                  edits,
+                * rows;		/* one row of len + 1 per depth */
+     void      (* found)(int, void *);
+     void       * arg;
+     } Near;
+
+
+static void near_state(const Near * n, int offset, int ord, int depth) {
+
+  /* Report the words accepted from the state at offset, reached along a path
+     of length depth with outputs summing to ord, that are close enough to
+     the query word. */
+
+  const int * up = n->rows + depth*(n->len + 1);
+  int * row = n->rows + (depth + 1)*(n->len + 1);
+  int final, narcs, i, j, label, output, target;
+  const unsigned char * p =
+    get_state(n->a->data, n->a->size, offset, &final, &narcs);
+
+  if (p == NULL) return;
+  if (final && (up[n->len] <= n->edits)) n->found(ord, n->arg);
+  if (depth >= MAXWORD) return;
+
+  for (i = 0, output = final; i < narcs; i++) {
+    int best;
+
+    p = get_arc(p, offset, i == 0, &label, &output, &target);
+    best = row[0] = up[0] + 1;
+    for (j = 1; j <= n->len; j++) {
+      const int c = (unsigned char) n->word[j - 1];
+
+      row[j] = min(min(up[j], row[j - 1]) + 1, up[j - 1] + (c != label));
+      best = min(best, row[j]);
+      }
+    if (best <= n->edits) near_state(n, target, ord + output, depth + 1);
+    }
+
+  } /* near_state */
+
+
+
+void near_fsa(
+  const Fsa * a, const char * word, int edits, void (* found)(int, void *),
+  void * arg) {
+
+  /* Call found(ordinal, arg) for each word a accepts that's no more than edits
+     insertions, deletions or substitutions away from word, in increasing
+     ordinal order. */
+
+  Near n;
+  int j;
+
+  n.a = a;
+  n.word = word;
+  n.len = strlen(word);
+  n.edits = edits;
+  n.found = found;
+  n.arg = arg;
+  if (n.len > MAXWORD + edits) return;
+
+  n.rows = (int *) alloc((MAXWORD + 2)*(n.len + 1)*sizeof(int));
+  for (j = 0; j <= n.len; j++) n.rows[j] = j;
+  near_state(&n, a->root, 0, 0);
+  free(n.rows);
+
+  } /* near_fsa */
@@ -0,0 +1,36 @@
+#ifndef _fsa_h_defined
+#define _fsa_h_defined
+
+#include "common.h"
+
+/* A minimal acyclic automaton accepting the words of a dictionary.  It's
+   built from the words in strcmp() order and stored as bytes that can be
+   searched in place.  Each word is mapped to its ordinal, its position in
+   the dictionary counting from 0, so the words having a given prefix are a
+   range of ordinals.  See fsa.c for the stored form. */
+
+   typedef struct {
+     const unsigned char * data;	/* the stored automaton */
+     int                   size;	/* in bytes */
+     int                   root;	/* offset of the start state in data */
+     int                   words;	/* the number of words accepted */
+     } Fsa;
+
+   typedef struct Fsa_builder * fsa_builder;
+
+extern fsa_builder
+  new_fsa_builder(void);
+
+extern void
+  add_fsa_builder(fsa_builder, const char *),
+  free_fsa_builder(fsa_builder),
+  near_fsa(const Fsa *, const char *, int, void (*)(int, void *), void *);
+
+extern const unsigned char
+  * end_fsa_builder(fsa_builder, int *, int *);
+
+extern bool
+  find_fsa(const Fsa *, const char *, int *),
+  prefix_fsa(const Fsa *, const char *, int *, int *);
+
+#endif
@@ -0,0 +1,168 @@
+#include "lz.h"
+#include "bix.h"
+
+#  define min(_a, _b) \
+     ((_a) > (_b) ? (_b) : (_a))
+
+/* The stored form.  A compressed run is a sequence of
+
+	token				-- one byte
+	    # literal bytes		-- high four bits
+	    match length, less four	-- low four bits
+	rest of the # literal bytes	-- if the count is 15 or more
+	the literal bytes
+	rest of the match length	-- ditto, not after the last literals
+	match distance			-- not after the last literals
+
+   where the rests and the distance are variable-byte integers (see bix.c); a
+   count too big for its four bits is stored as 15 plus the rest.  A match
+   repeats the match-length bytes starting match-distance bytes back in the
+   expanded text, so it may overlap itself.  The expanded length isn't stored;
+   expansion stops when that many bytes have been produced. */
+
+#  define LZ_MINMATCH 4
+
+/* Earlier occurrences of each four-byte string are found through a hash table
+   of chains; only the latest LZ_CHAIN occurrences are tried. */
+
+#  define LZ_HASHBITS 14
+#  define LZ_CHAIN    32
+
+#  define lz_hash(_p) \
+     ((((((unsigned long) (_p)[0] << 24) | ((unsigned long) (_p)[1] << 16) | \
+	  ((unsigned long) (_p)[2] << 8) | (unsigned long) (_p)[3]) \
+	* 2654435761UL) & 0xffffffffUL) >> (32 - LZ_HASHBITS))
+
+
+static int put_sequence(
+  unsigned char * out, const unsigned char * lit, int nlit, int len,
+  int dist) {
+
+  /* Store the nlit literal bytes at lit and a match of len bytes dist bytes
+     back at out; return the bytes used.  The last sequence has no match, and
+     len is 0. */
+
+  int size = 1;
+
+  if (len > 0) len -= LZ_MINMATCH;
+  *out = (unsigned char) ((min(nlit, 15) << 4) | min(len, 15));
+  if (nlit >= 15) size += bix_put_varint(out + size, nlit - 15);
+  memcpy((char *) out + size, (char *) lit, nlit);
+  size += nlit;
+  if (dist > 0) {
+    if (len >= 15) size += bix_put_varint(out + size, len - 15);
+    size += bix_put_varint(out + size, dist);
+    }
+
+  return size;
+
+  } /* put_sequence */
+
+
+
+int lz_compress(unsigned char * out, const unsigned char * in, int n) {
+
+  /* Compress the n bytes at in to out, which has room for lz_bound(n) bytes;
+     return the size of the compressed bytes. */
+
+  int * head = (int *) alloc((1 << LZ_HASHBITS)*sizeof(int)),
+      * prev = (int *) alloc((n > 0 ? n : 1)*sizeof(int)),
+      i = 0, lit = 0, size = 0, k;
+
+  for (k = 0; k < (1 << LZ_HASHBITS); k++) head[k] = -1;
+
+  while (i + LZ_MINMATCH <= n) {
+    const unsigned long h = lz_hash(in + i);
+    int j, depth, best = 0, dist = 0;
+
+    /* Find the longest earlier match for the bytes at i. */
+
+    for (j = head[h], depth = 0; (j >= 0) && (depth < LZ_CHAIN);
+	 j = prev[j], depth++) {
+      if (in[j + best] != in[i + best]) continue;
+      for (k = 0; (i + k < n) && (in[j + k] == in[i + k]); k++) { }
+      if (k > best) {
+	best = k;
+	dist = i - j;
+	if (i + k == n) break;
+	}
+      }
+    prev[i] = head[h];
+    head[h] = i;
+
+    /* A match is taken only if it's longer than its token and distance. */
+
+    if ((best < LZ_MINMATCH) || (best <= bix_put_varint(NULL, dist) + 1)) {
+      i++;
+      continue;
+      }
+
+    size += put_sequence(out + size, in + lit, i - lit, best, dist);
+
+    for (k = i + 1; (k < i + best) && (k + LZ_MINMATCH <= n); k++) {
+      const unsigned long g = lz_hash(in + k);
+
+      prev[k] = head[g];
+      head[g] = k;
+      }
+    i += best;
+    lit = i;
+    }
+
+  if (lit < n) size += put_sequence(out + size, in + lit, n - lit, 0, 0);
+
+  free(head);
+  free(prev);
+
+  return size;
+
+  } /* lz_compress */
+
+
+
+bool lz_expand(
+  unsigned char * out, int n, const unsigned char * in, int size) {
+
+  /* Expand the size compressed bytes at in into the n bytes at out; return
+     false if the compressed bytes don't expand to exactly n bytes. */
+
+  const unsigned char * end = in + size;
+  int o = 0;
+
+  while (o < n) {
+    unsigned long lit, len, dist;
+
+    if (in >= end) return false;
+    lit = *in >> 4;
+    len = *in++ & 15;
+    if (lit == 15) {
+      if (in >= end) return false;
+      in = bix_get_varint(in, &lit);
+      lit += 15;
+      }
+    if ((lit > (unsigned long) (n - o)) || (lit > (unsigned long) (end - in)))
+      return false;
+    memcpy((char *) out + o, (char *) in, (int) lit);
+    o += lit;
+    in += lit;
+    if (o == n) break;
+
+    if (len == 15) {
+      if (in >= end) return false;
+      in = bix_get_varint(in, &len);
+      len += 15;
+      }
+    if (in >= end) return false;
+    in = bix_get_varint(in, &dist);
+    len += LZ_MINMATCH;
+    if ((dist == 0) || (dist > (unsigned long) o) ||
+	(len > (unsigned long) (n - o)))
+      return false;
+    if (dist >= len) memcpy((char *) out + o, (char *) out + o - dist, len);
+    else for (; len > 0; len--, o++) out[o] = out[o - dist];
+    o += len;
+    }
+
+  return in == end;
+
+  } /* lz_expand */
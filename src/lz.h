@@ -0,0 +1,21 @@
+#ifndef _lz_h_defined
+#define _lz_h_defined
+
+#include "common.h"
+
+/* A small LZ77 compressor for runs of bib file text.  Each run is compressed
+   on its own and expanded all at once; the caller keeps the expanded length.
+   See lz.c for the stored form. */
+
+/* Return the most bytes compressing _n bytes can take. */
+
+#  define lz_bound(_n) \
+     ((_n) + (_n)/2 + 16)
+
+extern int
+  lz_compress(unsigned char *, const unsigned char *, int);
+
+extern bool
+  lz_expand(unsigned char *, int, const unsigned char *, int);
+
+#endif
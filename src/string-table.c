@@ -2,61 +2,210 @@
 #include "string-table.h"
 
 
-/* The string table. */
+/* The string table.  The strings are kept in the order they're first defined
+   and found through a hash table of entry numbers using linear probing; the
+   table doubles whenever it's half full.  Each entry keeps its name's hash to
+   save comparing names and to rehash without rereading them.  Redefining a
+   string replaces its text in the entry it already has.
 
-   typedef struct Strtbl_entry * strtbl_entry;
+   The names and texts are copied into large blocks freed together when the
+   table's emptied, rather than into a pair of allocations per string.  A
+   redefined string's old text stays in its block until then.
 
-   typedef struct Strtbl_entry {
+   keep_strtbl() makes the strings in the table, and their texts, the ones
+   clear_strtbl() empties it back to, along with the blocks holding them. */
+
+   typedef struct {
      char * name;
      char * str;
-     strtbl_entry next;
+     unsigned long hash;
      } Strtbl_entry;
 
-   static Strtbl_entry string_table = {"", NULL};
+   static Strtbl_entry * entries = NULL;
+   static int numentries = 0, entryspace = 0;
+
+   static int * slots = NULL;		/* entry numbers, -1 if empty */
+   static int numslots = 0;		/* a power of two */
+
+#  define STRTBL_BLOCK 16384
+
+   typedef struct Strtbl_block * strtbl_block;
+
+   typedef struct Strtbl_block {
+     strtbl_block next;
+     int used, size;
+     char text[1];
+     } Strtbl_block;
+
+   static strtbl_block blocks = NULL;
+
+   static char ** keptstrs = NULL;	/* the kept entries' texts */
+   static int numkept = 0, keptslots = 0;
+   static strtbl_block keptblock = NULL;	/* and the last block's use */
+   static int keptused = 0;
+
+
+static unsigned long hash_name(const char * nm) {
+
+  /* Return the hash of nm. */
+
+  unsigned long hash = 2166136261UL;
+
+  while (*nm != eos)
+    hash = ((hash ^ (unsigned char) *nm++)*16777619UL) & 0xffffffffUL;
+
+  return hash;
+
+  } /* hash_name */
 
 
-void clear_strtbl() {
 
-  /* Empty the string table. */
+static char * copy_strtbl(const char * str) {
 
-  strtbl_entry ste = string_table.next;
+  /* Return a copy of str in the current block, starting a new block if it
+     doesn't fit. */
 
-  while (ste != NULL) {
-    strtbl_entry ste2 = ste->next;
+  const int n = strlen(str) + 1;
+  char * s;
 
-    free(ste->str);
-    free(ste->name);
-    memset((char *) ste, 0, sizeof(Strtbl_entry));
-    free((char *) ste);
-    
-    ste = ste2;
+  if ((blocks == NULL) || (blocks->used + n > blocks->size)) {
+    const int size = n > STRTBL_BLOCK ? n : STRTBL_BLOCK;
+    strtbl_block b = (strtbl_block) alloc(sizeof(Strtbl_block) + size);
+
+    b->next = blocks;
+    b->used = 0;
+    b->size = size;
+    blocks = b;
     }
 
-  memset((char *) &string_table, 0, sizeof(Strtbl_entry));
+  s = blocks->text + blocks->used;
+  memcpy(s, str, n);
+  blocks->used += n;
+
+  return s;
+
+  } /* copy_strtbl */
+
+
+
+static int * find_slot(const char * nm, unsigned long hash) {
+
+  /* Return the slot holding nm, which has the given hash, or the empty slot
+     where it would go. */
+
+  int i = hash & (numslots - 1);
+
+  while (slots[i] >= 0) {
+    const Strtbl_entry * e = entries + slots[i];
+
+    if ((e->hash == hash) && !strcmp(e->name, nm)) break;
+    i = (i + 1) & (numslots - 1);
+    }
+
+  return slots + i;
+
+  } /* find_slot */
+
+
+
+static void rehash_strtbl(int size) {
+
+  /* Make the hash table size slots, a power of two, and put the entries
+     back into it. */
+
+  int i;
+
+  if (size != numslots) {
+    free(slots);
+    numslots = size;
+    slots = (int *) alloc(numslots*sizeof(int));
+    }
+  for (i = 0; i < numslots; i++) slots[i] = -1;
+
+  for (i = 0; i < numentries; i++)
+    *find_slot(entries[i].name, entries[i].hash) = i;
+
+  } /* rehash_strtbl */
+
+
+
+void clear_strtbl() {
+
+  /* Empty the string table, back to the strings kept, if any. */
+
+  int i;
+
+  while (blocks != keptblock) {
+    strtbl_block b = blocks->next;
+
+    free(blocks);
+    blocks = b;
+    }
+  if (blocks != NULL) blocks->used = keptused;
+
+  for (i = 0; i < numkept; i++) entries[i].str = keptstrs[i];
+  numentries = numkept;
+
+  if (numkept > 0) rehash_strtbl(keptslots);
+  else {
+    free(entries);
+    free(slots);
+    entries = NULL;
+    slots = NULL;
+    entryspace = numslots = 0;
+    }
 
   } /* clear_strtbl */
 
 
 
+void keep_strtbl() {
+
+  /* Keep the strings now in the string table when it's emptied. */
+
+  int i;
+
+  free(keptstrs);
+  keptstrs = (char **) alloc((numentries > 0 ? numentries : 1)*sizeof(char *));
+  for (i = 0; i < numentries; i++) keptstrs[i] = entries[i].str;
+  numkept = numentries;
+  keptslots = numslots;
+  keptblock = blocks;
+  keptused = (blocks != NULL) ? blocks->used : 0;
+
+  } /* keep_strtbl */
+
+
+
 void add_strtbl(const char * nm, const char * str) {
 
   /* Assoicate str with nm in the string table, superceeding any previous
      associations for nm.  */
 
-  strtbl_entry ste;
-  strtbl_entry nste = (strtbl_entry) malloc(sizeof(Strtbl_entry));
+  const unsigned long hash = hash_name(nm);
+  int * slot;
 
-  assert(nste);
+  if (2*(numentries + 1) > numslots)
+    rehash_strtbl(numslots ? 2*numslots : 64);
 
-  for (ste = &string_table;
-       (ste->next != NULL) && (strcmp(nm, ste->next->name) > 0);
-       ste = ste->next) {};
+  slot = find_slot(nm, hash);
+  if (*slot >= 0) {
+    entries[*slot].str = copy_strtbl(str);
+    return;
+    }
+
+  if (numentries == entryspace) {
+    entryspace = entryspace ? 2*entryspace : 64;
+    entries = (Strtbl_entry *)
+      realloc(entries, entryspace*sizeof(Strtbl_entry));
+    assert(entries);
+    }
+
+  entries[numentries].name = copy_strtbl(nm);
+  entries[numentries].str = copy_strtbl(str);
+  entries[numentries].hash = hash;
+  *slot = numentries++;
 
-  nste->name = strdupl(nm);
-  nste->str = strdupl(str);
-  nste->next = ste->next;
-  ste->next = nste;
-  
   } /* add_strtbl */
 
 
@@ -65,15 +214,12 @@ char * find_strtbl(const char * nm) {
 
   /* Return the string associated with nm or null if there's no such string. */
 
-  strtbl_entry ste;
+  int slot;
 
-  for (ste = string_table.next; ste != NULL; ste = ste->next) {
-    int i = strcmp(nm, ste->name);
+  if (numentries == 0) return NULL;
 
-    if (i == 0) return ste->str;
-    if (i < 0) break;
-    }
+  slot = *find_slot(nm, hash_name(nm));
 
-  return NULL;
+  return slot < 0 ? NULL : entries[slot].str;
 
   } /* find_strtbl */
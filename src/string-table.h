@@ -3,6 +3,7 @@
 
 extern void
    clear_strtbl(void),
+   keep_strtbl(void),
    add_strtbl(const char *, const char *);
   
 extern char 
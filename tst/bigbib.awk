@@ -0,0 +1,18 @@
+# Write a bibliography file of over 2 Mb, big enough for btxindex -j to split
+# between entries.  With at set, most of it is one entry whose lines start with
+# '@', so the split falls inside the entry and the file is read whole instead.
+
+BEGIN {
+  if (at) { n = 2000; lines = 400000 } else { n = 40000; lines = 0 }
+  for (i = 0; i < n; i++) {
+    if (i % 1000 == 0)
+      printf "@string{s%d = \"series %d\"}\n\n", int(i/1000), int(i/1000)
+    printf "@misc{m%d,\n  title = \"Entry %d of many\",\n", i, i
+    printf "  note = s%d # \" w%d\"\n}\n\n", int(i/1000), i % 100
+    }
+  if (lines > 0) {
+    printf "@misc{at,\n  note = \"\n"
+    for (i = 0; i < lines; i++) printf "@ w%d\n", i % 100
+    printf "\"\n}\n"
+    }
+  }